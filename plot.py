@@ -19,7 +19,139 @@ def load_ndfile(filename):
 
 
 
+def load_patches_file(filename):
+    """
+    Load a single-file checkpoint (chkpt.NNNN/patches.dat) into the same
+    nested dict as load_checkpoint. The arrays are read-only memory maps.
+    """
+    import json
+
+    with open(filename, 'rb') as f:
+        if f.read(8) != b'ATMOPTCH':
+            raise ValueError('{} is not a patches file'.format(filename))
+        index_length, data_start = struct.unpack('<QQ', f.read(16))
+        index = json.loads(f.read(index_length).decode('utf-8'))
+
+    database = dict()
+
+    for entry in index['patches']:
+        patch, field = entry['index'].split('/')
+        database.setdefault(patch, dict())[field] = np.memmap(filename,
+            dtype=entry['dtype'],
+            mode='r',
+            offset=data_start + entry['offset'],
+            shape=tuple(entry['shape']))
+
+    return database
+
+
+
+def decode_packbits(data):
+    out = bytearray()
+    i = 0
+
+    while i < len(data):
+        h = data[i]
+        i += 1
+
+        if h < 128:
+            out += data[i:i + h + 1]
+            i += h + 1
+        elif h > 128:
+            out += data[i:i + 1] * (257 - h)
+            i += 1
+
+    return bytes(out)
+
+
+
+def load_snapshot(filename):
+    """
+    Load a compressed snapshot (NNNN.snap) into the same nested dict as
+    load_checkpoint. The conserved variables are widened back to float64,
+    and vert_coords is regenerated from the run config stored in the file.
+    The zstd codec needs the zstandard module.
+    """
+    import json
+
+    with open(filename, 'rb') as f:
+        if f.read(8) != b'ATMOSNAP':
+            raise ValueError('{} is not a snapshot file'.format(filename))
+        index_length, data_start = struct.unpack('<QQ', f.read(16))
+        index = json.loads(f.read(index_length).decode('utf-8'))
+        f.seek(data_start)
+        payload = f.read()
+
+    database = dict()
+
+    for entry in index['patches']:
+        data = payload[entry['offset']:entry['offset'] + entry['nbytes']]
+
+        if entry['codec'] == 'zstd':
+            import zstandard
+            data = zstandard.ZstdDecompressor().decompress(data, max_output_size=entry['rawbytes'])
+        elif entry['codec'] == 'rle':
+            data = decode_packbits(data)
+        else:
+            raise ValueError('unknown codec {}'.format(entry['codec']))
+
+        shuffled = np.frombuffer(data, dtype=np.uint8).reshape(entry['shuffle'], -1)
+        values = np.ascontiguousarray(shuffled.T).view(entry['dtype'])
+        patch, field = entry['index'].split('/')
+        database.setdefault(patch, dict())[field] = values.reshape(entry['shape']).astype(np.float64)
+
+    for patch, pd in database.items():
+        pd['vert_coords'] = mesh_vertices(index['config'], *map(int, patch.split('-')[:2]))
+
+    return database
+
+
+
+def mesh_vertices(config, block, block_j=0):
+    """
+    Regenerate the vertex coordinates of block (block, block_j) from the run
+    config, as create_database does in main.cpp. Checkpoints do not store
+    them.
+    """
+    num_blocks = config['num_blocks']
+    num_blocks_j = config.get('num_blocks_j', 1)
+    outer_radius = config['outer_radius']
+    ni = int(config['nr'] * np.log10(outer_radius) / num_blocks)
+    nr = config['nr']
+    nj = nr // num_blocks_j
+    r0 = outer_radius**((block + 0) / num_blocks)
+    r1 = outer_radius**((block + 1) / num_blocks)
+    i, j = np.meshgrid(np.arange(ni + 1), np.arange(block_j * nj, (block_j + 1) * nj + 1), indexing='ij')
+    X = np.zeros([ni + 1, nj + 1, 2])
+    X[:,:,0] = r0 * (r1 / r0)**(i / ni)
+    X[:,:,1] = np.pi * j / nr
+    return X
+
+
+
 def load_checkpoint(btdir):
+    import json
+
+    if btdir.endswith('.snap'):
+        return load_snapshot(btdir)
+
+    if os.path.isfile(os.path.join(btdir, 'patches.dat')):
+        database = load_patches_file(os.path.join(btdir, 'patches.dat'))
+    else:
+        database = load_checkpoint_tree(btdir)
+
+    with open(os.path.join(btdir, 'config.json')) as f:
+        config = json.load(f)
+
+    for patch, pd in database.items():
+        if 'vert_coords' not in pd:
+            pd['vert_coords'] = mesh_vertices(config, *map(int, patch.split('-')[:2]))
+
+    return database
+
+
+
+def load_checkpoint_tree(btdir):
     database = dict()
 
     for patch in os.listdir(btdir):
@@ -27,6 +159,9 @@ def load_checkpoint(btdir):
         fd = os.path.join(btdir, patch)
         pd = dict()
 
+        if not os.path.isdir(fd):
+            continue
+
         for field in os.listdir(fd):
             fe = os.path.join(fd, field)
             pd[field] = load_ndfile(fe)
@@ -37,6 +172,74 @@ def load_checkpoint(btdir):
 
 
 
+def load_diagnostics(outdir):
+    """
+    Load the in-situ diagnostics time series written to outdir (diagi > 0).
+    Returns the integrals from diagnostics.csv as a dict of 1d arrays, and
+    the records of diagnostics.dat as a dict of 2d arrays, with one row per
+    record, e.g. profiles['shell_density'][n] is the shell-averaged density
+    profile of record n.
+    """
+    import json
+
+    with open(os.path.join(outdir, 'diagnostics.json')) as f:
+        layout = json.load(f)
+
+    series = np.genfromtxt(os.path.join(outdir, 'diagnostics.csv'), delimiter=',', names=True)
+    series = {name: np.atleast_1d(series[name]) for name in series.dtype.names}
+
+    width = sum(count for name, count in layout['fields'])
+    records = np.fromfile(os.path.join(outdir, 'diagnostics.dat'), dtype=layout['dtype']).reshape(-1, width)
+    profiles = dict()
+    offset = 0
+
+    for name, count in layout['fields']:
+        profiles[name] = records[:,offset:offset + count]
+        offset += count
+
+    return series, profiles
+
+
+
+def load_telemetry(filename):
+    """
+    Read the samples currently in a run's telemetry ring (telemetry > 0), which
+    may be live. Returns a dict of 1d arrays, one per field, in the order the
+    samples were published; samples being overwritten during the read are
+    left out.
+    """
+    import json
+
+    with open(filename, 'rb') as f:
+        if f.read(8) != b'ATMOTELE':
+            raise ValueError('{} is not a telemetry file'.format(filename))
+        index_length, data_start = struct.unpack('<QQ', f.read(16))
+        index = json.loads(f.read(index_length).decode('utf-8'))
+        f.seek(data_start)
+        payload = f.read()
+        f.seek(data_start)
+        count_after, = struct.unpack('=Q', f.read(8))
+
+    # Slots of samples that the run may have overwritten while the file was
+    # read are skipped, as are slots whose sequence is not that of a finished
+    # sample m.
+    capacity, nbytes = index['capacity'], index['slot_nbytes']
+    num_fields = len(index['fields'])
+    count, = struct.unpack('=Q', payload[:8])
+    samples = list()
+
+    for m in range(max(0, count - capacity, count_after + 1 - capacity), count):
+        start = index['slots_offset'] + (m % capacity) * nbytes
+        slot = payload[start:start + nbytes]
+
+        if struct.unpack('=Q', slot[:8])[0] == 2 * m + 2:
+            samples.append(np.frombuffer(slot, dtype=index['dtype'], count=num_fields, offset=8))
+
+    samples = np.array(samples).reshape(-1, num_fields)
+    return {name: samples[:,n] for n, name in enumerate(index['fields'])}
+
+
+
 def imshow_database(database, database1):
     from mpl_toolkits.axes_grid1 import make_axes_locatable
     difference = []
@@ -1,8 +1,10 @@
 #include <sstream>
+#include <cerrno>
 #include <iomanip>
 #include <vector>
 #include <cxxabi.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
@@ -208,6 +210,82 @@ bool filesystem::isdir(std::string path)
 
 
 
+// ============================================================================
+std::size_t binary_file::align_up(std::size_t n, std::size_t alignment)
+{
+    return (n + alignment - 1) / alignment * alignment;
+}
+
+std::string binary_file::native_float_dtype(std::size_t itemsize)
+{
+    const std::uint16_t one = 1;
+    return std::string(*reinterpret_cast<const char*>(&one) == 1 ? "<f" : ">f") + std::to_string(itemsize);
+}
+
+void binary_file::encode_uint64(std::uint64_t value, char* bytes)
+{
+    for (int n = 0; n < 8; ++n)
+    {
+        bytes[n] = char((value >> (8 * n)) & 0xff);
+    }
+}
+
+std::uint64_t binary_file::decode_uint64(const char* bytes)
+{
+    auto value = std::uint64_t(0);
+
+    for (int n = 0; n < 8; ++n)
+    {
+        value |= std::uint64_t(static_cast<unsigned char>(bytes[n])) << (8 * n);
+    }
+    return value;
+}
+
+void binary_file::write_at(int fd, const void* data, std::size_t size, std::size_t offset, std::string filename)
+{
+    auto bytes = static_cast<const char*>(data);
+
+    while (size > 0)
+    {
+        auto written = ::pwrite(fd, bytes, size, offset);
+
+        if (written < 0)
+        {
+            throw std::runtime_error("write to " + filename + " failed: " + std::strerror(errno));
+        }
+        bytes  += written;
+        size   -= written;
+        offset += written;
+    }
+}
+
+int binary_file::open_for_writing(std::string filename, bool truncate)
+{
+    const int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+
+    if (fd < 0)
+    {
+        throw std::invalid_argument("file " + filename + " could not be opened for writing");
+    }
+    return fd;
+}
+
+std::size_t binary_file::write_file_header(int fd, const char* magic, std::string text, std::size_t alignment, std::string filename)
+{
+    const std::uint64_t header[2] = {text.size(), align_up(24 + text.size(), alignment)};
+    char header_bytes[16];
+
+    encode_uint64(header[0], header_bytes + 0);
+    encode_uint64(header[1], header_bytes + 8);
+    write_at(fd, magic, 8, 0, filename);
+    write_at(fd, header_bytes, 16, 8, filename);
+    write_at(fd, text.data(), text.size(), 24, filename);
+    return header[1];
+}
+
+
+
+
 // ============================================================================
 void debug::backtrace()
 {
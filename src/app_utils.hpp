@@ -1,3 +1,4 @@
+#include <chrono>
 #include <iomanip>
 #include <fstream>
 #include <istream>
@@ -5,6 +6,7 @@
 #include <iterator>
 #include <functional>
 #include <map>
+#include <cstdint>
 #include <cstring>
 
 
@@ -151,6 +153,37 @@ namespace filesystem
 
 
 
+// ============================================================================
+/**
+ * Helpers for the binary output files: patches.dat, the snapshots, and
+ * telemetry.dat. These share a header layout: an 8-byte magic, the length
+ * of a JSON index and the offset of the payloads (as little-endian uint64),
+ * then the index itself (see chkpt.cpp).
+ */
+namespace binary_file
+{
+    std::size_t align_up(std::size_t n, std::size_t alignment);
+
+    /**
+     * Return the numpy dtype string of native floats of the given size, 4 or 8.
+     */
+    std::string native_float_dtype(std::size_t itemsize);
+
+    void encode_uint64(std::uint64_t value, char* bytes);
+    std::uint64_t decode_uint64(const char* bytes);
+    void write_at(int fd, const void* data, std::size_t size, std::size_t offset, std::string filename);
+    int open_for_writing(std::string filename, bool truncate=true);
+
+    /**
+     * Write the magic, the two header integers, and the JSON index, and
+     * return the offset of the payload section.
+     */
+    std::size_t write_file_header(int fd, const char* magic, std::string text, std::size_t alignment, std::string filename);
+}
+
+
+
+
 // ============================================================================
 namespace debug
 {
@@ -162,18 +195,24 @@ namespace debug
 
 
 // ============================================================================
+/**
+ * Measures elapsed wall-clock time. (Process CPU time, as from std::clock,
+ * would count the time of every thread.)
+ */
 class Timer
 {
 public:
-    Timer() : instantiated(std::clock())
+    using Clock = std::chrono::steady_clock;
+
+    Timer() : instantiated(Clock::now())
     {
     }
     double seconds() const
     {
-        return double (std::clock() - instantiated) / CLOCKS_PER_SEC;
+        return std::chrono::duration<double>(Clock::now() - instantiated).count();
     }
 private:
-    std::clock_t instantiated;
+    Clock::time_point instantiated;
 };
 
 
@@ -9,18 +9,55 @@ using namespace atmo;
 
 
 // ============================================================================
-VISITABLE_STRUCT(run_status, time, wall, iter, vtk_count, chkpt_count);
+VISITABLE_STRUCT(run_status,
+    time,
+    wall,
+    iter,
+    vtk_count,
+    chkpt_count,
+    snap_count,
+    diag_count,
+    wall_fetch,
+    wall_cons_to_prim,
+    wall_reconstruct,
+    wall_riemann,
+    wall_sources,
+    wall_commit,
+    wall_compress,
+    wall_io);
 VISITABLE_STRUCT(run_config,
     outdir,
     restart,
     tfinal,
     cpi,
     vtki,
+    vtk_format,
+    snapi,
+    snap_bits,
+    diagi,
+    io_queue,
+    logi,
+    telemetry,
+    chkpt_format,
     rk,
+    cfl,
     nr,
     num_blocks,
+    num_blocks_j,
+    balance,
     num_threads,
+    pin_threads,
     test_mode,
+    kernel,
+    checks,
+    exchange,
+    emulate_float32,
+    well_balanced,
+    subcycle,
+    profile,
+    counters,
+    peak_gflops,
+    peak_gbs,
     outer_radius,
     noise,
     heating_rate,
@@ -113,8 +150,33 @@ void run_config::tojson(std::ostream& os) const
 run_config run_config::validate() const
 {
     if (nr < 4)             throw std::runtime_error("nr must be >= 4");
-    if (rk != 1 && rk != 2) throw std::runtime_error("rk must be 1 or 2");
+    if (num_threads < 1)    throw std::runtime_error("num_threads must be >= 1");
+    if (io_queue < 0)       throw std::runtime_error("io_queue must be >= 0 (0 writes output synchronously)");
+    if (logi < 0.0)         throw std::runtime_error("logi must be >= 0 (0 prints every iteration)");
+    if (telemetry < 0)      throw std::runtime_error("telemetry must be >= 0 (0 disables telemetry.dat)");
+    if (pin_threads != 0 && pin_threads != 1) throw std::runtime_error("pin_threads must be 0 or 1");
+    if (balance != 0 && balance != 1) throw std::runtime_error("balance must be 0 or 1");
+    if (rk < 1 || rk > 3)   throw std::runtime_error("rk must be 1, 2, or 3");
+    if (cfl < 0.0 || cfl >= 1.0) throw std::runtime_error("cfl must be in [0, 1), where 0 means a fixed time step");
     if (outer_radius < 2.0) throw std::runtime_error("outer_radius must be > 2");
+    if (kernel != "ufunc" && kernel != "fused" && kernel != "simd") throw std::runtime_error("kernel must be ufunc, fused, or simd");
+    if (checks != "cell" && checks != "step") throw std::runtime_error("checks must be cell or step");
+    if (exchange != "fetch" && exchange != "split") throw std::runtime_error("exchange must be fetch or split");
+    if (emulate_float32 != 0 && emulate_float32 != 1) throw std::runtime_error("emulate_float32 must be 0 or 1");
+    if (well_balanced != 0 && well_balanced != 1) throw std::runtime_error("well_balanced must be 0 or 1");
+    if (subcycle < 0 || subcycle > 10) throw std::runtime_error("subcycle must be in [0, 10] (0 takes one global step)");
+    if (exchange == "split" && kernel == "ufunc") throw std::runtime_error("exchange=split needs the fused or simd kernel");
+    if (num_blocks_j < 1 || nr % num_blocks_j != 0 || nr / num_blocks_j < 2) throw std::runtime_error("num_blocks_j must divide nr into blocks at least 2 zones wide");
+    if (num_blocks_j > 1 && kernel == "ufunc") throw std::runtime_error("num_blocks_j > 1 needs the fused or simd kernel");
+    if (chkpt_format != "single" && chkpt_format != "tree") throw std::runtime_error("chkpt_format must be single or tree");
+    if (vtk_format != "vtk" && vtk_format != "vts") throw std::runtime_error("vtk_format must be vtk or vts");
+    if (diagi < 0.0)        throw std::runtime_error("diagi must be >= 0 (0 disables diagnostics)");
+    if (snap_bits < 1 || snap_bits > 52) throw std::runtime_error("snap_bits must be in [1, 52] (<= 23 stores float32, 52 is lossless)");
+    if (test_mode != 0 && test_mode != 1) throw std::runtime_error("test_mode must be 0 or 1");
+    if (profile != 0 && profile != 1) throw std::runtime_error("profile must be 0 or 1");
+    if (counters != 0 && counters != 1) throw std::runtime_error("counters must be 0 or 1");
+    if (counters && ! profile) throw std::runtime_error("counters=1 needs profile=1");
+    if (peak_gflops < 0.0 || peak_gbs < 0.0) throw std::runtime_error("peak_gflops and peak_gbs must be >= 0 (0 if unknown)");
     return *this;
 }
 
@@ -197,10 +259,22 @@ std::string run_config::make_filename_chkpt(int count) const
 std::string run_config::make_filename_vtk(int count) const
 {
     auto ss = std::stringstream();
-    ss << std::setfill('0') << std::setw(4) << count << ".vtk";
+    ss << std::setfill('0') << std::setw(4) << count << "." << vtk_format;
     return filesystem::join({outdir, ss.str()});
 }
 
+std::string run_config::make_filename_snap(int count) const
+{
+    auto ss = std::stringstream();
+    ss << std::setfill('0') << std::setw(4) << count << ".snap";
+    return filesystem::join({outdir, ss.str()});
+}
+
+std::string run_config::make_filename_diagnostics(std::string extension) const
+{
+    return filesystem::join({outdir, "diagnostics." + extension});
+}
+
 std::string run_config::make_filename_status(int count) const
 {
     return filesystem::join({make_filename_chkpt(count), "status.json"});
@@ -210,3 +284,13 @@ std::string run_config::make_filename_config(int count) const
 {
     return filesystem::join({make_filename_chkpt(count), "config.json"});
 }
+
+std::string run_config::make_filename_balance(int count) const
+{
+    return filesystem::join({make_filename_chkpt(count), "balance.json"});
+}
+
+std::string run_config::make_filename_telemetry() const
+{
+    return filesystem::join({outdir, "telemetry.dat"});
+}
@@ -1,3 +1,4 @@
+#pragma once
 #include <ostream>
 #include <string>
 #include <map>
@@ -40,6 +41,18 @@ struct atmo::run_status
     int iter        = 0;
     int vtk_count   = 0;
     int chkpt_count = 0;
+    int snap_count  = 0;
+    int diag_count  = 0;
+
+    /** Wall time per profiler phase, summed over threads (profile=1) */
+    double wall_fetch        = 0.0;
+    double wall_cons_to_prim = 0.0;
+    double wall_reconstruct  = 0.0;
+    double wall_riemann      = 0.0;
+    double wall_sources      = 0.0;
+    double wall_commit       = 0.0;
+    double wall_compress     = 0.0;
+    double wall_io           = 0.0;
 };
 
 
@@ -56,8 +69,12 @@ struct atmo::run_config
     run_config validate() const;
     std::string make_filename_chkpt(int count) const;
     std::string make_filename_vtk(int count) const;
+    std::string make_filename_snap(int count) const;
+    std::string make_filename_diagnostics(std::string extension) const;
     std::string make_filename_status(int count) const;
     std::string make_filename_config(int count) const;
+    std::string make_filename_balance(int count) const;
+    std::string make_filename_telemetry() const;
 
     template<typename Callable>
     void foreach(Callable f)
@@ -74,11 +91,33 @@ struct atmo::run_config
     double tfinal       = 0.1;
     double cpi          = 1.0;
     double vtki         = 1.0;
+    std::string vtk_format = "vtk";
+    double snapi        = 0.0;
+    int snap_bits       = 23;
+    double diagi        = 0.0;
+    int io_queue        = 2;
+    double logi         = 0.0; // wall seconds between progress lines, 0 prints every iteration
+    int telemetry       = 0; // samples kept in outdir/telemetry.dat, 0 for no file
+    std::string chkpt_format = "single";
     int rk              = 1;
+    double cfl          = 0.4;
     int nr              = 32;
     int num_threads     = 1;
+    int pin_threads     = 0;
     int num_blocks      = 12;
-    int test_mode       = 0;
+    int num_blocks_j    = 1;
+    int balance         = 1;
+    int test_mode       = 0; // 1 writes no output, for timing the main loop
+    std::string kernel  = "fused";
+    std::string checks  = "cell";
+    std::string exchange = "fetch";
+    int emulate_float32 = 0; // diagnostic: 1 rounds the double state to float32 after every stage
+    int well_balanced   = 0; // 1 holds the noise-free atmosphere steady to round-off
+    int subcycle        = 0; // maximum subcycling level of the radial blocks, 0 for one global step
+    int profile         = 0;
+    int counters        = 0;
+    double peak_gflops  = 0.0;
+    double peak_gbs     = 0.0;
 
     /** Physics setup */
     double outer_radius      = 10.0;
@@ -0,0 +1,192 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+
+
+
+// ============================================================================
+/**
+ * Runs jobs one at a time, in submission order, on a dedicated background
+ * thread. At most capacity jobs may be waiting to start: submit blocks while
+ * the queue is full, so a consumer that falls behind slows the producer down
+ * instead of letting memory grow. With a capacity of zero, jobs run inline on
+ * the submitting thread. If a job throws, the exception is rethrown from the
+ * next call to submit or flush.
+ */
+class BackgroundQueue
+{
+public:
+
+
+    /**
+     * Constructor. The background thread is only started if capacity > 0.
+     */
+    BackgroundQueue(std::size_t capacity);
+
+
+    /**
+     * Destructor. Waits for the remaining jobs to finish; exceptions they
+     * throw at this point are discarded, so call flush first to see them.
+     */
+    ~BackgroundQueue();
+
+
+    /**
+     * Return the maximum number of waiting jobs (zero means synchronous).
+     */
+    std::size_t capacity() const;
+
+
+    /**
+     * Return the number of jobs waiting or running, for monitoring.
+     */
+    std::size_t pending();
+
+
+    /**
+     * Add a job to the queue, blocking if the queue is full.
+     */
+    void submit(std::function<void()> job);
+
+
+    /**
+     * Block until every submitted job has finished.
+     */
+    void flush();
+
+
+private:
+    // ========================================================================
+    void worker_loop();
+    void rethrow_pending();
+
+    std::size_t max_waiting;
+    std::deque<std::function<void()>> jobs;
+    std::exception_ptr error;
+    bool busy;
+    bool stop;
+
+    std::mutex mutex;
+    std::condition_variable job_added;
+    std::condition_variable job_taken;
+    std::thread thread;
+};
+
+
+
+
+// ============================================================================
+inline BackgroundQueue::BackgroundQueue(std::size_t capacity)
+: max_waiting(capacity)
+, busy(false)
+, stop(false)
+{
+    if (max_waiting > 0)
+    {
+        thread = std::thread([this] { worker_loop(); });
+    }
+}
+
+inline BackgroundQueue::~BackgroundQueue()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        stop = true;
+    }
+    job_added.notify_all();
+
+    if (thread.joinable())
+    {
+        thread.join();
+    }
+}
+
+inline std::size_t BackgroundQueue::capacity() const
+{
+    return max_waiting;
+}
+
+inline std::size_t BackgroundQueue::pending()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return jobs.size() + (busy ? 1 : 0);
+}
+
+inline void BackgroundQueue::submit(std::function<void()> job)
+{
+    if (max_waiting == 0)
+    {
+        job();
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        job_taken.wait(lock, [this] { return jobs.size() < max_waiting || error; });
+        rethrow_pending();
+        jobs.push_back(std::move(job));
+    }
+    job_added.notify_one();
+}
+
+inline void BackgroundQueue::flush()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    job_taken.wait(lock, [this] { return (jobs.empty() && ! busy) || error; });
+    rethrow_pending();
+}
+
+inline void BackgroundQueue::worker_loop()
+{
+    for (;;)
+    {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            job_added.wait(lock, [this] { return stop || ! jobs.empty(); });
+
+            if (jobs.empty())
+            {
+                return;
+            }
+            job = std::move(jobs.front());
+            jobs.pop_front();
+            busy = true;
+        }
+        job_taken.notify_all();
+
+        try {
+            job();
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (! error)
+            {
+                error = std::current_exception();
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            busy = false;
+        }
+        job_taken.notify_all();
+    }
+}
+
+inline void BackgroundQueue::rethrow_pending()
+{
+    if (error)
+    {
+        auto e = error;
+        error = nullptr;
+        std::rethrow_exception(e);
+    }
+}
@@ -0,0 +1,485 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <algorithm>
+#include <map>
+#include <thread>
+#include <vector>
+#include "json.hpp"
+#include "app_utils.hpp"
+#include "patches.hpp"
+#include "physics.hpp"
+#include "atmo.hpp"
+#include "comm.hpp"
+#include "profiler.hpp"
+#include "thread_pool.hpp"
+#include "solver.hpp"
+
+using namespace patches2d;
+using run_config = atmo::run_config;
+
+
+
+
+// ============================================================================
+/**
+ * The benchmark harness, built and run by make bench. It times the solver on
+ * fixed-size problems over a sweep of nr, num_blocks, num_threads, and rk,
+ * each of which takes a comma-separated list, e.g.
+ *
+ *     atmo-bench nr=32,64 num_threads=1,2,4 rk=1,2 steps=10 repeats=5
+ *
+ * Every other run_config option (kernel, checks, exchange, emulate_float32, ...)
+ * applies to all of the runs. Each run takes warmup steps, after which the
+ * workers are balanced by their measured cost, and is then timed over
+ * repeats of a fixed number of steps; the fastest repeat gives the zones per
+ * second. One more, profiled, repeat gives the cost of each profiler phase,
+ * including fetch and commit, and with counters=1 the hardware counts of the
+ * kernels, fetch, and commit. The results are written as JSON to output.
+ */
+struct bench_options
+{
+    static bench_options from_argv(int argc, const char* argv[]);
+
+    std::vector<int> nr = {32, 64};
+    std::vector<int> num_blocks = {12};
+    std::vector<int> num_threads; // powers of two up to the hardware concurrency
+    std::vector<int> rk = {1, 2};
+    int steps       = 10;
+    int warmup      = 2;
+    int repeats     = 3;
+    int weak        = 1;
+    int micro_cells = 1 << 16;
+    std::string output = "bench.json";
+    std::vector<std::string> run_args; // the run_config options, as key=value
+};
+
+static std::vector<int> parse_list(std::string key, std::string value)
+{
+    auto result = std::vector<int>();
+    auto item = std::string();
+    auto ss = std::stringstream(value);
+
+    while (std::getline(ss, item, ','))
+    {
+        result.push_back(std::stoi(item));
+
+        if (result.back() < 1)
+        {
+            throw std::invalid_argument(key + " must be a list of positive integers");
+        }
+    }
+    if (result.empty())
+    {
+        throw std::invalid_argument(key + " must not be empty");
+    }
+    return result;
+}
+
+bench_options bench_options::from_argv(int argc, const char* argv[])
+{
+    auto opts = bench_options();
+
+    for (int n = 1; n < int(std::thread::hardware_concurrency()) + 1; n *= 2)
+    {
+        opts.num_threads.push_back(n);
+    }
+    if (opts.num_threads.empty())
+    {
+        opts.num_threads.push_back(1);
+    }
+
+    for (const auto& item : cmdline::parse_keyval(argc, argv))
+    {
+        const auto& key = item.first;
+        const auto& value = item.second;
+
+        if      (key == "nr")          opts.nr = parse_list(key, value);
+        else if (key == "num_blocks")  opts.num_blocks = parse_list(key, value);
+        else if (key == "num_threads") opts.num_threads = parse_list(key, value);
+        else if (key == "rk")          opts.rk = parse_list(key, value);
+        else if (key == "steps")       opts.steps = std::stoi(value);
+        else if (key == "warmup")      opts.warmup = std::stoi(value);
+        else if (key == "repeats")     opts.repeats = std::stoi(value);
+        else if (key == "weak")        opts.weak = std::stoi(value);
+        else if (key == "micro_cells") opts.micro_cells = std::stoi(value);
+        else if (key == "output")      opts.output = value;
+        else if (key == "restart")     throw std::invalid_argument("the benchmarks always start from the initial data");
+        else                           opts.run_args.push_back(key + "=" + value);
+    }
+
+    if (opts.steps < 1)       throw std::invalid_argument("steps must be >= 1");
+    if (opts.warmup < 0)      throw std::invalid_argument("warmup must be >= 0");
+    if (opts.repeats < 1)     throw std::invalid_argument("repeats must be >= 1");
+    if (opts.weak != 0 && opts.weak != 1) throw std::invalid_argument("weak must be 0 or 1");
+    if (opts.micro_cells < 2) throw std::invalid_argument("micro_cells must be >= 2");
+    return opts;
+}
+
+/**
+ * Return the run config of one point of the sweep.
+ */
+run_config bench_config(const bench_options& opts, int nr, int num_blocks, int num_threads, int rk)
+{
+    auto args = opts.run_args;
+    auto argv = std::vector<const char*>();
+
+    args.push_back("nr=" + std::to_string(nr));
+    args.push_back("num_blocks=" + std::to_string(num_blocks));
+    args.push_back("num_threads=" + std::to_string(num_threads));
+    args.push_back("rk=" + std::to_string(rk));
+
+    for (const auto& arg : args)
+    {
+        argv.push_back(arg.c_str());
+    }
+    return run_config::from_argv(argv.size(), argv.data()).validate();
+}
+
+
+
+
+// ============================================================================
+/**
+ * Time the update of the database of the given config, as described above,
+ * and return the result of the run. This is a collective over comm, and the
+ * times are those of the slowest rank.
+ */
+nlohmann::json time_run(run_config cfg, const bench_options& opts, const mpi::Communicator& comm)
+{
+    if (cfg.num_blocks < comm.size())
+    {
+        throw std::invalid_argument("num_blocks must be at least the number of MPI ranks");
+    }
+
+    ThreadPool pool(cfg.num_threads, cfg.pin_threads);
+    profiler::Profiler instrumentation(pool.size());
+    auto partition = BlockPartition(cfg.num_blocks, cfg.num_blocks_j, comm);
+    auto solver = create_solver(cfg, pool, partition);
+    auto& database = solver.database;
+    auto& workspace = solver.workspace;
+    auto local_cells = double(database.num_cells(Field::conserved));
+    auto num_cells = comm.allreduce_sum(local_cells);
+    auto dt = 0.25 * M_PI / cfg.nr;
+
+    auto run_steps = [&] (int steps)
+    {
+        comm.barrier();
+        auto timer = Timer();
+
+        // When subcycling, steps counts level-0 steps, so that the zone
+        // rates are those of the global steps it stands in for.
+        for (int n = 0; n < steps;)
+        {
+            n += subcycle_steps(workspace);
+
+            advance(pool, solver, dt);
+
+            if (cfg.checks == "step")
+            {
+                check_positivity(pool, database, comm);
+            }
+        }
+        return comm.allreduce_max(timer.seconds());
+    };
+
+    run_steps(opts.warmup);
+
+    if (cfg.balance)
+    {
+        rebalance_workers(workspace);
+    }
+
+    auto seconds = std::vector<double>();
+
+    for (int r = 0; r < opts.repeats; ++r)
+    {
+        seconds.push_back(run_steps(opts.steps));
+    }
+    workspace.profiler = &instrumentation;
+
+    if (cfg.counters)
+    {
+        instrumentation.enable_counters();
+    }
+    run_steps(opts.steps);
+    workspace.profiler = nullptr;
+
+    auto sorted = seconds;
+    std::sort(sorted.begin(), sorted.end());
+
+    auto result = nlohmann::json();
+    auto phases = nlohmann::json::object();
+    const auto T = instrumentation.totals();
+
+    // Phase times are summed over the threads of this rank, so they are
+    // thread-seconds per zone update of this rank's cells.
+    for (int phase = 0; phase < profiler::num_phases; ++phase)
+    {
+        phases[profiler::phase_name(phase)] = {
+            {"seconds_per_step", T[phase] / opts.steps},
+            {"ns_per_zone", T[phase] / opts.steps / local_cells * 1e9}};
+    }
+    result["nr"] = cfg.nr;
+    result["num_blocks"] = cfg.num_blocks;
+    result["num_threads"] = cfg.num_threads;
+    result["rk"] = cfg.rk;
+    result["subcycle"] = cfg.subcycle;
+    result["cells"] = num_cells;
+    result["seconds"] = seconds;
+    result["zones_per_second"] = num_cells * opts.steps / sorted.front();
+    result["zones_per_second_median"] = num_cells * opts.steps / sorted[sorted.size() / 2];
+    result["phases"] = phases;
+
+    // Hardware counts per step of the profiled repeat, null where the
+    // events are not available (see profiler::HardwareCounters).
+    if (cfg.counters)
+    {
+        const auto counts = instrumentation.counter_totals();
+        auto regions = nlohmann::json::object();
+
+        for (int r = 0; r < profiler::num_regions; ++r)
+        {
+            if (r == profiler::kernel_region || r == profiler::fetch || r == profiler::commit)
+            {
+                for (int c = 0; c < profiler::HardwareCounters::num_counters; ++c)
+                {
+                    regions[profiler::region_name(r)][profiler::HardwareCounters::name(c)] = counts[r][c] / opts.steps;
+                }
+            }
+        }
+        result["counters"] = regions;
+    }
+    return result;
+}
+
+
+
+
+// ============================================================================
+/**
+ * Time the physics functors alone, with the given validity checks, on a
+ * synthetic set of smooth, valid states, and return the wall time per call in
+ * ns of the fastest of repeats passes. A PLM call is the limited slopes of
+ * the five primitives of one cell, and an HLLE call is one face. The
+ * checksum only keeps the compiler from discarding the results.
+ */
+template <typename Validity>
+nlohmann::json time_kernels(run_config cfg, int num_cells, int repeats)
+{
+    const auto prim_to_cons = hydro::basic_prim_to_cons<Validity>();
+    const auto cons_to_prim = hydro::basic_cons_to_prim<Validity>();
+    const auto riemann_hlle = hydro::basic_riemann_hlle<Validity>({1, 0, 0});
+    const auto source_terms = hydro::basic_source_terms<Validity>(cfg.heating_rate, cfg.cooling_rate);
+    const auto gradient_est = gradient_plm(2.0);
+
+    auto P = std::vector<hydro::Vars>(num_cells);
+    auto U = std::vector<hydro::Vars>(num_cells);
+    auto C = std::vector<hydro::SourceCoefficients>(num_cells);
+    auto checksum = 0.0;
+
+    for (int n = 0; n < num_cells; ++n)
+    {
+        const double x = double(n) / num_cells;
+        P[n] = {1.0 + 0.5 * std::sin(2 * M_PI * x), 0.1 * std::cos(2 * M_PI * x), 0.05 * std::sin(6 * M_PI * x), 0.0, 1.0 + 0.25 * std::cos(4 * M_PI * x)};
+        U[n] = prim_to_cons(P[n]);
+        C[n] = source_terms.coefficients({1.0 + (cfg.outer_radius - 1.0) * x, 0.1 + (M_PI - 0.2) * x});
+    }
+
+    auto time = [repeats] (int calls, auto&& pass)
+    {
+        auto best = 0.0;
+
+        for (int r = 0; r < repeats; ++r)
+        {
+            auto timer = Timer();
+            pass();
+            best = r == 0 ? timer.seconds() : std::min(best, timer.seconds());
+        }
+        return nlohmann::json{{"ns_per_call", best / calls * 1e9}};
+    };
+
+    auto result = nlohmann::json();
+
+    result["cons_to_prim"] = time(num_cells, [&]
+    {
+        for (int n = 0; n < num_cells; ++n)
+        {
+            checksum += cons_to_prim(U[n])[4];
+        }
+    });
+
+    result["hlle"] = time(num_cells - 1, [&]
+    {
+        for (int n = 0; n < num_cells - 1; ++n)
+        {
+            checksum += riemann_hlle(P[n], P[n + 1])[0];
+        }
+    });
+
+    result["plm"] = time(num_cells - 2, [&]
+    {
+        for (int n = 1; n < num_cells - 1; ++n)
+        {
+            for (int q = 0; q < 5; ++q)
+            {
+                checksum += gradient_est(P[n - 1][q], P[n][q], P[n + 1][q]);
+            }
+        }
+    });
+
+    result["source_terms"] = time(num_cells, [&]
+    {
+        for (int n = 0; n < num_cells; ++n)
+        {
+            const auto S = source_terms.evaluate(P[n], C[n]);
+            checksum += S[1] + S[4];
+        }
+    });
+
+    result["cells"] = num_cells;
+    result["checks"] = cfg.checks;
+    result["checksum"] = checksum;
+    return result;
+}
+
+
+
+
+// ============================================================================
+int bench(int argc, const char* argv[], const mpi::Communicator& comm)
+{
+    auto opts = bench_options::from_argv(argc, argv);
+    auto root = comm.rank() == 0;
+    auto runs = std::map<std::array<int, 4>, nlohmann::json>();
+
+    auto run = [&] (int nr, int num_blocks, int num_threads, int rk)
+    {
+        auto key = std::array<int, 4>{nr, num_blocks, num_threads, rk};
+
+        if (! runs.count(key))
+        {
+            runs[key] = time_run(bench_config(opts, nr, num_blocks, num_threads, rk), opts, comm);
+
+            if (root)
+            {
+                std::printf("nr=%d num_blocks=%d num_threads=%d rk=%d: kzps=%3.2lf\n",
+                    nr, num_blocks, num_threads, rk, runs[key]["zones_per_second"].get<double>() / 1e3);
+                std::fflush(stdout);
+            }
+        }
+        return runs[key];
+    };
+
+
+    // Strong scaling: each problem over the thread counts, relative to the
+    // fewest threads.
+    // ------------------------------------------------------------------------
+    auto strong = nlohmann::json::array();
+
+    for (int nr : opts.nr)
+    {
+        for (int num_blocks : opts.num_blocks)
+        {
+            for (int rk : opts.rk)
+            {
+                const int t0 = opts.num_threads.front();
+                const double z0 = run(nr, num_blocks, t0, rk)["zones_per_second"];
+
+                for (int t : opts.num_threads)
+                {
+                    auto result = run(nr, num_blocks, t, rk);
+                    result["efficiency"] = result["zones_per_second"].get<double>() / z0 * t0 / t;
+                    strong.push_back(result);
+                }
+            }
+        }
+    }
+
+
+    // Weak scaling: the first nr on the fewest threads, and nr grown with
+    // the thread count so that the zones per thread stay about the same. The
+    // efficiency compares the zones per second per thread.
+    // ------------------------------------------------------------------------
+    auto weak = nlohmann::json::array();
+    auto base = bench_config(opts, opts.nr.front(), opts.num_blocks.front(), 1, 1);
+
+    for (int num_blocks : opts.num_blocks)
+    {
+        for (int rk : opts.rk)
+        {
+            const int t0 = opts.num_threads.front();
+            const int nr0 = opts.nr.front();
+            const double z0 = run(nr0, num_blocks, t0, rk)["zones_per_second"];
+
+            for (int t : opts.weak ? opts.num_threads : std::vector<int>())
+            {
+                const int q = base.num_blocks_j;
+                const int nr = std::max(4, int(std::lround(nr0 * std::sqrt(double(t) / t0) / q)) * q);
+                auto result = run(nr, num_blocks, t, rk);
+                result["efficiency"] = result["zones_per_second"].get<double>() / t / (z0 / t0);
+                weak.push_back(result);
+            }
+        }
+    }
+
+
+    // Kernel microbenchmarks and the report
+    // ------------------------------------------------------------------------
+    auto kernels = base.checks == "step"
+    ? time_kernels<hydro::unchecked>(base, opts.micro_cells, opts.repeats)
+    : time_kernels<hydro::checked>(base, opts.micro_cells, opts.repeats);
+
+    if (root)
+    {
+        auto config = std::stringstream();
+        auto report = nlohmann::json();
+
+        base.tojson(config);
+        report["config"] = nlohmann::json::parse(config.str());
+        report["steps"] = opts.steps;
+        report["warmup"] = opts.warmup;
+        report["repeats"] = opts.repeats;
+        report["ranks"] = comm.size();
+        report["hardware_concurrency"] = std::thread::hardware_concurrency();
+        report["strong"] = strong;
+        report["weak"] = weak;
+        report["kernels"] = kernels;
+
+        auto ofs = std::ofstream(opts.output);
+
+        if (! ofs.is_open())
+        {
+            throw std::invalid_argument("file " + opts.output + " could not be opened for writing");
+        }
+        ofs << report.dump(4) << "\n";
+        std::cout << "write " << opts.output << std::endl;
+    }
+    return 0;
+}
+
+
+
+
+// ============================================================================
+int main(int argc, const char* argv[])
+{
+    mpi::Session session(argc, argv);
+    auto comm = mpi::Communicator::world();
+
+    try {
+        return bench(argc, argv, comm);
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "\nERROR: ";
+        std::cerr << e.what() << "\n\n";
+
+        if (comm.size() > 1)
+        {
+            comm.abort(1);
+        }
+        return 1;
+    }
+}
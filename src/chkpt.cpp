@@ -0,0 +1,427 @@
+#include <iostream>
+#include <fstream>
+#include <numeric>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "json.hpp"
+#include "app_utils.hpp"
+#include "chkpt.hpp"
+
+using namespace patches2d;
+using run_config = atmo::run_config;
+using run_status = atmo::run_status;
+
+
+
+
+// ============================================================================
+/**
+ * Single-file checkpoint format. The file chkpt.NNNN/patches.dat holds
+ *
+ *     char[8]    magic, "ATMOPTCH"
+ *     uint64     length L of the JSON index
+ *     uint64     offset of the payload section
+ *     char[L]    JSON index
+ *     (padding)
+ *     payloads
+ *
+ * The index is {"alignment": A, "patches": [{"index": "0-0-0/conserved",
+ * "dtype": "<f8", "shape": [ni, nj, nq], "offset": ..., "nbytes": ...}, ...]},
+ * where each offset is relative to the payload section. The payload section
+ * and every payload start on a multiple of A bytes, and a payload is the raw
+ * array elements in row-major order. The dtype is "<f4" for runs with
+ * emulate_float32=1, whose state is exactly representable in float32. The
+ * two integers in the fixed header are little-endian.
+ */
+static const char chkpt_file_magic[8] = {'A', 'T', 'M', 'O', 'P', 'T', 'C', 'H'};
+static const std::size_t chkpt_file_alignment = 4096;
+
+/**
+ * Write the patches of the given field to a patches.dat file. This is a
+ * collective over comm: each rank writes the patches it holds, at offsets
+ * following those of the lower ranks, so that the file is the same as if one
+ * rank held every patch. Rank 0 creates the file and writes the merged index.
+ * If single is true, the payloads are float32 rather than float64.
+ */
+static void write_patches_file(const Database& database, Field field, std::string filename, const mpi::Communicator& comm, bool single=false)
+{
+    auto entries = nlohmann::json::array();
+    auto offsets = std::vector<std::size_t>();
+    auto offset = std::size_t(0);
+    auto itemsize = single ? sizeof(float) : sizeof(double);
+    auto dtype = binary_file::native_float_dtype(itemsize);
+
+    for (const auto& patch : database)
+    {
+        if (std::get<3>(patch.first) != field)
+        {
+            continue;
+        }
+        const auto& A = patch.second;
+        const auto nbytes = std::size_t(A.shape(0)) * A.shape(1) * A.shape(2) * itemsize;
+
+        entries.push_back({
+            {"index", to_string(patch.first)},
+            {"dtype", dtype},
+            {"shape", {A.shape(0), A.shape(1), A.shape(2)}},
+            {"offset", offset},
+            {"nbytes", nbytes}});
+        offsets.push_back(offset);
+        offset = binary_file::align_up(offset + nbytes, chkpt_file_alignment);
+    }
+
+    // Shift the local offsets past the payloads of the lower ranks. The byte
+    // counts are summed as doubles, which is exact below 2^53.
+    // ------------------------------------------------------------------------
+    auto totals = std::vector<double>(comm.size(), 0.0);
+    totals[comm.rank()] = offset;
+    comm.allreduce_sum(totals);
+
+    const auto base = std::size_t(std::accumulate(totals.begin(), totals.begin() + comm.rank(), 0.0));
+
+    for (std::size_t n = 0; n < offsets.size(); ++n)
+    {
+        offsets[n] += base;
+        entries[n]["offset"] = offsets[n];
+    }
+
+    auto parts = comm.gather(entries.dump());
+    auto data_start = 0.0;
+
+    if (comm.rank() == 0)
+    {
+        auto index = nlohmann::json();
+
+        for (const auto& part : parts)
+        {
+            for (const auto& entry : nlohmann::json::parse(part))
+            {
+                index["patches"].push_back(entry);
+            }
+        }
+        index["alignment"] = chkpt_file_alignment;
+
+        const int fd = binary_file::open_for_writing(filename);
+
+        try {
+            data_start = binary_file::write_file_header(fd, chkpt_file_magic, index.dump(), chkpt_file_alignment, filename);
+        }
+        catch (...)
+        {
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+    }
+
+    // The file exists once every rank knows where the payloads start.
+    // ------------------------------------------------------------------------
+    const auto payload_start = std::size_t(comm.allreduce_sum(data_start));
+    const int fd = binary_file::open_for_writing(filename, false);
+
+    try {
+        auto buffer = std::vector<double>();
+        auto buffer_single = std::vector<float>();
+        auto n = std::size_t(0);
+
+        for (const auto& patch : database)
+        {
+            if (std::get<3>(patch.first) != field)
+            {
+                continue;
+            }
+            const auto& A = patch.second;
+            buffer.clear();
+
+            for (int i = 0; i < A.shape(0); ++i)
+            {
+                for (int j = 0; j < A.shape(1); ++j)
+                {
+                    for (int k = 0; k < A.shape(2); ++k)
+                    {
+                        buffer.push_back(A(i, j, k));
+                    }
+                }
+            }
+            if (single)
+            {
+                buffer_single.assign(buffer.begin(), buffer.end());
+                binary_file::write_at(fd, buffer_single.data(), buffer_single.size() * sizeof(float), payload_start + offsets[n++], filename);
+            }
+            else
+            {
+                binary_file::write_at(fd, buffer.data(), buffer.size() * sizeof(double), payload_start + offsets[n++], filename);
+            }
+        }
+    }
+    catch (...)
+    {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+    comm.barrier();
+}
+
+/**
+ * Load the patches of the given field in a patches.dat file into the
+ * database; patches of other fields, and those for which select returns
+ * false, are skipped. The file is memory-mapped, and the patches are copied
+ * out of the mapping in parallel on the pool. Payloads may be native float32
+ * or float64, and are widened to double. The return value is the number of
+ * patches of the field in the file, whether selected or not.
+ */
+static int load_patches_file(ThreadPool& pool, Database& database, Field field, std::string filename, std::function<bool(Database::Index)> select)
+{
+    struct Mapping
+    {
+        ~Mapping()
+        {
+            if (data != MAP_FAILED) ::munmap(data, size);
+            if (fd >= 0) ::close(fd);
+        }
+        int fd = -1;
+        void* data = MAP_FAILED;
+        std::size_t size = 0;
+    };
+
+    Mapping file;
+    struct stat info;
+
+    file.fd = ::open(filename.c_str(), O_RDONLY);
+
+    if (file.fd < 0 || ::fstat(file.fd, &info) != 0)
+    {
+        throw std::invalid_argument("file " + filename + " could not be opened for reading");
+    }
+    file.size = info.st_size;
+    file.data = ::mmap(nullptr, file.size, PROT_READ, MAP_PRIVATE, file.fd, 0);
+
+    if (file.data == MAP_FAILED)
+    {
+        throw std::runtime_error("mmap of " + filename + " failed: " + std::strerror(errno));
+    }
+
+    auto bytes = static_cast<const char*>(file.data);
+    auto header = std::array<std::uint64_t, 2>();
+
+    if (file.size < 24 || std::memcmp(bytes, chkpt_file_magic, 8) != 0)
+    {
+        throw std::runtime_error(filename + " is not a patches file");
+    }
+    header[0] = binary_file::decode_uint64(bytes + 8);
+    header[1] = binary_file::decode_uint64(bytes + 16);
+
+    if (24 + header[0] > file.size || header[1] > file.size)
+    {
+        throw std::runtime_error(filename + " has a corrupt header");
+    }
+
+    auto index = nlohmann::json::parse(bytes + 24, bytes + 24 + header[0]);
+    auto entries = std::vector<nlohmann::json>();
+    auto found = 0;
+
+    for (const auto& entry : index.at("patches"))
+    {
+        const auto patch = patches2d::parse_index(entry.at("index").get<std::string>());
+
+        if (std::get<3>(patch) == field)
+        {
+            found += 1;
+
+            if (select(patch))
+            {
+                entries.push_back(entry);
+            }
+        }
+    }
+    auto arrays = std::vector<Database::Array>(entries.size());
+
+    for (const auto& entry : entries)
+    {
+        const auto dtype = entry.at("dtype").get<std::string>();
+
+        if (dtype != binary_file::native_float_dtype(sizeof(double)) && dtype != binary_file::native_float_dtype(sizeof(float)))
+        {
+            throw std::runtime_error(filename + " has unsupported dtype " + dtype);
+        }
+        if (header[1] + entry.at("offset").get<std::size_t>() + entry.at("nbytes").get<std::size_t>() > file.size)
+        {
+            throw std::runtime_error(filename + " is truncated");
+        }
+    }
+
+    pool.parallel_for(0, entries.size(), [&] (int n)
+    {
+        const auto& entry = entries[n];
+        const auto shape = entry.at("shape").get<std::array<int, 3>>();
+        const auto data = bytes + header[1] + entry.at("offset").get<std::size_t>();
+        const auto single = entry.at("dtype").get<std::string>() == binary_file::native_float_dtype(sizeof(float));
+        auto A = nd::array<double, 3>(shape[0], shape[1], shape[2]);
+
+        for (int i = 0; i < shape[0]; ++i)
+        {
+            for (int j = 0; j < shape[1]; ++j)
+            {
+                for (int k = 0; k < shape[2]; ++k)
+                {
+                    const auto m = (i * shape[1] + j) * shape[2] + k;
+                    A(i, j, k) = single ? reinterpret_cast<const float*>(data)[m] : reinterpret_cast<const double*>(data)[m];
+                }
+            }
+        }
+        arrays[n] = A;
+    });
+
+    for (std::size_t n = 0; n < entries.size(); ++n)
+    {
+        database.insert(patches2d::parse_index(entries[n].at("index").get<std::string>()), arrays[n]);
+    }
+    return found;
+}
+
+
+
+
+// ============================================================================
+void write_chkpt(
+    const Database& database,
+    run_config cfg,
+    run_status sts,
+    const std::vector<double>& block_costs,
+    int count,
+    const mpi::Communicator& comm)
+{
+    auto filename = cfg.make_filename_chkpt(count);
+    auto parts = std::vector<std::string>{filename};
+
+    if (comm.rank() == 0)
+    {
+        std::cout << "write checkpoint " << filename << std::endl;
+
+        filesystem::remove_recurse(filename);
+        filesystem::require_dir(filename);
+
+
+        // Write the run config and status to json
+        // --------------------------------------------------------------------
+        auto cfg_stream = std::fstream(cfg.make_filename_config(count), std::ios::out);
+        auto sts_stream = std::fstream(cfg.make_filename_status(count), std::ios::out);
+
+        cfg.tojson(cfg_stream);
+        sts.tojson(sts_stream);
+
+        if (! block_costs.empty())
+        {
+            auto balance = nlohmann::json();
+            balance["num_blocks"] = cfg.num_blocks;
+            balance["num_blocks_j"] = cfg.num_blocks_j;
+            balance["block_costs"] = block_costs;
+            auto bal_stream = std::fstream(cfg.make_filename_balance(count), std::ios::out);
+            bal_stream << balance.dump(4) << "\n";
+        }
+    }
+    comm.barrier();
+
+
+    // Write patch data
+    // ------------------------------------------------------------------------
+    if (cfg.chkpt_format == "single")
+    {
+        write_patches_file(database, Field::conserved, filesystem::join({filename, "patches.dat"}), comm, cfg.emulate_float32);
+        return;
+    }
+
+    for (const auto& patch : database.all(Field::conserved))
+    {
+        parts.push_back(to_string(patch.first));
+        filesystem::require_dir(filesystem::parent(filesystem::join(parts)));
+        nd::tofile(patch.second, filesystem::join(parts));
+        parts.pop_back();
+    }
+    comm.barrier();
+}
+
+std::vector<double> load_block_costs(run_config cfg)
+{
+    auto filename = filesystem::join({cfg.restart, "balance.json"});
+
+    if (cfg.restart.empty() || cfg.balance == 0 || ! filesystem::isfile(filename))
+    {
+        return {};
+    }
+    auto ifs = std::ifstream(filename);
+    auto balance = nlohmann::json();
+    ifs >> balance;
+
+    if (balance.at("num_blocks") != cfg.num_blocks || balance.at("num_blocks_j") != cfg.num_blocks_j)
+    {
+        std::cout << "warning: ignoring " << filename << ", which is for a different set of blocks" << std::endl;
+        return {};
+    }
+    return balance.at("block_costs").get<std::vector<double>>();
+}
+
+int load_patches_from_chkpt(ThreadPool& pool, Database& database, std::string filename, std::function<bool(Database::Index)> select)
+{
+    auto path = std::vector<std::string>{filename};
+    auto indexes = std::vector<Database::Index>();
+    auto filenames = std::vector<std::string>();
+    auto found = 0;
+
+    if (filesystem::isfile(filesystem::join({filename, "patches.dat"})))
+    {
+        return load_patches_file(pool, database, Field::conserved, filesystem::join({filename, "patches.dat"}), select);
+    }
+
+    for (auto patch : filesystem::listdir(filename))
+    {
+        path.push_back(patch);
+
+        if (filesystem::isdir(filesystem::join(path)))
+        {
+            for (auto field : filesystem::listdir(filesystem::join(path)))
+            {
+                auto index = patches2d::parse_index(filesystem::join({patch, field}));
+
+                if (std::get<3>(index) != Field::conserved)
+                {
+                    continue;
+                }
+                found += 1;
+
+                if (! select(index))
+                {
+                    continue;
+                }
+                path.push_back(field);
+                indexes.push_back(index);
+                filenames.push_back(filesystem::join(path));
+                path.pop_back();
+            }
+        }
+        path.pop_back();
+    }
+
+    // The files are read and parsed concurrently, and inserted afterwards,
+    // as in load_patches_file.
+    auto arrays = std::vector<Database::Array>(filenames.size());
+
+    pool.parallel_for(0, filenames.size(), [&] (int n)
+    {
+        auto ifs = std::ifstream(filenames[n]);
+        auto str = std::string(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+        arrays[n] = nd::array<double, 3>::loads(str);
+    });
+
+    for (std::size_t n = 0; n < indexes.size(); ++n)
+    {
+        database.insert(indexes[n], arrays[n]);
+    }
+    return found;
+}
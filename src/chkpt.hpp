@@ -0,0 +1,47 @@
+#pragma once
+#include <functional>
+#include <string>
+#include <vector>
+#include "patches.hpp"
+#include "atmo.hpp"
+#include "comm.hpp"
+#include "thread_pool.hpp"
+
+
+
+
+// ============================================================================
+/**
+ * Write a checkpoint. Only the conserved variables are stored: the mesh
+ * geometry is a function of the run config, which is saved alongside, and is
+ * regenerated by create_database on restart. This is a collective over comm,
+ * where each rank writes the patches it holds; rank 0 prepares the directory
+ * and writes the config and status, and the measured block costs, if any,
+ * to balance.json (see load_block_costs).
+ */
+void write_chkpt(
+    const patches2d::Database& database,
+    atmo::run_config cfg,
+    atmo::run_status sts,
+    const std::vector<double>& block_costs,
+    int count,
+    const mpi::Communicator& comm);
+
+/**
+ * Return the block costs saved in the restart checkpoint, or an empty vector
+ * if there are none, or they were measured on a different set of blocks. The
+ * result is for the BlockPartition constructor.
+ */
+std::vector<double> load_block_costs(atmo::run_config cfg);
+
+/**
+ * Load the conserved variables from a checkpoint in either format, keeping
+ * the patches for which select returns true. Geometry fields, which older
+ * checkpoints contain, are ignored. The return value is the number of
+ * conserved patches in the checkpoint.
+ */
+int load_patches_from_chkpt(
+    ThreadPool& pool,
+    patches2d::Database& database,
+    std::string filename,
+    std::function<bool(patches2d::Database::Index)> select);
@@ -0,0 +1,263 @@
+#include <cstdlib>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include "comm.hpp"
+using namespace mpi;
+
+
+
+
+// ============================================================================
+#ifdef HAVE_MPI
+
+static std::mutex& library_mutex()
+{
+    static std::mutex mutex;
+    return mutex;
+}
+
+static void check(int error, const char* operation)
+{
+    if (error != MPI_SUCCESS)
+    {
+        throw std::runtime_error(std::string("MPI: ") + operation + " failed");
+    }
+}
+
+/**
+ * Poll the request to completion, holding the library lock only while
+ * testing it.
+ */
+static void wait_for(MPI_Request& request)
+{
+    while (true)
+    {
+        {
+            std::lock_guard<std::mutex> lock(library_mutex());
+            int done = 0;
+            check(MPI_Test(&request, &done, MPI_STATUS_IGNORE), "MPI_Test");
+
+            if (done)
+            {
+                return;
+            }
+        }
+        std::this_thread::yield();
+    }
+}
+
+#endif
+
+
+
+
+// ============================================================================
+Session::Session(int& argc, const char**& argv)
+{
+#ifdef HAVE_MPI
+    int provided = 0;
+    auto c_argv = const_cast<char**>(argv);
+    MPI_Init_thread(&argc, &c_argv, MPI_THREAD_SERIALIZED, &provided);
+    argv = const_cast<const char**>(c_argv);
+
+    if (provided < MPI_THREAD_SERIALIZED)
+    {
+        MPI_Finalize();
+        throw std::runtime_error("MPI: the library does not support MPI_THREAD_SERIALIZED");
+    }
+#else
+    (void) argc;
+    (void) argv;
+#endif
+}
+
+Session::~Session()
+{
+#ifdef HAVE_MPI
+    MPI_Finalize();
+#endif
+}
+
+
+
+
+// ============================================================================
+void Request::wait()
+{
+#ifdef HAVE_MPI
+    wait_for(request);
+#endif
+}
+
+
+
+
+// ============================================================================
+Communicator Communicator::world()
+{
+    return Communicator();
+}
+
+Communicator Communicator::duplicate() const
+{
+    auto result = Communicator();
+#ifdef HAVE_MPI
+    std::lock_guard<std::mutex> lock(library_mutex());
+    check(MPI_Comm_dup(comm, &result.comm), "MPI_Comm_dup");
+#endif
+    return result;
+}
+
+int Communicator::rank() const
+{
+#ifdef HAVE_MPI
+    std::lock_guard<std::mutex> lock(library_mutex());
+    int r = 0;
+    MPI_Comm_rank(comm, &r);
+    return r;
+#else
+    return 0;
+#endif
+}
+
+int Communicator::size() const
+{
+#ifdef HAVE_MPI
+    std::lock_guard<std::mutex> lock(library_mutex());
+    int s = 1;
+    MPI_Comm_size(comm, &s);
+    return s;
+#else
+    return 1;
+#endif
+}
+
+double Communicator::allreduce_max(double value) const
+{
+#ifdef HAVE_MPI
+    auto result = 0.0;
+    auto request = MPI_Request();
+    {
+        std::lock_guard<std::mutex> lock(library_mutex());
+        check(MPI_Iallreduce(&value, &result, 1, MPI_DOUBLE, MPI_MAX, comm, &request), "MPI_Iallreduce");
+    }
+    wait_for(request);
+    return result;
+#else
+    return value;
+#endif
+}
+
+double Communicator::allreduce_sum(double value) const
+{
+    auto values = std::vector<double>{value};
+    allreduce_sum(values);
+    return values[0];
+}
+
+void Communicator::allreduce_sum(std::vector<double>& values) const
+{
+#ifdef HAVE_MPI
+    auto request = MPI_Request();
+    {
+        std::lock_guard<std::mutex> lock(library_mutex());
+        check(MPI_Iallreduce(MPI_IN_PLACE, values.data(), int(values.size()), MPI_DOUBLE, MPI_SUM, comm, &request), "MPI_Iallreduce");
+    }
+    wait_for(request);
+#else
+    (void) values;
+#endif
+}
+
+void Communicator::barrier() const
+{
+#ifdef HAVE_MPI
+    auto request = MPI_Request();
+    {
+        std::lock_guard<std::mutex> lock(library_mutex());
+        check(MPI_Ibarrier(comm, &request), "MPI_Ibarrier");
+    }
+    wait_for(request);
+#endif
+}
+
+std::vector<std::string> Communicator::gather(const std::string& bytes, int root) const
+{
+#ifdef HAVE_MPI
+    const auto r = rank();
+    const auto s = size();
+    auto count = int(bytes.size());
+    auto sizes = std::vector<int>(r == root ? s : 0);
+    auto request = MPI_Request();
+    {
+        std::lock_guard<std::mutex> lock(library_mutex());
+        check(MPI_Igather(&count, 1, MPI_INT, sizes.data(), 1, MPI_INT, root, comm, &request), "MPI_Igather");
+    }
+    wait_for(request);
+
+    auto offsets = std::vector<int>(sizes.size());
+    auto total = 0;
+
+    for (std::size_t n = 0; n < sizes.size(); ++n)
+    {
+        offsets[n] = total;
+        total += sizes[n];
+    }
+    auto buffer = std::string(total, '\0');
+    {
+        std::lock_guard<std::mutex> lock(library_mutex());
+        check(MPI_Igatherv(bytes.data(), count, MPI_CHAR, &buffer[0], sizes.data(), offsets.data(), MPI_CHAR, root, comm, &request), "MPI_Igatherv");
+    }
+    wait_for(request);
+
+    auto result = std::vector<std::string>();
+
+    for (std::size_t n = 0; n < sizes.size(); ++n)
+    {
+        result.push_back(buffer.substr(offsets[n], sizes[n]));
+    }
+    return result;
+#else
+    (void) root;
+    return {bytes};
+#endif
+}
+
+Request Communicator::isend(const std::vector<double>& buffer, int dest, int tag) const
+{
+    auto result = Request();
+#ifdef HAVE_MPI
+    std::lock_guard<std::mutex> lock(library_mutex());
+    check(MPI_Isend(buffer.data(), int(buffer.size()), MPI_DOUBLE, dest, tag, comm, &result.request), "MPI_Isend");
+#else
+    (void) buffer;
+    (void) dest;
+    (void) tag;
+    throw std::logic_error("Communicator::isend: there are no other ranks");
+#endif
+    return result;
+}
+
+Request Communicator::irecv(std::vector<double>& buffer, int source, int tag) const
+{
+    auto result = Request();
+#ifdef HAVE_MPI
+    std::lock_guard<std::mutex> lock(library_mutex());
+    check(MPI_Irecv(buffer.data(), int(buffer.size()), MPI_DOUBLE, source, tag, comm, &result.request), "MPI_Irecv");
+#else
+    (void) buffer;
+    (void) source;
+    (void) tag;
+    throw std::logic_error("Communicator::irecv: there are no other ranks");
+#endif
+    return result;
+}
+
+void Communicator::abort(int code) const
+{
+#ifdef HAVE_MPI
+    MPI_Abort(comm, code);
+#endif
+    std::exit(code);
+}
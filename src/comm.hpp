@@ -0,0 +1,115 @@
+#pragma once
+#include <string>
+#include <vector>
+#ifdef HAVE_MPI
+#include <mpi.h>
+#endif
+
+
+
+
+// ============================================================================
+/**
+ * Thin wrapper over the handful of MPI operations the solver uses. Builds
+ * without HAVE_MPI get a serial communicator of one rank, for which every
+ * collective is the identity, so the calling code has no #ifdefs. Enable MPI
+ * with CXX = mpicxx and CXXFLAGS += -DHAVE_MPI in Makefile.in.
+ *
+ * MPI may be called from the main thread, the pool workers, and the
+ * background writer, so the library is initialized with
+ * MPI_THREAD_SERIALIZED and every call is made under one lock. Waits poll
+ * the request under the lock and yield in between, so no thread ever blocks
+ * inside MPI while holding it. Collectives issued from the background writer
+ * go through their own communicator (see duplicate), so that they are never
+ * interleaved with the main thread's collectives in a different order on
+ * different ranks.
+ */
+namespace mpi
+{
+    class Session;
+    class Communicator;
+    class Request;
+}
+
+
+
+
+// ============================================================================
+/**
+ * Initializes MPI for its lifetime.
+ */
+class mpi::Session
+{
+public:
+    Session(int& argc, const char**& argv);
+    ~Session();
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+};
+
+
+
+
+// ============================================================================
+/**
+ * A pending point-to-point operation. It must be waited on before the buffer
+ * it refers to is read, reused, or destroyed.
+ */
+class mpi::Request
+{
+public:
+    void wait();
+
+private:
+    friend class Communicator;
+#ifdef HAVE_MPI
+    MPI_Request request = MPI_REQUEST_NULL;
+#endif
+};
+
+
+
+
+// ============================================================================
+class mpi::Communicator
+{
+public:
+    /**
+     * Return the communicator of all ranks.
+     */
+    static Communicator world();
+
+    /**
+     * Return a new communicator over the same ranks, whose messages and
+     * collectives never match those of this one. This is itself a
+     * collective.
+     */
+    Communicator duplicate() const;
+
+    int rank() const;
+    int size() const;
+
+    double allreduce_max(double value) const;
+    double allreduce_sum(double value) const;
+    void allreduce_sum(std::vector<double>& values) const;
+    void barrier() const;
+
+    /**
+     * Return every rank's bytes, in rank order, on the root, and an empty
+     * vector on the other ranks.
+     */
+    std::vector<std::string> gather(const std::string& bytes, int root=0) const;
+
+    Request isend(const std::vector<double>& buffer, int dest, int tag) const;
+    Request irecv(std::vector<double>& buffer, int source, int tag) const;
+
+    /**
+     * Terminate all ranks, after an error that only this rank may have seen.
+     */
+    void abort(int code) const;
+
+private:
+#ifdef HAVE_MPI
+    MPI_Comm comm = MPI_COMM_WORLD;
+#endif
+};
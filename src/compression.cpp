@@ -0,0 +1,162 @@
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include "compression.hpp"
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+
+
+
+// ============================================================================
+static const int zstd_level = 3;
+
+static bool host_is_little_endian()
+{
+    const std::uint16_t one = 1;
+    return *reinterpret_cast<const char*>(&one) == 1;
+}
+
+/**
+ * Round the low (mantissa_bits - bits) bits of an IEEE value to nearest, and
+ * clear them.
+ */
+template <typename Word>
+static Word round_mantissa(Word w, int mantissa_bits, int bits)
+{
+    if (bits >= mantissa_bits)
+    {
+        return w;
+    }
+    const int drop = mantissa_bits - bits;
+    const Word half = Word(1) << (drop - 1);
+    const Word mask = ~((Word(1) << drop) - 1);
+    return (w + half) & mask;
+}
+
+
+
+
+// ============================================================================
+const char* compression::codec()
+{
+#ifdef HAVE_ZSTD
+    return "zstd";
+#else
+    return "rle";
+#endif
+}
+
+std::string compression::packed_dtype(int bits)
+{
+    return std::string(host_is_little_endian() ? "<" : ">") + (bits <= 23 ? "f4" : "f8");
+}
+
+std::vector<char> compression::pack(const double* data, std::size_t count, int bits)
+{
+    if (bits < 1 || bits > 52)
+    {
+        throw std::invalid_argument("compression::pack: bits must be in [1, 52]");
+    }
+
+    if (bits <= 23)
+    {
+        auto result = std::vector<char>(count * sizeof(float));
+
+        for (std::size_t n = 0; n < count; ++n)
+        {
+            const float f = data[n];
+            std::uint32_t w;
+            std::memcpy(&w, &f, sizeof(w));
+            w = round_mantissa<std::uint32_t>(w, 23, bits);
+            std::memcpy(result.data() + n * sizeof(w), &w, sizeof(w));
+        }
+        return result;
+    }
+
+    auto result = std::vector<char>(count * sizeof(double));
+
+    for (std::size_t n = 0; n < count; ++n)
+    {
+        std::uint64_t w;
+        std::memcpy(&w, data + n, sizeof(w));
+        w = round_mantissa<std::uint64_t>(w, 52, bits);
+        std::memcpy(result.data() + n * sizeof(w), &w, sizeof(w));
+    }
+    return result;
+}
+
+std::vector<char> compression::shuffle(const std::vector<char>& bytes, std::size_t itemsize)
+{
+    const std::size_t count = bytes.size() / itemsize;
+    auto result = std::vector<char>(bytes.size());
+
+    for (std::size_t k = 0; k < itemsize; ++k)
+    {
+        for (std::size_t n = 0; n < count; ++n)
+        {
+            result[k * count + n] = bytes[n * itemsize + k];
+        }
+    }
+    return result;
+}
+
+std::vector<char> compression::compress(const std::vector<char>& bytes)
+{
+#ifdef HAVE_ZSTD
+    auto result = std::vector<char>(ZSTD_compressBound(bytes.size()));
+    auto size = ZSTD_compress(result.data(), result.size(), bytes.data(), bytes.size(), zstd_level);
+
+    if (ZSTD_isError(size))
+    {
+        throw std::runtime_error(std::string("zstd: ") + ZSTD_getErrorName(size));
+    }
+    result.resize(size);
+    return result;
+#else
+    // PackBits: a header byte h < 128 is followed by h + 1 literal bytes, and
+    // h > 128 by one byte that is repeated 257 - h times.
+    const std::size_t n = bytes.size();
+    auto result = std::vector<char>();
+    auto i = std::size_t(0);
+
+    auto run_length = [&] (std::size_t start)
+    {
+        auto length = std::size_t(1);
+
+        while (start + length < n && length < 128 && bytes[start + length] == bytes[start])
+        {
+            ++length;
+        }
+        return length;
+    };
+
+    result.reserve(n / 4);
+
+    while (i < n)
+    {
+        const auto run = run_length(i);
+
+        if (run >= 3)
+        {
+            result.push_back(char(257 - run));
+            result.push_back(bytes[i]);
+            i += run;
+        }
+        else
+        {
+            auto end = i + 1;
+
+            while (end < n && end - i < 128 && run_length(end) < 3)
+            {
+                ++end;
+            }
+            result.push_back(char(end - i - 1));
+            result.insert(result.end(), bytes.begin() + i, bytes.begin() + end);
+            i = end;
+        }
+    }
+    return result;
+#endif
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <vector>
+
+
+
+
+// ============================================================================
+/**
+ * Reduced-precision, compressed encoding of double arrays, for snapshot
+ * output. An array is encoded in three stages:
+ *
+ *  1. pack: round each value to the given number of explicit mantissa bits,
+ *     and store it as a float32 if bits <= 23, or a float64 otherwise. The
+ *     bytes are in the host order; bits = 52 is lossless.
+ *  2. shuffle: transpose the bytes so that byte k of every value comes
+ *     before byte k + 1 of any value. The zeroed low mantissa bytes then
+ *     form long runs.
+ *  3. compress: zstd if the build has it, otherwise PackBits run-length
+ *     coding. Enable zstd with CXXFLAGS += -DHAVE_ZSTD and LDFLAGS += -lzstd
+ *     in Makefile.in.
+ */
+namespace compression
+{
+    /**
+     * Return the codec compress uses in this build: "zstd" or "rle".
+     */
+    const char* codec();
+
+    /**
+     * Return the numpy dtype string ("<f4", ">f8", ...) that pack produces
+     * for the given number of mantissa bits.
+     */
+    std::string packed_dtype(int bits);
+
+    std::vector<char> pack(const double* data, std::size_t count, int bits);
+    std::vector<char> shuffle(const std::vector<char>& bytes, std::size_t itemsize);
+    std::vector<char> compress(const std::vector<char>& bytes);
+}
@@ -3,15 +3,25 @@
 #include <sstream>
 #include <cmath>
 #include <vector>
-#include <thread>
-#include <future>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <complex>
+#include <unistd.h>
+#include "json.hpp"
 #include "app_utils.hpp"
 #include "ndarray.hpp"
 #include "physics.hpp"
 #include "patches.hpp"
-#include "ufunc.hpp"
 #include "atmo.hpp"
+#include "chkpt.hpp"
+#include "background_queue.hpp"
+#include "comm.hpp"
+#include "compression.hpp"
+#include "profiler.hpp"
 #include "thread_pool.hpp"
+#include "solver.hpp"
+#include "telemetry.hpp"
 
 using namespace patches2d;
 namespace hydro = newtonian_hydro;
@@ -22,676 +32,1116 @@ using run_status = atmo::run_status;
 
 
 // ============================================================================
-template <typename T>
-std::vector<char> swap_bytes(const std::vector<T>& buffer)
+/**
+ * Stages float32 values for the VTK writers in a fixed-size buffer, converting
+ * them to the requested byte order on the way in, and writes the buffer to
+ * the stream in large blocks. Callers ask for room with next(count) and fill
+ * it in a plain loop, so there is no per-value bookkeeping.
+ */
+class FloatStream
 {
-    auto res = std::vector<char>(buffer.size() * sizeof(T));
+public:
+    FloatStream(std::ostream& os, bool big_endian)
+    : os(os)
+    , swap(big_endian == host_is_little_endian())
+    , buffer(1 << 16)
+    , size(0)
+    {
+    }
+
+    ~FloatStream()
+    {
+        flush();
+    }
 
-    for (std::size_t n = 0; n < buffer.size(); ++n)
+    static bool host_is_little_endian()
     {
-        const char* src = reinterpret_cast<const char*>(buffer.data()) + n * sizeof(T);
-        char* dst = static_cast<char*>(res.data()) + n * sizeof(T);
+        const std::uint16_t one = 1;
+        return *reinterpret_cast<const char*>(&one) == 1;
+    }
 
-        for (unsigned int b = 0; b < sizeof(T); ++b)
+    /**
+     * Return a pointer to room for count more values. The room is only valid
+     * until the next call.
+     */
+    std::uint32_t* next(std::size_t count)
+    {
+        if (size + count > buffer.size())
         {
-            dst[sizeof(T) - b - 1] = src[b];
+            flush();
+            buffer.resize(std::max(buffer.size(), count));
         }
+        size += count;
+        return buffer.data() + size - count;
     }
-    return res;
-}
 
-template <typename T>
-void write_swapped_bytes_and_clear(std::ostream& os, std::vector<T>& buffer)
-{
-    auto bytes = swap_bytes(buffer);
-    os.write(bytes.data(), bytes.size());
-    buffer.clear();
-}
+    /**
+     * Return the bits of x as a float32 in the byte order of this stream.
+     */
+    std::uint32_t encode(double x) const
+    {
+        const float f = x;
+        std::uint32_t b;
+        std::memcpy(&b, &f, sizeof(b));
+        return swap ? (b >> 24) | ((b >> 8) & 0xff00) | ((b << 8) & 0xff0000) | (b << 24) : b;
+    }
+
+    void flush()
+    {
+        os.write(reinterpret_cast<const char*>(buffer.data()), size * sizeof(std::uint32_t));
+        size = 0;
+    }
+
+private:
+    std::ostream& os;
+    bool swap;
+    std::vector<std::uint32_t> buffer;
+    std::size_t size;
+};
 
 
 
 
 // ============================================================================
-void write_chkpt(const Database& database, run_config cfg, run_status sts, int count)
+/**
+ * Write the legacy VTK format: a single big-endian structured grid spanning
+ * all the blocks. Rows of the grid cross every radial block, so each row is
+ * streamed block by block straight from the database, without assembling
+ * the domain. Row j is read from the polar block that contains it; the polar
+ * blocks share their edge vertices, which are taken from the lower block.
+ */
+void write_vtk_legacy(const Database& database, run_config cfg, std::ostream& os)
 {
-    auto filename = cfg.make_filename_chkpt(count);
-    std::cout << "write checkpoint " << filename << std::endl;
+    auto cons_to_prim = hydro::cons_to_prim();
+    auto verts = std::vector<std::vector<const Database::Array*>>(cfg.num_blocks);
+    auto conss = std::vector<std::vector<const Database::Array*>>(cfg.num_blocks);
+    auto num_cells_i = 0;
 
-    filesystem::remove_recurse(filename);
-    filesystem::require_dir(filename);
-    auto parts = std::vector<std::string>{filename};
+    for (int b = 0; b < cfg.num_blocks; ++b)
+    {
+        for (int c = 0; c < cfg.num_blocks_j; ++c)
+        {
+            verts[b].push_back(&database.at(std::make_tuple(b, c, 0, Field::vert_coords), Field::vert_coords));
+            conss[b].push_back(&database.at(std::make_tuple(b, c, 0, Field::conserved), Field::conserved));
+        }
+        num_cells_i += conss[b].front()->shape(0);
+    }
+    const int nj = conss.front().front()->shape(1);
+    const int num_cells_j = nj * cfg.num_blocks_j;
 
 
-    // Write the run config and status to json
     // ------------------------------------------------------------------------
-    auto cfg_stream = std::fstream(cfg.make_filename_config(count), std::ios::out);
-    auto sts_stream = std::fstream(cfg.make_filename_status(count), std::ios::out);
-
-    cfg.tojson(cfg_stream);
-    sts.tojson(sts_stream);
+    // Write header
+    // ------------------------------------------------------------------------
+    os << "# vtk DataFile Version 3.0\n";
+    os << "My Data" << "\n";
+    os << "BINARY\n";
+    os << "DATASET STRUCTURED_GRID\n";
+    os << "DIMENSIONS " << num_cells_i + 1 << " " << num_cells_j + 1 << " " << 1 << "\n";
 
 
-    // Write patch data
     // ------------------------------------------------------------------------
-    for (const auto& patch : database)
+    // Write vertex points
+    // ------------------------------------------------------------------------
+    os << "POINTS " << (num_cells_i + 1) * (num_cells_j + 1) << " FLOAT\n";
     {
-        parts.push_back(to_string(patch.first));
-        filesystem::require_dir(filesystem::parent(filesystem::join(parts)));
-        nd::tofile(patch.second, filesystem::join(parts));
-        parts.pop_back();
+        FloatStream stream(os, true);
+
+        for (int J = 0; J < num_cells_j + 1; ++J)
+        {
+            const int c = std::min(J / nj, cfg.num_blocks_j - 1);
+            const int j = J - c * nj;
+
+            for (int b = 0; b < cfg.num_blocks; ++b)
+            {
+                const auto& X = *verts[b][c];
+                const int ni = X.shape(0) - (b + 1 < cfg.num_blocks);
+                auto dst = stream.next(3 * ni);
+
+                for (int i = 0; i < ni; ++i)
+                {
+                    const double r = X(i, j, 0);
+                    const double q = X(i, j, 1);
+                    dst[3 * i + 0] = stream.encode(r * std::sin(q));
+                    dst[3 * i + 1] = stream.encode(0.0);
+                    dst[3 * i + 2] = stream.encode(r * std::cos(q));
+                }
+            }
+        }
     }
-}
 
-void load_patches_from_chkpt(Database& database, std::string filename)
-{
-    auto path = std::vector<std::string>{filename};
 
-    for (auto patch : filesystem::listdir(filename))
+    // ------------------------------------------------------------------------
+    // Write primitive data
+    // ------------------------------------------------------------------------
+    os << "CELL_DATA " << num_cells_i * num_cells_j << "\n";
+
+    for (const auto& field : {std::make_pair("density", 0), std::make_pair("radial_velocity", 1), std::make_pair("pressure", 4)})
     {
-        path.push_back(patch);
+        os << "SCALARS " << field.first << " " << "FLOAT " << 1 << "\n";
+        os << "LOOKUP_TABLE default\n";
+
+        FloatStream stream(os, true);
 
-        if (filesystem::isdir(filesystem::join(path)))
+        for (int J = 0; J < num_cells_j; ++J)
         {
-            for (auto field : filesystem::listdir(filesystem::join(path)))
+            const int c = J / nj;
+            const int j = J - c * nj;
+
+            for (int b = 0; b < cfg.num_blocks; ++b)
             {
-                path.push_back(field);
-                auto ifs = std::ifstream(filesystem::join(path));
-                auto str = std::string(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
-                auto data = nd::array<double, 3>::loads(str);
-                auto index = patches2d::parse_index(filesystem::join({patch, field}));
-                database.insert(index, data);
-                path.pop_back();
+                const auto& U = *conss[b][c];
+                auto dst = stream.next(U.shape(0));
+
+                for (int i = 0; i < U.shape(0); ++i)
+                {
+                    const auto P = cons_to_prim({U(i, j, 0), U(i, j, 1), U(i, j, 2), U(i, j, 3), U(i, j, 4)});
+                    dst[i] = stream.encode(P[field.second]);
+                }
             }
         }
-        path.pop_back();
     }
 }
 
-void write_vtk(const Database& database, run_config cfg, run_status /*sts*/, int count)
+/**
+ * Write the VTK XML structured grid format (.vts), with one piece per block
+ * (radial blocks outermost) and the data in raw appended form, in the host byte order. Each block is
+ * converted in a single pass: its vertices, then its three primitive fields.
+ */
+void write_vtk_xml(const Database& database, run_config cfg, std::ostream& os)
 {
-    auto filename = cfg.make_filename_vtk(count);
-
-    std::cout << "write VTK " << filename << std::endl;
-    filesystem::require_dir(filesystem::parent(filename));
+    auto cons_to_prim = hydro::cons_to_prim();
+    auto byte_order = FloatStream::host_is_little_endian() ? "LittleEndian" : "BigEndian";
+    auto names = std::array<const char*, 3>{"density", "radial_velocity", "pressure"};
+    auto fields = std::array<int, 3>{0, 1, 4};
+    auto blocks = std::vector<std::array<int, 2>>();
+    auto extents = std::vector<std::array<int, 4>>(); // i0, ni, j0, nj
+    auto num_cells_i = 0;
+    auto num_cells_j = 0;
+
+    for (int b = 0; b < cfg.num_blocks; ++b)
+    {
+        num_cells_j = 0;
 
-    auto stream = std::fstream(filename, std::ios::out);
-    auto cons_to_prim = ufunc::vfrom(hydro::cons_to_prim());
-    auto vert = database.assemble(0, cfg.num_blocks, 0, 1, 0, Field::vert_coords);
-    auto buffer = std::vector<float>();
+        for (int c = 0; c < cfg.num_blocks_j; ++c)
+        {
+            const auto& U = database.at(std::make_tuple(b, c, 0, Field::conserved), Field::conserved);
+            blocks.push_back({b, c});
+            extents.push_back({num_cells_i, U.shape(0), num_cells_j, U.shape(1)});
+            num_cells_j += U.shape(1);
+        }
+        num_cells_i += extents.back()[1];
+    }
 
 
     // ------------------------------------------------------------------------
-    // Write header
+    // Write the XML description; offsets are into the appended data
     // ------------------------------------------------------------------------
-    stream << "# vtk DataFile Version 3.0\n";
-    stream << "My Data" << "\n";
-    stream << "BINARY\n";
-    stream << "DATASET STRUCTURED_GRID\n";
-    stream << "DIMENSIONS " << vert.shape(0) << " " << vert.shape(1) << " " << 1 << "\n";
+    auto offset = std::uint64_t(0);
 
+    os << "<?xml version=\"1.0\"?>\n";
+    os << "<VTKFile type=\"StructuredGrid\" version=\"1.0\" byte_order=\"" << byte_order << "\" header_type=\"UInt64\">\n";
+    os << "  <StructuredGrid WholeExtent=\"0 " << num_cells_i << " 0 " << num_cells_j << " 0 0\">\n";
 
-    // ------------------------------------------------------------------------
-    // Write vertex points
-    // ------------------------------------------------------------------------
-    stream << "POINTS " << vert.shape(0) * vert.shape(1) << " FLOAT\n";
-
-    for (int j = 0; j < vert.shape(1); ++j)
+    for (const auto& e : extents)
     {
-        for (int i = 0; i < vert.shape(0); ++i)
+        os << "    <Piece Extent=\"" << e[0] << " " << e[0] + e[1] << " " << e[2] << " " << e[2] + e[3] << " 0 0\">\n";
+        os << "      <Points>\n";
+        os << "        <DataArray type=\"Float32\" NumberOfComponents=\"3\" format=\"appended\" offset=\"" << offset << "\"/>\n";
+        os << "      </Points>\n";
+        os << "      <CellData Scalars=\"" << names[0] << "\">\n";
+        offset += sizeof(std::uint64_t) + 3 * sizeof(float) * (e[1] + 1) * (e[3] + 1);
+
+        for (auto name : names)
         {
-            const double r = vert(i, j, 0);
-            const double q = vert(i, j, 1);
-            const double x = r * std::sin(q);
-            const double z = r * std::cos(q);
-            buffer.push_back(x);
-            buffer.push_back(0.0);
-            buffer.push_back(z);
+            os << "        <DataArray type=\"Float32\" Name=\"" << name << "\" format=\"appended\" offset=\"" << offset << "\"/>\n";
+            offset += sizeof(std::uint64_t) + sizeof(float) * e[1] * e[3];
         }
+        os << "      </CellData>\n";
+        os << "    </Piece>\n";
     }
-    write_swapped_bytes_and_clear(stream, buffer);
+    os << "  </StructuredGrid>\n";
+    os << "  <AppendedData encoding=\"raw\">\n";
+    os << "_";
 
 
     // ------------------------------------------------------------------------
-    // Write primitive data
+    // Write the appended data, block by block
     // ------------------------------------------------------------------------
-    auto cons = database.assemble(0, cfg.num_blocks, 0, 1, 0, Field::conserved);
-    auto prim = cons_to_prim(cons);
-    stream << "CELL_DATA " << prim.shape(0) * prim.shape(1) << "\n";
+    FloatStream stream(os, ! FloatStream::host_is_little_endian());
 
-    stream << "SCALARS " << "density " << "FLOAT " << 1 << "\n";
-    stream << "LOOKUP_TABLE default\n";
-
-    for (int j = 0; j < prim.shape(1); ++j)
+    for (auto block : blocks)
     {
-        for (int i = 0; i < prim.shape(0); ++i)
+        const auto& X = database.at(std::make_tuple(block[0], block[1], 0, Field::vert_coords), Field::vert_coords);
+        const auto& U = database.at(std::make_tuple(block[0], block[1], 0, Field::conserved), Field::conserved);
+        const int ni = U.shape(0);
+        const int nj = U.shape(1);
+        const int nc = ni * nj;
+
+        const int np = (ni + 1) * (nj + 1);
+        const std::uint64_t point_bytes = 3 * sizeof(float) * np;
+        const std::uint64_t cell_bytes = sizeof(float) * nc;
+
+        // Each appended block is a UInt64 byte count, which takes two
+        // slots of the stream, followed by the values.
+        auto points = stream.next(2 + 3 * np);
+        std::memcpy(points, &point_bytes, sizeof(point_bytes));
+        points += 2;
+
+        for (int j = 0; j < nj + 1; ++j)
         {
-            buffer.push_back(prim(i, j, 0));
+            for (int i = 0; i < ni + 1; ++i)
+            {
+                const double r = X(i, j, 0);
+                const double q = X(i, j, 1);
+                const int n = j * (ni + 1) + i;
+                points[3 * n + 0] = stream.encode(r * std::sin(q));
+                points[3 * n + 1] = stream.encode(0.0);
+                points[3 * n + 2] = stream.encode(r * std::cos(q));
+            }
         }
-    }
-    write_swapped_bytes_and_clear(stream, buffer);
 
-    stream << "SCALARS " << "radial_velocity " << "FLOAT " << 1 << "\n";
-    stream << "LOOKUP_TABLE default\n";
+        // The three scalar blocks are filled together, in one pass over the
+        // cells, so the room for all of them is taken in one call.
+        auto cells = stream.next(3 * (2 + nc));
 
-    for (int j = 0; j < prim.shape(1); ++j)
-    {
-        for (int i = 0; i < prim.shape(0); ++i)
+        for (int f = 0; f < 3; ++f)
         {
-            buffer.push_back(prim(i, j, 1));
+            std::memcpy(cells + f * (2 + nc), &cell_bytes, sizeof(cell_bytes));
+        }
+
+        for (int j = 0; j < nj; ++j)
+        {
+            for (int i = 0; i < ni; ++i)
+            {
+                const auto P = cons_to_prim({U(i, j, 0), U(i, j, 1), U(i, j, 2), U(i, j, 3), U(i, j, 4)});
+                const int n = j * ni + i;
+
+                for (int f = 0; f < 3; ++f)
+                {
+                    cells[f * (2 + nc) + 2 + n] = stream.encode(P[fields[f]]);
+                }
+            }
         }
     }
-    write_swapped_bytes_and_clear(stream, buffer);
+    stream.flush();
+
+    os << "\n  </AppendedData>\n";
+    os << "</VTKFile>\n";
+}
+
+void write_vtk(const Database& database, run_config cfg, run_status /*sts*/, int count)
+{
+    auto filename = cfg.make_filename_vtk(count);
+
+    std::cout << "write VTK " << filename << std::endl;
+    filesystem::require_dir(filesystem::parent(filename));
 
-    stream << "SCALARS " << "pressure " << "FLOAT " << 1 << "\n";
-    stream << "LOOKUP_TABLE default\n";
+    auto stream = std::ofstream(filename, std::ios::out | std::ios::binary);
 
-    for (int j = 0; j < prim.shape(1); ++j)
+    if (cfg.vtk_format == "vts")
     {
-        for (int i = 0; i < prim.shape(0); ++i)
-        {
-            buffer.push_back(prim(i, j, 4));
-        }
+        write_vtk_xml(database, cfg, stream);
+    }
+    else
+    {
+        write_vtk_legacy(database, cfg, stream);
     }
-    write_swapped_bytes_and_clear(stream, buffer);
 }
 
 
 
 
 // ============================================================================
-struct MeshGeometry
+/**
+ * A compressed, reduced-precision copy of the conserved variables (see
+ * compression.hpp), written to NNNN.snap. The file has the layout of
+ * patches.dat with the magic "ATMOSNAP" and 8-byte alignment. Each index
+ * entry has "index", "dtype", "shape", "bits", "shuffle" (the item size of
+ * the byte shuffle), "codec", "offset", "nbytes" (compressed), and "rawbytes"
+ * (uncompressed). The index also holds the run "config", from which a reader
+ * regenerates the mesh, and the simulation "time".
+ */
+struct CompressedSnapshot
 {
-    MeshGeometry(
-        const nd::array<double, 3>& A,
-        const nd::array<double, 3>& B,
-        const nd::array<double, 3>& C,
-        const nd::array<double, 3>& D)
-    : centroids(A)
-    , volumes(B)
-    , face_areas_i(C)
-    , face_areas_j(D)
-    {
-    }
-
-    const nd::array<double, 3>& centroids;
-    const nd::array<double, 3>& volumes;
-    const nd::array<double, 3>& face_areas_i;
-    const nd::array<double, 3>& face_areas_j;
+    std::vector<Database::Index> indexes;
+    std::vector<std::array<int, 3>> shapes;
+    std::vector<std::vector<char>> payloads;
+    std::vector<std::size_t> raw_sizes;
+    int bits = 52;
 };
 
+static const char snap_file_magic[8] = {'A', 'T', 'M', 'O', 'S', 'N', 'A', 'P'};
+static const std::size_t snap_file_alignment = 8;
 
+void write_snap(const CompressedSnapshot& snap, run_config cfg, run_status sts, int count)
+{
+    auto filename = cfg.make_filename_snap(count);
+    auto config = std::stringstream();
+    auto index = nlohmann::json();
+    auto offsets = std::vector<std::size_t>();
+    auto offset = std::size_t(0);
+    auto double_total = std::size_t(0);
+
+    cfg.tojson(config);
+    index["config"] = nlohmann::json::parse(config.str());
+    index["time"] = sts.time;
+    index["alignment"] = snap_file_alignment;
+    index["patches"] = nlohmann::json::array();
+
+    for (std::size_t n = 0; n < snap.indexes.size(); ++n)
+    {
+        const auto& shape = snap.shapes[n];
+
+        index["patches"].push_back({
+            {"index", to_string(snap.indexes[n])},
+            {"dtype", compression::packed_dtype(snap.bits)},
+            {"shape", {shape[0], shape[1], shape[2]}},
+            {"bits", snap.bits},
+            {"shuffle", snap.bits <= 23 ? sizeof(float) : sizeof(double)},
+            {"codec", compression::codec()},
+            {"offset", offset},
+            {"nbytes", snap.payloads[n].size()},
+            {"rawbytes", snap.raw_sizes[n]}});
+        offsets.push_back(offset);
+        offset = binary_file::align_up(offset + snap.payloads[n].size(), snap_file_alignment);
+        double_total += std::size_t(shape[0]) * shape[1] * shape[2] * sizeof(double);
+    }
 
+    std::cout
+    << "write snapshot " << filename
+    << " (" << offset / 1e6 << " MB, ratio " << double_total / std::max(double(offset), 1.0) << " to float64)"
+    << std::endl;
+    filesystem::require_dir(filesystem::parent(filename));
 
-// ============================================================================
-nd::array<double, 3> mesh_vertices(int ni, int nj, std::array<double, 4> extent)
-{
-    auto X = nd::array<double, 3>(ni + 1, nj + 1, 2);
-    auto x0 = extent[0];
-    auto x1 = extent[1];
-    auto y0 = extent[2];
-    auto y1 = extent[3];
+    const int fd = binary_file::open_for_writing(filename);
 
-    for (int i = 0; i < ni + 1; ++i)
-    {
-        for (int j = 0; j < nj + 1; ++j)
+    try {
+        auto data_start = binary_file::write_file_header(fd, snap_file_magic, index.dump(), snap_file_alignment, filename);
+
+        for (std::size_t n = 0; n < snap.payloads.size(); ++n)
         {
-            X(i, j, 0) = x0 * std::pow(x1 / x0, double(i) / ni);
-            X(i, j, 1) = y0 + (y1 - y0) * j / nj;
+            binary_file::write_at(fd, snap.payloads[n].data(), snap.payloads[n].size(), data_start + offsets[n], filename);
         }
     }
-    return X;
-}
-
-nd::array<double, 3> mesh_cell_centroids(const nd::array<double, 3>& verts)
-{
-    auto centroid_r = ufunc::from([] (double r0, double r1)
-    {
-        return std::sqrt(r0 * r1);
-    });
-    auto centroid_q = ufunc::from([] (double q0, double q1)
+    catch (...)
     {
-        return 0.5 * (q0 + q1);
-    });
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+}
 
-    auto _ = nd::axis::all();
-    auto mi = verts.shape(0);
-    auto mj = verts.shape(1);
-    auto r0 = verts.select(_|0|mi-1, _|0|mj-1, _|0|1);
-    auto r1 = verts.select(_|1|mi-0, _|1|mj-0, _|0|1);
-    auto q0 = verts.select(_|0|mi-1, _|0|mj-1, _|1|2);
-    auto q1 = verts.select(_|1|mi-0, _|1|mj-0, _|1|2);
-    auto res = nd::array<double, 3>(mi - 1, mj - 1, 2);
 
-    res.select(_, _, _|0|1) = centroid_r(r0, r1);
-    res.select(_, _, _|1|2) = centroid_q(q0, q1);
 
-    return res;
-}
 
-nd::array<double, 3> mesh_cell_volumes(const nd::array<double, 3>& verts)
+// ============================================================================
+/**
+ * Return a deep copy of the patches the output writers read: the conserved
+ * variables and the vertex coordinates. The patches are copied in parallel on
+ * the pool.
+ */
+Database snapshot(ThreadPool& pool, const Database& database)
 {
-    auto _ = nd::axis::all();
-    auto p1 = 2 * M_PI;
-    auto p0 = 0;
-    auto mi = verts.shape(0);
-    auto mj = verts.shape(1);
-    auto r0 = verts.select(_|0|mi-1, _|0|mj-1, _|0|1);
-    auto r1 = verts.select(_|1|mi-0, _|1|mj-0, _|0|1);
-    auto q0 = verts.select(_|0|mi-1, _|0|mj-1, _|1|2);
-    auto q1 = verts.select(_|1|mi-0, _|1|mj-0, _|1|2);
-
-    auto volume = ufunc::nfrom([p0, p1] (std::array<double, 4> extent)
-    {
-        auto r0 = extent[0];
-        auto r1 = extent[1];
-        auto q0 = extent[2];
-        auto q1 = extent[3];
-        return -1. / 3 * (r1 * r1 * r1 - r0 * r0 * r0) * (std::cos(q1) - std::cos(q0)) * (p1 - p0);
-    });
-
-    auto args = std::array<nd::array<double, 3>, 4>{r0, r1, q0, q1};
-    return volume(args);
-}
+    auto indexes = std::vector<Database::Index>();
+    auto sources = std::vector<const Database::Array*>();
+    auto ni = 0;
+    auto nj = 0;
 
-nd::array<double, 3> mesh_face_areas_i(const nd::array<double, 3>& verts)
-{
-    auto _ = nd::axis::all();
-    auto p1 = 2 * M_PI;
-    auto p0 = 0;
-    // auto mi = verts.shape(0);
-    auto mj = verts.shape(1);
-    auto r0 = verts.select(_, _|0|mj-1, _|0|1);
-    auto r1 = verts.select(_, _|1|mj-0, _|0|1);
-    auto q0 = verts.select(_, _|0|mj-1, _|1|2);
-    auto q1 = verts.select(_, _|1|mj-0, _|1|2);
-
-    auto area = ufunc::nfrom([p0, p1] (std::array<double, 4> extent)
-    {
-        auto r0 = extent[0];
-        // auto r1 = extent[1];
-        auto q0 = extent[2];
-        auto q1 = extent[3];
-        return -r0 * r0 * (p1 - p0) * (std::cos(q1) - std::cos(q0));
-    });
+    for (const auto& patch : database)
+    {
+        if (std::get<3>(patch.first) == Field::conserved)
+        {
+            ni = patch.second.shape(0);
+            nj = patch.second.shape(1);
+        }
+        else if (std::get<3>(patch.first) != Field::vert_coords)
+        {
+            continue;
+        }
+        indexes.push_back(patch.first);
+        sources.push_back(&patch.second);
+    }
 
-    auto args = std::array<nd::array<double, 3>, 4>{r0, r1, q0, q1};
-    return area(args);
-}
+    auto copies = std::vector<Database::Array>(indexes.size());
+    auto result = Database(ni, nj, create_header());
 
-nd::array<double, 3> mesh_face_areas_j(const nd::array<double, 3>& verts)
-{
-    auto _ = nd::axis::all();
-    auto p1 = 2 * M_PI;
-    auto p0 = 0;
-    auto mi = verts.shape(0);
-    // auto mj = verts.shape(1);
-    auto r0 = verts.select(_|0|mi-1, _, _|0|1);
-    auto r1 = verts.select(_|1|mi-0, _, _|0|1);
-    auto q0 = verts.select(_|0|mi-1, _, _|1|2);
-    auto q1 = verts.select(_|1|mi-0, _, _|1|2);
-
-    auto area = ufunc::nfrom([p0, p1] (std::array<double, 4> extent)
-    {
-        auto r0 = extent[0];
-        auto r1 = extent[1];
-        auto q0 = extent[2];
-        // auto q1 = extent[3];
-        return 0.5 * (r1 + r0) * (r1 - r0) * (p1 - p0) * std::sin(q0);
+    pool.parallel_for(0, indexes.size(), [&] (int n)
+    {
+        copies[n] = first_touch_copy(*sources[n]);
     });
 
-    auto args = std::array<nd::array<double, 3>, 4>{r0, r1, q0, q1};
-    return area(args);
+    for (std::size_t n = 0; n < indexes.size(); ++n)
+    {
+        result.insert(indexes[n], copies[n]);
+    }
+    return result;
 }
 
-
-
-
-// ============================================================================
-nd::array<double, 3> pad_with_zeros_j(const nd::array<double, 3>& A)
+/**
+ * Append a record to a byte string, as its length followed by its bytes, or
+ * read back the record at the given position and advance past it. These
+ * pack many patches into the one message that Communicator::gather takes.
+ */
+static void append_record(std::string& bytes, const std::string& record)
 {
-    auto _ = nd::axis::all();
-    auto ni = A.shape(0);
-    auto nj = A.shape(1);
-    auto nk = A.shape(2);
-
-    auto res = nd::ndarray<double, 3>(ni, nj + 2, nk);
-    res.select(_, _|1|nj+1, _) = A;
-    return res;
+    char length[8];
+    binary_file::encode_uint64(record.size(), length);
+    bytes.append(length, 8);
+    bytes.append(record);
 }
 
-
-
-
-// ============================================================================
-#define MIN3ABS(a, b, c) std::min(std::min(std::fabs(a), std::fabs(b)), std::fabs(c))
-#define SGN(x) std::copysign(1, x)
-
-static double minmod(double ul, double u0, double ur, double theta)
+static std::string read_record(const std::string& bytes, std::size_t& position)
 {
-    const double a = theta * (u0 - ul);
-    const double b =   0.5 * (ur - ul);
-    const double c = theta * (ur - u0);
-    return 0.25 * std::fabs(SGN(a) + SGN(b)) * (SGN(a) + SGN(c)) * MIN3ABS(a, b, c);
+    if (position + 8 > bytes.size() || position + 8 + binary_file::decode_uint64(bytes.data() + position) > bytes.size())
+    {
+        throw std::runtime_error("read_record: message is truncated");
+    }
+    const auto length = binary_file::decode_uint64(bytes.data() + position);
+    position += 8 + length;
+    return bytes.substr(position - length, length);
 }
 
-struct gradient_plm
+/**
+ * Return, on rank 0, a database holding the conserved variables and vertex
+ * coordinates of every rank's patches, for the writers that need the whole
+ * domain; on the other ranks, return null. This is a collective over comm.
+ */
+std::shared_ptr<Database> gather_patches(const Database& database, const mpi::Communicator& comm)
 {
-    gradient_plm(double theta) : theta(theta) {}
+    auto bytes = std::string();
+    auto ni = 0;
+    auto nj = 0;
 
-    double inline operator()(double a, double b, double c) const
+    for (const auto& patch : database)
     {
-        return minmod(a, b, c, theta);
+        if (std::get<3>(patch.first) == Field::conserved)
+        {
+            ni = patch.second.shape(0);
+            nj = patch.second.shape(1);
+        }
+        else if (std::get<3>(patch.first) != Field::vert_coords)
+        {
+            continue;
+        }
+        append_record(bytes, to_string(patch.first));
+        append_record(bytes, patch.second.dumps());
     }
-    double theta;
-};
 
+    auto parts = comm.gather(bytes);
 
+    if (comm.rank() != 0)
+    {
+        return nullptr;
+    }
+    auto result = std::make_shared<Database>(ni, nj, create_header());
 
+    for (const auto& part : parts)
+    {
+        auto position = std::size_t(0);
 
-// ============================================================================
-auto advance_2d(hydro::source_terms source_terms, nd::array<double, 3> U0, const MeshGeometry& G, double dt)
+        while (position < part.size())
+        {
+            auto index = patches2d::parse_index(read_record(part, position));
+            result->insert(index, Database::Array::loads(read_record(part, position)));
+        }
+    }
+    return result;
+}
+
+/**
+ * Compress the conserved variables for a snapshot, one patch per pool task.
+ * The result shares nothing with the database, so it replaces the deep copy
+ * that the other output tasks take. The time and bytes are reported under
+ * the compress phase.
+ */
+CompressedSnapshot compress_snapshot(ThreadPool& pool, const Database& database, int bits, profiler::Profiler* profiler)
 {
-    auto _ = nd::axis::all();
+    auto snap = CompressedSnapshot();
+    auto sources = std::vector<const Database::Array*>();
 
-    auto update_formula = [dt] (std::array<double, 5> s, std::array<double, 5> df, std::array<double, 1> dv)
+    for (const auto& patch : database)
     {
-        return std::array<double, 5>{
-            dt * (s[0] - df[0] / dv[0]),
-            dt * (s[1] - df[1] / dv[0]),
-            dt * (s[2] - df[2] / dv[0]),
-            dt * (s[3] - df[3] / dv[0]),
-            dt * (s[4] - df[4] / dv[0]),
-        };
-    };
+        if (std::get<3>(patch.first) == Field::conserved)
+        {
+            const auto& A = patch.second;
+            snap.indexes.push_back(patch.first);
+            snap.shapes.push_back({A.shape(0), A.shape(1), A.shape(2)});
+            sources.push_back(&A);
+        }
+    }
+    snap.payloads.resize(sources.size());
+    snap.raw_sizes.resize(sources.size());
+    snap.bits = bits;
 
-    auto flux_times_area_formula = [] (std::array<double, 5> f, std::array<double, 1> da)
+    pool.parallel_for(0, sources.size(), [&] (int n)
     {
-        return std::array<double, 5>{
-            f[0] * da[0],
-            f[1] * da[0],
-            f[2] * da[0],
-            f[3] * da[0],
-            f[4] * da[0],
-        };
-    };
+        profiler::Scope scope(profiler, profiler::compress, n);
 
-    auto gradient_est = ufunc::from(gradient_plm(2.0));
-    auto advance_cons = ufunc::vfrom(update_formula);
-    auto evaluate_src = ufunc::vfrom(source_terms);
-    auto cons_to_prim = ufunc::vfrom(hydro::cons_to_prim());
-    auto godunov_flux_i = ufunc::vfrom(hydro::riemann_hlle({1, 0, 0}));
-    auto godunov_flux_j = ufunc::vfrom(hydro::riemann_hlle({0, 1, 0}));
-    auto extrap_l = ufunc::from([] (double a, double b) { return a - b * 0.5; });
-    auto extrap_r = ufunc::from([] (double a, double b) { return a + b * 0.5; });
-    auto flux_times_area = ufunc::vfrom(flux_times_area_formula);
-
-    auto mi = U0.shape(0);
-    auto mj = U0.shape(1);
-    auto P0 = cons_to_prim(U0);
-
-    auto Fhi = [&] ()
-    {
-        auto Pa = P0.select(_|0|mi-2, _, _);
-        auto Pb = P0.select(_|1|mi-1, _, _);
-        auto Pc = P0.select(_|2|mi-0, _, _);
-        auto Gb = gradient_est(Pa, Pb, Pc);
-        auto Pl = extrap_l(Pb, Gb);
-        auto Pr = extrap_r(Pb, Gb);
-        auto Fh = godunov_flux_i(Pr.take<0>(_|0|mi-3), Pl.take<0>(_|1|mi-2));
-        auto Fa = flux_times_area(Fh, G.face_areas_i);
-        return Fa;
-    }();
-
-    auto Fhj = [&] ()
-    {
-        auto Pa = P0.select(_|2|mi-2, _|0|mj-2, _);
-        auto Pb = P0.select(_|2|mi-2, _|1|mj-1, _);
-        auto Pc = P0.select(_|2|mi-2, _|2|mj-0, _);
-        auto Gb = pad_with_zeros_j(gradient_est(Pa, Pb, Pc));
-        auto Pl = extrap_l(P0.take<0>(_|2|mi-2), Gb);
-        auto Pr = extrap_r(P0.take<0>(_|2|mi-2), Gb);
-        auto Fh = pad_with_zeros_j(godunov_flux_j(Pr.take<1>(_|0|mj-1), Pl.take<1>(_|1|mj)));
-        auto Fa = flux_times_area(Fh, G.face_areas_j);
-        return Fa;
-    }();
-
-    auto dFi = Fhi.take<0>(_|1|mi-3) - Fhi.take<0>(_|0|mi-4);
-    auto dFj = Fhj.take<1>(_|1|mj+1) - Fhj.take<1>(_|0|mj+0);
-    auto dF = dFi + dFj;
-
-    auto S0 = evaluate_src(P0.take<0>(_|2|mi-2), G.centroids);
-    auto dU = advance_cons(S0, dF, G.volumes);
-
-    return U0.take<0>(_|2|mi-2) + dU;
-}
+        const auto& A = *sources[n];
+        const auto& shape = snap.shapes[n];
+        auto values = std::vector<double>();
+        values.reserve(std::size_t(shape[0]) * shape[1] * shape[2]);
 
+        for (int i = 0; i < shape[0]; ++i)
+        {
+            for (int j = 0; j < shape[1]; ++j)
+            {
+                for (int k = 0; k < shape[2]; ++k)
+                {
+                    values.push_back(A(i, j, k));
+                }
+            }
+        }
+        auto packed = compression::pack(values.data(), values.size(), bits);
+        auto itemsize = bits <= 23 ? sizeof(float) : sizeof(double);
 
+        snap.payloads[n] = compression::compress(compression::shuffle(packed, itemsize));
+        snap.raw_sizes[n] = packed.size();
 
+        if (profiler)
+        {
+            profiler->add_bytes(profiler::compress, values.size() * sizeof(double), snap.payloads[n].size());
+        }
+    });
+    return snap;
+}
 
-// ============================================================================
-void update_2d_threaded(
-    ThreadPool& pool,
-    hydro::source_terms source_terms,
-    Database& database, double dt, double rk_factor)
+/**
+ * Return, on rank 0, the compressed patches of every rank in one snapshot;
+ * on the other ranks, return an empty one. The patches are compressed where
+ * they live, so only the compressed bytes are sent. This is a collective
+ * over comm.
+ */
+CompressedSnapshot gather_snapshot(const CompressedSnapshot& snap, const mpi::Communicator& comm)
 {
-    using Result = std::pair<Database::Index, Database::Array>;
-    auto futures = std::vector<std::future<Result>>();
+    auto bytes = std::string();
 
-    auto update_task = [S = source_terms] (Database::Index index, const Database::Array& U,
-			   const MeshGeometry& G, double dt)
+    for (std::size_t n = 0; n < snap.indexes.size(); ++n)
     {
-        return std::make_pair(index, advance_2d(S, U, G, dt));
-    };
+        const auto& shape = snap.shapes[n];
+        const auto meta = nlohmann::json{{"shape", {shape[0], shape[1], shape[2]}}, {"rawbytes", snap.raw_sizes[n]}};
 
-    for (const auto& patch : database.all(Field::conserved))
-    {
-        auto U = database.fetch(patch.first, 2, 2, 0, 0);
-        auto G = MeshGeometry(
-            database.at(patch.first, Field::cell_coords),
-            database.at(patch.first, Field::cell_volume),
-            database.at(patch.first, Field::face_area_i),
-            database.at(patch.first, Field::face_area_j));
-        futures.push_back(pool.enqueue(update_task, patch.first, U, G, dt));
+        append_record(bytes, to_string(snap.indexes[n]));
+        append_record(bytes, meta.dump());
+        append_record(bytes, std::string(snap.payloads[n].begin(), snap.payloads[n].end()));
     }
 
-    for (auto& future : futures)
+    auto parts = comm.gather(bytes);
+    auto result = CompressedSnapshot();
+    result.bits = snap.bits;
+
+    for (const auto& part : parts)
     {
-        auto result = future.get();
-        database.commit(result.first, result.second, rk_factor);
+        auto position = std::size_t(0);
+
+        while (position < part.size())
+        {
+            auto index = patches2d::parse_index(read_record(part, position));
+            auto meta = nlohmann::json::parse(read_record(part, position));
+            auto payload = read_record(part, position);
+
+            result.indexes.push_back(index);
+            result.shapes.push_back(meta.at("shape").get<std::array<int, 3>>());
+            result.raw_sizes.push_back(meta.at("rawbytes").get<std::size_t>());
+            result.payloads.emplace_back(payload.begin(), payload.end());
+        }
     }
+    return result;
 }
 
-void update(ThreadPool& pool,
-    hydro::source_terms source_terms,
-    Database& database,
-    double dt, int rk)
+/**
+ * Write the discrete Fourier transform X[m] = sum_j x[j] exp(-2 pi i m j / n)
+ * of the n values x[0], x[stride], ... into X. This is the mixed-radix
+ * Cooley-Tukey algorithm, recursing on the smallest prime factor p of n, so
+ * it takes O(n (p1 + p2 + ...)) operations: O(n log n) for the usual zone
+ * counts, and a direct sum only if n is prime. W holds exp(-2 pi i k / N)
+ * for k < N, where N = n * L is the length of the outermost transform.
+ */
+static void fourier_transform(
+    const std::complex<double>* x, int stride, std::complex<double>* X, int n,
+    const std::vector<std::complex<double>>& W, int L)
 {
-    switch (rk)
-    {
-        case 1:
-            update_2d_threaded(pool, source_terms, database, dt, 0.0);
-            break;
-        case 2:
-            update_2d_threaded(pool, source_terms, database, dt, 0.0);
-            update_2d_threaded(pool, source_terms, database, dt, 0.5);
-            break;
-        default:
-            throw std::invalid_argument("rk must be 1 or 2");
-    }
-}
+    const int N = n * L;
+    auto p = 2;
 
+    while (p * p <= n && n % p != 0)
+    {
+        ++p;
+    }
+    if (p * p > n)
+    {
+        p = n;
+    }
 
+    if (p == n)
+    {
+        for (int m = 0; m < n; ++m)
+        {
+            auto sum = std::complex<double>(0.0);
 
+            for (int j = 0; j < n; ++j)
+            {
+                sum += x[j * stride] * W[(long(m) * j % n) * L];
+            }
+            X[m] = sum;
+        }
+        return;
+    }
 
-// ============================================================================
-struct atmosphere
-{
-    atmosphere(double noise=0.0) : noise(noise) {}
+    // Transform the p decimated sequences into consecutive runs of q values,
+    // then combine the p values of each k, which occupy the same p slots
+    // before and after.
+    const int q = n / p;
+    auto t = std::vector<std::complex<double>>(p);
 
-    inline std::array<double, 5> operator()(std::array<double, 2> X) const
+    for (int r = 0; r < p; ++r)
     {
-        const double r = X[0];
-        const double a = 1.5;                 // density index, alpha
-        const double vf = std::sqrt(1.0 / r); // free-fall velocity (GM = 1)
-        const double cs = vf / std::sqrt(a);  // sound speed via Virial condition
-        const double dg = std::pow(r, -a);    // power-law everywhere (infinite Virial radius)
-        const double pg = dg * cs * cs / (5. / 3);
-        const double delta = noise * std::rand() / RAND_MAX;
-        return {dg + delta, 0, 0, 0, pg};
+        fourier_transform(x + r * stride, stride * p, X + r * q, q, W, L * p);
     }
-    double noise;
-};
-
+    for (int k = 0; k < q; ++k)
+    {
+        for (int r = 0; r < p; ++r)
+        {
+            t[r] = X[r * q + k] * W[(long(r) * k * L) % N];
+        }
+        for (int s = 0; s < p; ++s)
+        {
+            auto sum = std::complex<double>(0.0);
 
+            for (int r = 0; r < p; ++r)
+            {
+                sum += t[r] * W[(long(r) * s % p) * q * L];
+            }
+            X[s * q + k] = sum;
+        }
+    }
+}
 
+/**
+ * Volume-weighted reductions of the solution, computed in situ by the write
+ * diagnostics task. Each radial shell of cells (a row i of a block) gives the
+ * volume average of the density, pressure, and radial velocity. The kinetic
+ * energy spectrum in theta is the squared FFT amplitude of sqrt(rho dV / 2) v
+ * over each shell, summed over shells and velocity components, with modes m
+ * and nj - m folded together; by Parseval's theorem it sums to the kinetic
+ * energy. The integrals are of the conserved mass and energy, the kinetic
+ * and gravitational potential energy, and the heating and cooling rates. In
+ * a distributed run, each rank reduces its own blocks, and the results are
+ * then summed over the ranks.
+ */
+struct Diagnostics
+{
+    double time      = 0.0;
+    double mass      = 0.0;
+    double energy    = 0.0;
+    double kinetic   = 0.0;
+    double potential = 0.0;
+    double heating   = 0.0;
+    double cooling   = 0.0;
+    std::vector<double> shell_radius;
+    std::vector<double> shell_density;
+    std::vector<double> shell_pressure;
+    std::vector<double> shell_radial_velocity;
+    std::vector<double> spectrum;
+};
 
-// ============================================================================
-struct boundary_value
+Diagnostics compute_diagnostics(
+    ThreadPool& pool,
+    const Database& database,
+    const hydro::source_terms& source_terms,
+    double time,
+    const mpi::Communicator& comm)
 {
-    nd::array<double, 3> operator()(
-        Database::Index,
-        PatchBoundary edge,
-        int /*depth*/,
-        const nd::array<double, 3>& patch) const
+    auto cons = std::vector<const Database::Array*>();
+    auto coords = std::vector<const Database::Array*>();
+    auto volumes = std::vector<const Database::Array*>();
+    auto block_index = std::vector<int>();
+    auto block_patches = std::vector<std::vector<int>>();
+
+    // Patches are visited in index order, so the polar blocks of each radial
+    // block come together and in order of increasing j. The shells run
+    // across all of them.
+    // ------------------------------------------------------------------------
+    for (const auto& patch : database)
     {
-        switch (edge)
+        if (std::get<3>(patch.first) == Field::conserved)
         {
-            case PatchBoundary::il: return reflecting_inner(patch);
-            case PatchBoundary::ir: return zero_gradient_outer(patch);
-            case PatchBoundary::jl: return nd::array<double, 3>();
-            case PatchBoundary::jr: return nd::array<double, 3>();
+            if (block_index.empty() || block_index.back() != std::get<0>(patch.first))
+            {
+                block_index.push_back(std::get<0>(patch.first));
+                block_patches.emplace_back();
+            }
+            block_patches.back().push_back(cons.size());
+            cons.push_back(&patch.second);
+            coords.push_back(&database.at(patch.first, Field::cell_coords));
+            volumes.push_back(&database.at(patch.first, Field::cell_volume));
         }
-	throw;
     }
 
-    nd::array<double, 3> zero_gradient_outer(const nd::array<double, 3>& patch) const
+    auto nj = 0;
+
+    for (int p : block_patches.front())
     {
-        auto _ = nd::axis::all();
-        auto U = nd::array<double, 3>(2, patch.shape(1), 5);
-        U.select(0, _, _) = patch.select(patch.shape(0) - 1, _, _);
-        U.select(1, _, _) = patch.select(patch.shape(0) - 1, _, _);
-        return U;
+        nj += cons[p]->shape(1);
     }
+    const int num_modes = nj / 2 + 1;
+    auto twiddles = std::vector<std::complex<double>>(nj);
+    auto blocks = std::vector<Diagnostics>(block_patches.size());
 
-    nd::array<double, 3> fixed_inner(const nd::array<double, 3>& patch) const
+    for (int k = 0; k < nj; ++k)
     {
-        auto _ = nd::axis::all();
-        auto P = hydro::prim_to_cons()(atmosphere()({1.0, 0.0}));
-        auto U = nd::array<double, 3>(2, patch.shape(1), 5);
-        U.select(_, _, 0) = P[0];
-        U.select(_, _, 1) = P[1];
-        U.select(_, _, 2) = P[2];
-        U.select(_, _, 3) = P[3];
-        U.select(_, _, 4) = P[4];
-        return U;
+        twiddles[k] = {std::cos(2 * M_PI * k / nj), -std::sin(2 * M_PI * k / nj)};
     }
 
-    nd::array<double, 3> reflecting_inner(const nd::array<double, 3>& patch) const
+    pool.parallel_for(0, block_patches.size(), [&] (int b)
     {
-        auto _ = nd::axis::all();
-        auto U = nd::array<double, 3>(2, patch.shape(1), 5);
-        auto non_const_patch = patch;
+        const int ni = cons[block_patches[b].front()]->shape(0);
+        auto& D = blocks[b];
+        auto cons_to_prim = hydro::cons_to_prim();
+        auto weighted = std::vector<std::complex<double>>(3 * nj);
+        auto amplitude = std::vector<std::complex<double>>(nj);
 
-        U.select(0, _, 0) = patch.select(1, _, 0);
-        U.select(1, _, 0) = patch.select(0, _, 0);
+        D.spectrum.assign(num_modes, 0.0);
 
-        U.select(0, _, 1) = non_const_patch.select(1, _, 1) * -1.0;
-        U.select(1, _, 1) = non_const_patch.select(0, _, 1) * -1.0;
+        for (int i = 0; i < ni; ++i)
+        {
+            auto shell_volume = 0.0;
+            auto shell_density = 0.0;
+            auto shell_pressure = 0.0;
+            auto shell_radial_velocity = 0.0;
 
-        U.select(0, _, 2) = patch.select(1, _, 2);
-        U.select(1, _, 2) = patch.select(0, _, 2);
+            auto J = 0;
 
-        U.select(0, _, 3) = patch.select(1, _, 3);
-        U.select(1, _, 3) = patch.select(0, _, 3);
+            for (int p : block_patches[b])
+            {
+                const auto& U = *cons[p];
+                const auto& X = *coords[p];
+                const auto& V = *volumes[p];
+
+                for (int j = 0; j < U.shape(1); ++j, ++J)
+                {
+                    const auto u = hydro::Vars{U(i, j, 0), U(i, j, 1), U(i, j, 2), U(i, j, 3), U(i, j, 4)};
+                    const auto P = cons_to_prim(u);
+                    const auto C = source_terms.coefficients({X(i, j, 0), X(i, j, 1)});
+                    const double dV = V(i, j, 0);
+                    const double w = std::sqrt(0.5 * P[0] * dV);
+
+                    shell_volume          += dV;
+                    shell_density         += dV * P[0];
+                    shell_pressure        += dV * P[4];
+                    shell_radial_velocity += dV * P[1];
+
+                    D.mass      += dV * u[0];
+                    D.energy    += dV * u[4];
+                    D.kinetic   += dV * 0.5 * P[0] * (P[1] * P[1] + P[2] * P[2] + P[3] * P[3]);
+                    D.potential -= dV * P[0] / C.r;
+                    D.heating   += dV * C.heating;
+                    D.cooling   += dV * source_terms.cooling(P);
+
+                    weighted[3 * J + 0] = w * P[1];
+                    weighted[3 * J + 1] = w * P[2];
+                    weighted[3 * J + 2] = w * P[3];
+                }
+            }
 
-        U.select(0, _, 4) = patch.select(1, _, 4);
-        U.select(1, _, 4) = patch.select(0, _, 4);
+            D.shell_radius.push_back((*coords[block_patches[b].front()])(i, 0, 0));
+            D.shell_density.push_back(shell_density / shell_volume);
+            D.shell_pressure.push_back(shell_pressure / shell_volume);
+            D.shell_radial_velocity.push_back(shell_radial_velocity / shell_volume);
 
-        return U;
-    }
-};
+            for (int c = 0; c < 3; ++c)
+            {
+                fourier_transform(&weighted[c], 3, amplitude.data(), nj, twiddles, 1);
 
+                for (int m = 0; m < num_modes; ++m)
+                {
+                    const bool folded = m != 0 && 2 * m != nj;
+                    D.spectrum[m] += std::norm(amplitude[m]) / nj * (folded ? 2 : 1);
+                }
+            }
+        }
+    });
 
+    // The per-block values are packed into one vector and summed over the
+    // ranks: the integrals, then the spectrum, then the four shell profiles.
+    // Shell i of block b goes to position b * ni + i of its profile, which
+    // no other rank writes to, so the sum places every rank's shells.
+    // ------------------------------------------------------------------------
+    const int ni = cons.front()->shape(0);
+    const int num_shells = int(comm.allreduce_sum(double(ni * block_patches.size())));
+    const int num_integrals = 6;
+    auto values = std::vector<double>(num_integrals + num_modes + 4 * num_shells, 0.0);
+    auto spectrum = values.begin() + num_integrals;
+    auto profiles = spectrum + num_modes;
+
+    for (std::size_t b = 0; b < blocks.size(); ++b)
+    {
+        const auto& D = blocks[b];
+        const auto shell = profiles + block_index[b] * ni;
 
+        values[0] += D.mass;
+        values[1] += D.energy;
+        values[2] += D.kinetic;
+        values[3] += D.potential;
+        values[4] += D.heating;
+        values[5] += D.cooling;
 
-// ============================================================================
-Database::Header create_header()
-{
-    return Database::Header
-    {
-        {Field::conserved,   {5, MeshLocation::cell}},
-        {Field::vert_coords, {2, MeshLocation::vert}},
-        {Field::cell_coords, {2, MeshLocation::cell}},
-        {Field::cell_volume, {1, MeshLocation::cell}},
-        {Field::face_area_i, {1, MeshLocation::face_i}},
-        {Field::face_area_j, {1, MeshLocation::face_j}},
-    };
+        for (int m = 0; m < num_modes; ++m)
+        {
+            spectrum[m] += D.spectrum[m];
+        }
+        std::copy(D.shell_radius.begin(), D.shell_radius.end(), shell + 0 * num_shells);
+        std::copy(D.shell_density.begin(), D.shell_density.end(), shell + 1 * num_shells);
+        std::copy(D.shell_pressure.begin(), D.shell_pressure.end(), shell + 2 * num_shells);
+        std::copy(D.shell_radial_velocity.begin(), D.shell_radial_velocity.end(), shell + 3 * num_shells);
+    }
+    comm.allreduce_sum(values);
+
+    auto result = Diagnostics();
+    result.time      = time;
+    result.mass      = values[0];
+    result.energy    = values[1];
+    result.kinetic   = values[2];
+    result.potential = values[3];
+    result.heating   = values[4];
+    result.cooling   = values[5];
+    result.spectrum.assign(spectrum, spectrum + num_modes);
+    result.shell_radius.assign(profiles + 0 * num_shells, profiles + 1 * num_shells);
+    result.shell_density.assign(profiles + 1 * num_shells, profiles + 2 * num_shells);
+    result.shell_pressure.assign(profiles + 2 * num_shells, profiles + 3 * num_shells);
+    result.shell_radial_velocity.assign(profiles + 3 * num_shells, profiles + 4 * num_shells);
+    return result;
 }
 
-Database create_database(run_config cfg)
+/**
+ * Append a diagnostics record to the time series in the output directory.
+ * The integrals go to diagnostics.csv, one row per record. The profiles and
+ * the spectrum go to diagnostics.dat as fixed-size records of float64 in the
+ * host byte order, whose layout is described by diagnostics.json. The first
+ * record (count = 0) starts the files over.
+ */
+void write_diagnostics(const Diagnostics& D, run_config cfg, int count)
 {
-    auto target_radial_zone_count = cfg.nr * std::log10(cfg.outer_radius);
-    auto block_size = target_radial_zone_count / cfg.num_blocks;
+    auto mode = count == 0 ? std::ios::out : std::ios::out | std::ios::app;
+    auto fields = std::vector<std::pair<std::string, const std::vector<double>*>>{
+        {"shell_radius", &D.shell_radius},
+        {"shell_density", &D.shell_density},
+        {"shell_pressure", &D.shell_pressure},
+        {"shell_radial_velocity", &D.shell_radial_velocity},
+        {"spectrum", &D.spectrum}};
 
-    auto ni = block_size;
-    auto nj = cfg.nr;
-    auto database = Database(ni, nj, create_header());
+    filesystem::require_dir(cfg.outdir);
 
-    if (! cfg.restart.empty())
-    {
-        load_patches_from_chkpt(database, cfg.restart);
-    }
-    else
+    if (count == 0)
     {
-        auto prim_to_cons = ufunc::vfrom(hydro::prim_to_cons());
+        auto layout = nlohmann::json();
+        layout["dtype"] = binary_file::native_float_dtype(sizeof(double));
+        layout["fields"].push_back({"time", 1});
 
-        for (int i = 0; i < cfg.num_blocks; ++i)
+        for (const auto& field : fields)
         {
-            double r0 = std::pow(cfg.outer_radius, double(i + 0) / cfg.num_blocks);
-            double r1 = std::pow(cfg.outer_radius, double(i + 1) / cfg.num_blocks);
+            layout["fields"].push_back({field.first, field.second->size()});
+        }
+        auto json_stream = std::ofstream(cfg.make_filename_diagnostics("json"));
+        json_stream << std::setw(4) << layout << std::endl;
+    }
 
-            auto x_verts = mesh_vertices(ni, nj, {r0, r1, 0, M_PI});
-            auto x_cells = mesh_cell_centroids(x_verts);
-            auto v_cells = mesh_cell_volumes(x_verts);
-            auto a_faces_i = mesh_face_areas_i(x_verts);
-            auto a_faces_j = mesh_face_areas_j(x_verts);
+    auto csv = std::ofstream(cfg.make_filename_diagnostics("csv"), mode);
+    auto dat = std::ofstream(cfg.make_filename_diagnostics("dat"), mode | std::ios::binary);
 
-            database.insert(std::make_tuple(i, 0, 0, Field::vert_coords), x_verts);
-            database.insert(std::make_tuple(i, 0, 0, Field::cell_coords), x_cells);
-            database.insert(std::make_tuple(i, 0, 0, Field::cell_volume), v_cells);
-            database.insert(std::make_tuple(i, 0, 0, Field::face_area_i), a_faces_i);
-            database.insert(std::make_tuple(i, 0, 0, Field::face_area_j), a_faces_j);
+    if (! csv.is_open() || ! dat.is_open())
+    {
+        throw std::invalid_argument("diagnostics files in " + cfg.outdir + " could not be opened for writing");
+    }
 
-            auto initial_data = ufunc::vfrom(atmosphere(cfg.noise));
-            database.insert(std::make_tuple(i, 0, 0, Field::conserved), prim_to_cons(initial_data(x_cells)));
-        }
+    if (count == 0)
+    {
+        csv << "time,mass,energy,kinetic,potential,heating,cooling\n";
+    }
+    csv << std::setprecision(16)
+    << D.time << ","
+    << D.mass << ","
+    << D.energy << ","
+    << D.kinetic << ","
+    << D.potential << ","
+    << D.heating << ","
+    << D.cooling << "\n";
+
+    dat.write(reinterpret_cast<const char*>(&D.time), sizeof(double));
+
+    for (const auto& field : fields)
+    {
+        dat.write(reinterpret_cast<const char*>(field.second->data()), field.second->size() * sizeof(double));
+    }
+}
+
+/**
+ * Hand an output task to the background writer, with data that the task
+ * holds on to until it has run.
+ */
+template <typename Writer>
+void submit_output(
+    BackgroundQueue& output,
+    std::shared_ptr<const Database> data,
+    profiler::Profiler* profiler,
+    Writer writer)
+{
+    output.submit([data, profiler, writer]
+    {
+        profiler::Scope scope(profiler, profiler::io);
+        writer(*data);
+    });
+}
+
+/**
+ * Hand an output task to the background writer. Unless the writer is
+ * synchronous, the task gets a snapshot of the database, so the main loop can
+ * keep stepping while it runs. Taking the snapshot is counted as I/O time on
+ * the main thread.
+ */
+template <typename Writer>
+void submit_output(
+    BackgroundQueue& output,
+    ThreadPool& pool,
+    const Database& database,
+    profiler::Profiler* profiler,
+    Writer writer)
+{
+    if (output.capacity() == 0)
+    {
+        profiler::Scope scope(profiler, profiler::io);
+        writer(database);
+        return;
     }
 
-    database.set_boundary_value(boundary_value());
-    return database;
+    auto data = std::shared_ptr<const Database>();
+    {
+        profiler::Scope scope(profiler, profiler::io);
+        data = std::make_shared<Database>(snapshot(pool, database));
+    }
+    submit_output(output, data, profiler, writer);
 }
 
+/**
+ * Hand an output task that needs the whole domain to the background writer
+ * of rank 0. With several ranks, the patches are first gathered to rank 0,
+ * which is counted as I/O time, and the other ranks submit nothing.
+ */
+template <typename Writer>
+void submit_gathered_output(
+    BackgroundQueue& output,
+    ThreadPool& pool,
+    const Database& database,
+    const mpi::Communicator& comm,
+    profiler::Profiler* profiler,
+    Writer writer)
+{
+    if (comm.size() == 1)
+    {
+        submit_output(output, pool, database, profiler, writer);
+        return;
+    }
 
+    auto data = std::shared_ptr<const Database>();
+    {
+        profiler::Scope scope(profiler, profiler::io);
+        data = gather_patches(database, comm);
+    }
 
+    if (data)
+    {
+        submit_output(output, data, profiler, writer);
+    }
+}
 
-// ============================================================================
-Scheduler create_scheduler(run_config& cfg, run_status& sts, const Database& database)
+/**
+ * Create the scheduler of output tasks. The tasks are collectives over comm,
+ * and are dispatched at the same times on every rank. Checkpoints are written
+ * by every rank, from the background writer, through io_comm; the other
+ * outputs are reduced or gathered to rank 0, which alone writes them.
+ */
+Scheduler create_scheduler(
+    run_config& cfg,
+    run_status& sts,
+    const Database& database,
+    UpdateWorkspace& workspace,
+    ThreadPool& pool,
+    BackgroundQueue& output,
+    profiler::Profiler* profiler,
+    hydro::source_terms source_terms,
+    mpi::Communicator comm,
+    mpi::Communicator io_comm)
 {
     auto scheduler = Scheduler(sts.time);
 
-    auto task_vtk = [&cfg, &sts, &database] (int count)
+    auto task_vtk = [&cfg, &sts, &database, &pool, &output, profiler, comm] (int count)
     {
         sts.vtk_count = count + 1;
-        write_vtk(database, cfg, sts, count);
+
+        submit_gathered_output(output, pool, database, comm, profiler, [cfg, sts, count] (const Database& data)
+        {
+            write_vtk(data, cfg, sts, count);
+        });
     };
 
-    auto task_chkpt = [&cfg, &sts, &database] (int count)
+    auto task_chkpt = [&cfg, &sts, &database, &workspace, &pool, &output, profiler, io_comm] (int count)
     {
         sts.chkpt_count = count + 1;
-        write_chkpt(database, cfg, sts, count);
+
+        if (cfg.balance)
+        {
+            rebalance_workers(workspace);
+        }
+        auto block_costs = cfg.balance ? gather_block_costs(workspace) : std::vector<double>();
+
+        submit_output(output, pool, database, profiler, [cfg, sts, block_costs, count, io_comm] (const Database& data)
+        {
+            write_chkpt(data, cfg, sts, block_costs, count, io_comm);
+        });
+    };
+
+    auto task_snap = [&cfg, &sts, &database, &pool, &output, profiler, comm] (int count)
+    {
+        sts.snap_count = count + 1;
+
+        auto snap = std::make_shared<CompressedSnapshot>(compress_snapshot(pool, database, cfg.snap_bits, profiler));
+
+        if (comm.size() > 1)
+        {
+            profiler::Scope scope(profiler, profiler::io);
+            *snap = gather_snapshot(*snap, comm);
+        }
+
+        if (comm.rank() == 0)
+        {
+            output.submit([snap, cfg, sts, count, profiler]
+            {
+                profiler::Scope scope(profiler, profiler::io);
+                write_snap(*snap, cfg, sts, count);
+            });
+        }
+    };
+
+    auto task_diag = [&cfg, &sts, &database, &pool, &output, profiler, source_terms, comm] (int count)
+    {
+        sts.diag_count = count + 1;
+
+        auto diag = std::make_shared<Diagnostics>(compute_diagnostics(pool, database, source_terms, sts.time, comm));
+
+        if (comm.rank() == 0)
+        {
+            output.submit([diag, cfg, count, profiler]
+            {
+                profiler::Scope scope(profiler, profiler::io);
+                write_diagnostics(*diag, cfg, count);
+            });
+        }
     };
 
     scheduler.repeat("write vtk", cfg.vtki, sts.vtk_count, task_vtk);
+    scheduler.repeat("write snapshot", cfg.snapi, sts.snap_count, task_snap);
+    scheduler.repeat("write diagnostics", cfg.diagi, sts.diag_count, task_diag);
     scheduler.repeat("write checkpoint", cfg.cpi, sts.chkpt_count, task_chkpt);
 
     return scheduler;
@@ -701,30 +1151,100 @@ Scheduler create_scheduler(run_config& cfg, run_status& sts, const Database& dat
 
 
 // ============================================================================
-int run(int argc, const char* argv[])
+int run(int argc, const char* argv[], const mpi::Communicator& comm)
 {
     auto cfg = run_config::from_argv(argc, argv).validate();
     auto sts = run_status::from_config(cfg);
-    auto database  = create_database(cfg);
-    auto scheduler = create_scheduler(cfg, sts, database);
-    auto source_terms = hydro::source_terms(cfg.heating_rate, cfg.cooling_rate);
-    auto dt = 0.25 * M_PI / cfg.nr; // WARNING: assuming here that speeds are generally \lesssim 1
 
+    if (cfg.num_blocks < comm.size())
+    {
+        throw std::invalid_argument("num_blocks must be at least the number of MPI ranks");
+    }
+
+    ThreadPool thread_pool(cfg.num_threads, cfg.pin_threads);
+    profiler::Profiler instrumentation(thread_pool.size());
+    auto profiler = cfg.profile ? &instrumentation : nullptr;
 
-    ThreadPool thread_pool(cfg.num_threads);
+    if (cfg.counters)
+    {
+        instrumentation.enable_counters();
+    }
+    auto partition = BlockPartition(cfg.num_blocks, cfg.num_blocks_j, comm, load_block_costs(cfg));
+    auto root = comm.rank() == 0;
+
+    BackgroundQueue output(cfg.io_queue);
+
+    auto solver = create_solver(cfg, thread_pool, partition);
+    auto& database = solver.database;
+    auto& workspace = solver.workspace;
+    auto source_terms = solver.source_terms;
+    auto scheduler = create_scheduler(cfg, sts, database, workspace, thread_pool, output, profiler, source_terms, comm, comm.duplicate());
+    auto num_cells = comm.allreduce_sum(double(database.num_cells(Field::conserved)));
+    const auto sts_initial = sts;
+
+    workspace.profiler = profiler;
+
+    // The step adapts to the signal speed when cfl > 0, which is the default.
+    // cfl=0 restores the fixed step of earlier versions, which is kept for
+    // compatibility and assumes that speeds are generally \lesssim 1.
+    auto dt = 0.25 * M_PI / cfg.nr;
+    const auto max_dt_growth = 1.1; // per iteration, with cfl > 0
+
+    if (cfg.cfl > 0.0)
+    {
+        dt = cfg.cfl / max_signal_rate(thread_pool, database, workspace);
+    }
 
 
     // ========================================================================
     // Initial report
     // ========================================================================
-    std::cout << "\n";
-    cfg      .print(std::cout);
-    sts      .print(std::cout);
-    database .print(std::cout);
-    scheduler.print(std::cout);
+    if (root)
+    {
+        std::cout << "\n";
+        cfg      .print(std::cout);
+        sts      .print(std::cout);
+        database .print(std::cout);
+        scheduler.print(std::cout);
+
+        if (comm.size() > 1)
+        {
+            std::cout << std::string(52, '=') << "\n";
+            std::cout << "Ranks:\n\n";
+
+            for (int r = 0; r < comm.size(); ++r)
+            {
+                std::printf("\trank %d: blocks [%d, %d)\n", r, partition.first(r), partition.first(r + 1));
+            }
+            std::cout << "\n";
+        }
+        if (cfg.subcycle)
+        {
+            std::cout << std::string(52, '=') << "\n";
+            std::cout << "Levels:\n\n\t";
+
+            for (int level : workspace.block_levels)
+            {
+                std::cout << level << " ";
+            }
+            std::cout << "(" << subcycle_steps(workspace) << " steps of level 0 per update)\n\n";
+        }
+        std::cout << std::string(52, '=') << "\n";
+        std::cout << "Main loop:\n\n";
+    }
 
-    std::cout << std::string(52, '=') << "\n";
-    std::cout << "Main loop:\n\n";
+    // Rank 0 publishes a sample per iteration; the wall_ fields are the
+    // profiler's totals since the start of this run (zero unless profile=1).
+    auto telemetry_fields = std::vector<std::string>{"iter", "time", "dt", "kzps", "seconds", "wall", "io_pending"};
+
+    for (int p = 0; p < profiler::num_phases; ++p)
+    {
+        telemetry_fields.push_back(std::string("wall_") + profiler::phase_name(p));
+    }
+    telemetry::Publisher publisher(cfg.make_filename_telemetry(), telemetry_fields, root ? cfg.telemetry : 0);
+    auto log_timer = Timer();
+    auto log_iter = sts.iter;
+    auto log_seconds = 0.0;
 
 
     // ========================================================================
@@ -732,30 +1252,116 @@ int run(int argc, const char* argv[])
     // ========================================================================
     while (sts.time < cfg.tfinal)
     {
-        scheduler.dispatch(sts.time);
+        if (! cfg.test_mode)
+        {
+            scheduler.dispatch(sts.time);
+        }
+
+        // When subcycling, dt is the step of the finest level, and the
+        // update advances by steps of it.
+        const int steps = subcycle_steps(workspace);
+
+        if (cfg.cfl > 0.0)
+        {
+            dt = std::min(dt, (cfg.tfinal - sts.time) / steps);
+        }
 
         auto timer = Timer();
-        update(thread_pool, source_terms, database, dt, cfg.rk);
+        auto rate = advance(thread_pool, solver, dt);
+
+        if (cfg.checks == "step")
+        {
+            check_positivity(thread_pool, database, comm);
+        }
 
-        sts.time += dt;
+        const auto seconds = timer.seconds();
+        sts.time += dt * steps;
         sts.iter += 1;
-        sts.wall += timer.seconds();
+        sts.wall += seconds;
+
+        if (profiler)
+        {
+            const auto T = profiler->totals();
+            sts.wall_fetch        = sts_initial.wall_fetch        + T[profiler::fetch];
+            sts.wall_cons_to_prim = sts_initial.wall_cons_to_prim + T[profiler::cons_to_prim];
+            sts.wall_reconstruct  = sts_initial.wall_reconstruct  + T[profiler::reconstruct];
+            sts.wall_riemann      = sts_initial.wall_riemann      + T[profiler::riemann];
+            sts.wall_sources      = sts_initial.wall_sources      + T[profiler::sources];
+            sts.wall_commit       = sts_initial.wall_commit       + T[profiler::commit];
+            sts.wall_compress     = sts_initial.wall_compress     + T[profiler::compress];
+            sts.wall_io           = sts_initial.wall_io           + T[profiler::io];
+        }
+
+        if (root)
+        {
+            auto kzps = num_cells / 1e3 / seconds;
+            auto sample = std::vector<double>{
+                double(sts.iter), sts.time, dt, kzps, seconds, sts.wall, double(output.pending())};
+
+            auto T = profiler ? profiler->totals() : profiler::PhaseTimes{};
+
+            for (int p = 0; p < profiler::num_phases; ++p)
+            {
+                sample.push_back(T[p]);
+            }
+            publisher.publish(sample);
 
-        auto kzps = database.num_cells(Field::conserved) / 1e3 / timer.seconds();
-        std::printf("[%04d] t=%3.3lf kzps=%3.2lf\n", sts.iter, sts.time, kzps);
-        std::fflush(stdout);
+            // With logi > 0, a line is printed at most every logi wall
+            // seconds, and at the end; its kzps is averaged over the
+            // iterations since the previous line.
+            log_seconds += seconds;
+
+            if (cfg.logi == 0.0 || log_timer.seconds() >= cfg.logi || sts.time >= cfg.tfinal)
+            {
+                auto average_kzps = num_cells / 1e3 * (sts.iter - log_iter) / log_seconds;
+                std::printf("[%04d] t=%3.3lf dt=%3.2e kzps=%3.2lf\n", sts.iter, sts.time, dt, average_kzps);
+                std::fflush(stdout);
+                log_timer = Timer();
+                log_iter = sts.iter;
+                log_seconds = 0.0;
+            }
+        }
+
+        // The rate is that of the last stage's input rather than of the new
+        // state, so the step may only grow gradually toward cfl / rate.
+        if (cfg.cfl > 0.0)
+        {
+            dt = std::min(cfg.cfl / rate, max_dt_growth * dt);
+        }
     }
-    scheduler.dispatch(sts.time);
+    if (! cfg.test_mode)
+    {
+        scheduler.dispatch(sts.time);
+    }
+    output.flush();
 
 
     // ========================================================================
     // Final report
     // ========================================================================
-    std::cout << "\n";
-    std::cout << std::string(52, '=') << "\n";
-    std::cout << "Run completed:\n\n";
-    std::printf("\taverage kzps=%f\n", database.num_cells(Field::conserved) / 1e3 / sts.wall * sts.iter);
-    std::cout << "\n";
+    if (root)
+    {
+        std::cout << "\n";
+        std::cout << std::string(52, '=') << "\n";
+        std::cout << "Run completed:\n\n";
+        std::printf("\taverage kzps=%f\n", num_cells / 1e3 / sts.wall * sts.iter);
+        std::cout << "\n";
+    }
+
+    if (cfg.counters && root)
+    {
+        profiler->print_roofline(std::cout, cfg.peak_gflops, cfg.peak_gbs);
+    }
+
+    // Each rank profiles its own threads; rank 0's profile is reported.
+    if (profiler && root)
+    {
+        auto filename = filesystem::join({cfg.outdir, "profile.json"});
+        filesystem::require_dir(cfg.outdir);
+        profiler->print_summary(std::cout);
+        profiler->write_trace(filename);
+        std::cout << "write " << filename << std::endl;
+    }
 
     return 0;
 }
@@ -766,13 +1372,23 @@ int run(int argc, const char* argv[])
 // ============================================================================
 int main(int argc, const char* argv[])
 {
+    mpi::Session session(argc, argv);
+    auto comm = mpi::Communicator::world();
+
     try {
-        return run(argc, argv);
+        return run(argc, argv, comm);
     }
     catch (std::exception& e)
     {
         std::cerr << "\nERROR: ";
         std::cerr << e.what() << "\n\n";
+
+        // The other ranks may be waiting on this one, so they are taken down
+        // with it.
+        if (comm.size() > 1)
+        {
+            comm.abort(1);
+        }
         return 1;
     }
 }
@@ -1,6 +1,7 @@
 #pragma once
 #include <cmath>
 #include <algorithm>
+#include "simd.hpp"
 
 
 
@@ -30,12 +31,40 @@ namespace newtonian_hydro {
     using Unit = std::array<double, 3>;
     using Position = std::array<double, 2>;
 
-    struct cons_to_prim;
-    struct prim_to_cons;
-    struct prim_to_flux;
-    struct prim_to_eval;
-    struct riemann_hlle;
-    struct source_terms;
+    /**
+     * The position-dependent factors in the source terms: radius, cot(theta),
+     * gravitational acceleration, and the heating term. They are fixed for a
+     * static mesh, so they can be computed once per cell and reused.
+     */
+    struct SourceCoefficients
+    {
+        double r;
+        double cot_q;
+        double gravity;
+        double heating;
+    };
+
+    /**
+     * Validity policies: checked functors throw at the first invalid state
+     * they see. Unchecked functors compile the checks out of the hot path and
+     * are meant to be paired with a whole-step positivity report.
+     */
+    struct checked;
+    struct unchecked;
+
+    template <typename Validity> struct basic_cons_to_prim;
+    template <typename Validity> struct basic_prim_to_cons;
+    template <typename Validity> struct basic_prim_to_flux;
+    template <typename Validity> struct basic_prim_to_eval;
+    template <typename Validity> struct basic_riemann_hlle;
+    template <typename Validity> struct basic_source_terms;
+
+    using cons_to_prim = basic_cons_to_prim<checked>;
+    using prim_to_cons = basic_prim_to_cons<checked>;
+    using prim_to_flux = basic_prim_to_flux<checked>;
+    using prim_to_eval = basic_prim_to_eval<checked>;
+    using riemann_hlle = basic_riemann_hlle<checked>;
+    using source_terms = basic_source_terms<checked>;
 
     static inline Vars check_valid_cons(Vars U, const char* caller)
     {
@@ -68,11 +97,91 @@ namespace newtonian_hydro {
 
 
 // ============================================================================
-struct newtonian_hydro::cons_to_prim
+/**
+ * Batch versions of the functors above. A VarsBatch holds simd::vdouble::size
+ * cells in structure-of-arrays form: one packed vector per component. They
+ * perform the same arithmetic, in the same order, as their scalar
+ * counterparts, and they report invalid states through the same scalar
+ * checks, so error messages are unchanged.
+ */
+namespace newtonian_hydro {
+
+    using VarsBatch = std::array<simd::vdouble, 5>;
+
+    template <typename Validity> struct basic_cons_to_prim_batch;
+    template <typename Validity> struct basic_prim_to_cons_batch;
+    template <typename Validity> struct basic_prim_to_flux_batch;
+    template <typename Validity> struct basic_prim_to_eval_batch;
+    template <typename Validity> struct basic_riemann_hlle_batch;
+
+    using cons_to_prim_batch = basic_cons_to_prim_batch<checked>;
+    using prim_to_cons_batch = basic_prim_to_cons_batch<checked>;
+    using prim_to_flux_batch = basic_prim_to_flux_batch<checked>;
+    using prim_to_eval_batch = basic_prim_to_eval_batch<checked>;
+    using riemann_hlle_batch = basic_riemann_hlle_batch<checked>;
+
+    static inline Vars lane(const VarsBatch& X, int n)
+    {
+        double x[5][simd::vdouble::size];
+
+        for (int q = 0; q < 5; ++q)
+        {
+            X[q].store(x[q]);
+        }
+        return {x[0][n], x[1][n], x[2][n], x[3][n], x[4][n]};
+    }
+
+    static inline VarsBatch check_valid_cons(VarsBatch U, const char* caller)
+    {
+        if (simd::any_negative(U[DDD]) || simd::any_negative(U[NRG]))
+        {
+            for (int n = 0; n < simd::vdouble::size; ++n)
+            {
+                check_valid_cons(lane(U, n), caller);
+            }
+        }
+        return U;
+    }
+
+    static inline VarsBatch check_valid_prim(VarsBatch P, const char* caller)
+    {
+        if (simd::any_negative(P[RHO]) || simd::any_negative(P[PRE]))
+        {
+            for (int n = 0; n < simd::vdouble::size; ++n)
+            {
+                check_valid_prim(lane(P, n), caller);
+            }
+        }
+        return P;
+    }
+}
+
+
+
+
+// ============================================================================
+struct newtonian_hydro::checked
+{
+    template <typename T> static inline T cons(T U, const char* caller) { return check_valid_cons(U, caller); }
+    template <typename T> static inline T prim(T P, const char* caller) { return check_valid_prim(P, caller); }
+};
+
+struct newtonian_hydro::unchecked
+{
+    template <typename T> static inline T cons(T U, const char*) { return U; }
+    template <typename T> static inline T prim(T P, const char*) { return P; }
+};
+
+
+
+
+// ============================================================================
+template <typename Validity>
+struct newtonian_hydro::basic_cons_to_prim
 {
     inline Vars operator()(Vars U) const
     {
-        check_valid_cons(U, "newtonian_hydro::cons_to_prim");
+        Validity::cons(U, "newtonian_hydro::cons_to_prim");
 
         const double gm1 = gammaLawIndex - 1.0;
         const double pp = U[S11] * U[S11] + U[S22] * U[S22] + U[S33] * U[S33];
@@ -84,7 +193,7 @@ struct newtonian_hydro::cons_to_prim
         P[V22] =  U[S22] / U[DDD];
         P[V33] =  U[S33] / U[DDD];
 
-        return check_valid_prim(P, "newtonian_hydro::cons_to_prim");
+        return Validity::prim(P, "newtonian_hydro::cons_to_prim");
     }
     double gammaLawIndex = 5. / 3;
 };
@@ -93,11 +202,12 @@ struct newtonian_hydro::cons_to_prim
 
 
 // ============================================================================
-struct newtonian_hydro::prim_to_cons
+template <typename Validity>
+struct newtonian_hydro::basic_prim_to_cons
 {
     inline Vars operator()(Vars P) const
     {
-        check_valid_prim(P, "newtonian_hydro::prim_to_cons");
+        Validity::prim(P, "newtonian_hydro::prim_to_cons");
 
         const double gm1 = gammaLawIndex - 1.0;
         const double vv = P[V11] * P[V11] + P[V22] * P[V22] + P[V33] * P[V33];
@@ -118,14 +228,15 @@ struct newtonian_hydro::prim_to_cons
 
 
 // ============================================================================
-struct newtonian_hydro::prim_to_flux
+template <typename Validity>
+struct newtonian_hydro::basic_prim_to_flux
 {
     inline Vars operator()(Vars P, Unit N) const
     {
-        check_valid_prim(P, "newtonian_hydro::prim_to_flux");
+        Validity::prim(P, "newtonian_hydro::prim_to_flux");
 
         const double vn = P[V11] * N[0] + P[V22] * N[1] + P[V33] * N[2];
-        auto U = prim_to_cons()(P);
+        auto U = basic_prim_to_cons<Validity>()(P);
         auto F = Vars();
 
         F[DDD] = vn * U[DDD];
@@ -143,11 +254,12 @@ struct newtonian_hydro::prim_to_flux
 
 
 // ============================================================================
-struct newtonian_hydro::prim_to_eval
+template <typename Validity>
+struct newtonian_hydro::basic_prim_to_eval
 {
     inline Vars operator()(Vars P, Unit N) const
     {
-        check_valid_prim(P, "newtonian_hydro::prim_to_eval");
+        Validity::prim(P, "newtonian_hydro::prim_to_eval");
 
         const double gm0 = gammaLawIndex;
         const double dg = P[RHO];
@@ -171,14 +283,15 @@ struct newtonian_hydro::prim_to_eval
 
 
 // ============================================================================
-struct newtonian_hydro::riemann_hlle
+template <typename Validity>
+struct newtonian_hydro::basic_riemann_hlle
 {
-    riemann_hlle(Unit nhat) : nhat(nhat) {}
+    basic_riemann_hlle(Unit nhat) : nhat(nhat) {}
 
     inline Vars operator()(Vars Pl, Vars Pr) const
     {
-        check_valid_prim(Pl, "newtonian_hydro::riemann_hlle");
-        check_valid_prim(Pr, "newtonian_hydro::riemann_hlle");
+        Validity::prim(Pl, "newtonian_hydro::riemann_hlle");
+        Validity::prim(Pr, "newtonian_hydro::riemann_hlle");
 
         auto Ul = p2c(Pl);
         auto Ur = p2c(Pr);
@@ -204,41 +317,64 @@ struct newtonian_hydro::riemann_hlle
         return F;
     }
     Unit nhat;
-    prim_to_cons p2c;
-    prim_to_eval p2a;
-    prim_to_flux p2f;
+    basic_prim_to_cons<Validity> p2c;
+    basic_prim_to_eval<Validity> p2a;
+    basic_prim_to_flux<Validity> p2f;
 };
 
 
 
 
 // ============================================================================
-struct newtonian_hydro::source_terms
+template <typename Validity>
+struct newtonian_hydro::basic_source_terms
 {
 
 
     // ========================================================================
-    source_terms(double heating_rate, double cooling_rate)
+    basic_source_terms(double heating_rate, double cooling_rate)
     : heating_rate(heating_rate)
     , cooling_rate(cooling_rate)
     {
     }
 
+    template <typename Other>
+    basic_source_terms(const basic_source_terms<Other>& other)
+    : heating_rate(other.heating_rate)
+    , cooling_rate(other.cooling_rate)
+    {
+    }
+
 
     // ========================================================================
     inline Vars operator()(Vars P, Position X) const
     {
-        check_valid_prim(P, "newtonian_hydro::source_terms");
+        return evaluate(P, coefficients(X));
+    }
 
+    /**
+     * Return the source term coefficients at the given position. Calling
+     * evaluate with these gives exactly the same result as calling the
+     * operator above with the position.
+     */
+    inline SourceCoefficients coefficients(Position X) const
+    {
         const double r = X[0];
         const double q = X[1];
-        const double gm = 5. / 3;
+        return {r, cot(q), 1.0 / r / r, heating_rate * std::exp(-r * r)};
+    }
+
+    inline Vars evaluate(Vars P, const SourceCoefficients& C) const
+    {
+        Validity::prim(P, "newtonian_hydro::source_terms");
+
+        const double r = C.r;
+        const double cq = C.cot_q;
         const double dg = P[0];
         const double vr = P[1];
         const double vq = P[2];
         const double vp = P[3];
         const double pg = P[4];
-        const double Tg = pg / dg / (gm - 1);
         auto S = Vars();
 
 
@@ -246,27 +382,39 @@ struct newtonian_hydro::source_terms
         // --------------------------------------------------------------------
         S[DDD] = 0.0;
         S[S11] = (2 * pg + dg * (vq * vq + vp * vp)) / r;
-        S[S22] = (pg * cot(q) + dg * (vp * vp * cot(q) - vr * vq)) / r;
-        S[S33] = -dg * vp * (vr + vq * cot(q)) / r;
+        S[S22] = (pg * cq + dg * (vp * vp * cq - vr * vq)) / r;
+        S[S33] = -dg * vp * (vr + vq * cq) / r;
         S[NRG] = 0.0;
 
 
         // Source terms for point mass gravity. GM = 1.0.
         // --------------------------------------------------------------------
-        const double g = 1.0 / r / r;
+        const double g = C.gravity;
         S[S11] -= dg * g;
         S[NRG] -= dg * g * vr;
 
 
         // Source terms for thermal heating and Bremsstrahlung cooling
         // --------------------------------------------------------------------
-        S[NRG] += heating_rate * std::exp(-r * r);
-        S[NRG] -= cooling_rate * std::sqrt(Tg) * dg * dg;
+        S[NRG] += C.heating;
+        S[NRG] -= cooling(P);
 
 
         return S;
     }
 
+    /**
+     * Return the Bremsstrahlung cooling rate per unit volume. Together with
+     * the heating coefficient, this is the energy source due to the thermal
+     * terms.
+     */
+    inline double cooling(Vars P) const
+    {
+        const double gm = 5. / 3;
+        const double Tg = P[4] / P[0] / (gm - 1);
+        return cooling_rate * std::sqrt(Tg) * P[0] * P[0];
+    }
+
     double cot(double x) const
     {
         return std::tan(M_PI_2 - x);
@@ -275,6 +423,157 @@ struct newtonian_hydro::source_terms
 
 private:
     // ========================================================================
+    template <typename> friend struct basic_source_terms;
     double heating_rate = 0.0;
     double cooling_rate = 0.0;
 };
+
+
+
+
+// ============================================================================
+template <typename Validity>
+struct newtonian_hydro::basic_cons_to_prim_batch
+{
+    inline VarsBatch operator()(VarsBatch U) const
+    {
+        Validity::cons(U, "newtonian_hydro::cons_to_prim");
+
+        const simd::vdouble gm1 = gammaLawIndex - 1.0;
+        const simd::vdouble pp = U[S11] * U[S11] + U[S22] * U[S22] + U[S33] * U[S33];
+        auto P = VarsBatch();
+
+        P[RHO] =  U[DDD];
+        P[PRE] = (U[NRG] - 0.5 * pp / U[DDD]) * gm1;
+        P[V11] =  U[S11] / U[DDD];
+        P[V22] =  U[S22] / U[DDD];
+        P[V33] =  U[S33] / U[DDD];
+
+        return Validity::prim(P, "newtonian_hydro::cons_to_prim");
+    }
+    double gammaLawIndex = 5. / 3;
+};
+
+
+
+
+// ============================================================================
+template <typename Validity>
+struct newtonian_hydro::basic_prim_to_cons_batch
+{
+    inline VarsBatch operator()(VarsBatch P) const
+    {
+        Validity::prim(P, "newtonian_hydro::prim_to_cons");
+
+        const simd::vdouble gm1 = gammaLawIndex - 1.0;
+        const simd::vdouble vv = P[V11] * P[V11] + P[V22] * P[V22] + P[V33] * P[V33];
+        auto U = VarsBatch();
+
+        U[DDD] = P[RHO];
+        U[S11] = P[RHO] * P[V11];
+        U[S22] = P[RHO] * P[V22];
+        U[S33] = P[RHO] * P[V33];
+        U[NRG] = P[RHO] * 0.5 * vv + P[PRE] / gm1;
+
+        return U;
+    }
+    double gammaLawIndex = 5. / 3;
+};
+
+
+
+
+// ============================================================================
+template <typename Validity>
+struct newtonian_hydro::basic_prim_to_flux_batch
+{
+    inline VarsBatch operator()(VarsBatch P, Unit N) const
+    {
+        Validity::prim(P, "newtonian_hydro::prim_to_flux");
+
+        const simd::vdouble vn = P[V11] * N[0] + P[V22] * N[1] + P[V33] * N[2];
+        auto U = basic_prim_to_cons_batch<Validity>()(P);
+        auto F = VarsBatch();
+
+        F[DDD] = vn * U[DDD];
+        F[S11] = vn * U[S11] + P[PRE] * N[0];
+        F[S22] = vn * U[S22] + P[PRE] * N[1];
+        F[S33] = vn * U[S33] + P[PRE] * N[2];
+        F[NRG] = vn * U[NRG] + P[PRE] * vn;
+
+        return F;
+    }
+    double gammaLawIndex = 5. / 3;
+};
+
+
+
+
+// ============================================================================
+template <typename Validity>
+struct newtonian_hydro::basic_prim_to_eval_batch
+{
+    inline VarsBatch operator()(VarsBatch P, Unit N) const
+    {
+        Validity::prim(P, "newtonian_hydro::prim_to_eval");
+
+        const simd::vdouble gm0 = gammaLawIndex;
+        const simd::vdouble dg = P[RHO];
+        const simd::vdouble pg = simd::max(0.0, P[PRE]);
+        const simd::vdouble cs = simd::sqrt(gm0 * pg / dg);
+        const simd::vdouble vn = P[V11] * N[0] + P[V22] * N[1] + P[V33] * N[2];
+        auto A = VarsBatch();
+
+        A[0] = vn - cs;
+        A[1] = vn;
+        A[2] = vn;
+        A[3] = vn;
+        A[4] = vn + cs;
+
+        return A;
+    }
+    double gammaLawIndex = 5. / 3;
+};
+
+
+
+
+// ============================================================================
+template <typename Validity>
+struct newtonian_hydro::basic_riemann_hlle_batch
+{
+    basic_riemann_hlle_batch(Unit nhat) : nhat(nhat) {}
+
+    inline VarsBatch operator()(VarsBatch Pl, VarsBatch Pr) const
+    {
+        Validity::prim(Pl, "newtonian_hydro::riemann_hlle");
+        Validity::prim(Pr, "newtonian_hydro::riemann_hlle");
+
+        auto Ul = p2c(Pl);
+        auto Ur = p2c(Pr);
+        auto Al = p2a(Pl, nhat);
+        auto Ar = p2a(Pr, nhat);
+        auto Fl = p2f(Pl, nhat);
+        auto Fr = p2f(Pr, nhat);
+
+        // The eigenvalues are ordered, A[0] <= A[1..3] <= A[4].
+        const simd::vdouble epl = Al[4];
+        const simd::vdouble eml = Al[0];
+        const simd::vdouble epr = Ar[4];
+        const simd::vdouble emr = Ar[0];
+        const simd::vdouble ap = simd::max(0.0, simd::max(epl, epr));
+        const simd::vdouble am = simd::min(0.0, simd::min(eml, emr));
+
+        VarsBatch F;
+
+        for (int q = 0; q < 5; ++q)
+        {
+            F[q] = (ap * Fl[q] - am * Fr[q] - (Ul[q] - Ur[q]) * ap * am) / (ap - am);
+        }
+        return F;
+    }
+    Unit nhat;
+    basic_prim_to_cons_batch<Validity> p2c;
+    basic_prim_to_eval_batch<Validity> p2a;
+    basic_prim_to_flux_batch<Validity> p2f;
+};
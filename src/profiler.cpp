@@ -0,0 +1,462 @@
+#include <algorithm>
+#include <numeric>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+#include "profiler.hpp"
+#include "thread_pool.hpp"
+using namespace profiler;
+
+
+
+
+// ============================================================================
+static const std::size_t max_events_per_thread = 1 << 18;
+
+
+
+
+// ============================================================================
+const char* profiler::phase_name(int phase)
+{
+    switch (phase)
+    {
+        case fetch:        return "fetch";
+        case cons_to_prim: return "cons_to_prim";
+        case reconstruct:  return "reconstruct";
+        case riemann:      return "riemann";
+        case sources:      return "sources";
+        case commit:       return "commit";
+        case compress:     return "compress";
+        case io:           return "io";
+    }
+    return "unknown";
+}
+
+const char* profiler::region_name(int region)
+{
+    return region == kernel_region ? "kernel" : phase_name(region);
+}
+
+
+
+
+// ============================================================================
+static bool is_intel_cpu()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+
+    if (! __get_cpuid(0, &eax, &ebx, &ecx, &edx))
+    {
+        return false;
+    }
+    return ebx == 0x756e6547 && edx == 0x49656e69 && ecx == 0x6c65746e; // "GenuineIntel"
+#else
+    return false;
+#endif
+}
+
+const char* HardwareCounters::name(int counter)
+{
+    switch (counter)
+    {
+        case cycles:           return "cycles";
+        case instructions:     return "instructions";
+        case cache_references: return "cache_references";
+        case cache_misses:     return "cache_misses";
+        case flops:            return "flops";
+    }
+    return "unknown";
+}
+
+HardwareCounters::HardwareCounters()
+{
+    missing.fill(true);
+#ifdef __linux__
+    // Each event is {perf type, config, counter, FLOPs per count}. A group
+    // is scheduled onto the PMU as a whole, so it has to fit in the general
+    // purpose counters; hence the two groups.
+    open_group({
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,       cycles,           1},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,     instructions,     1},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES, cache_references, 1},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,     cache_misses,     1}});
+
+    if (is_intel_cpu())
+    {
+        // FP_ARITH_INST_RETIRED (event 0xc7): scalar, 128-, 256-, and 512-bit
+        // packed double. FMA instructions are counted twice by the CPU.
+        open_group({
+            {PERF_TYPE_RAW, 0x01c7, flops, 1},
+            {PERF_TYPE_RAW, 0x04c7, flops, 2},
+            {PERF_TYPE_RAW, 0x10c7, flops, 4},
+            {PERF_TYPE_RAW, 0x40c7, flops, 8}});
+    }
+    else
+    {
+        message += (message.empty() ? "" : "; ") + std::string("flops: only counted on Intel CPUs");
+    }
+#else
+    message = "hardware counters need Linux perf_event";
+#endif
+}
+
+HardwareCounters::~HardwareCounters()
+{
+    for (const auto& group : groups)
+    {
+        for (auto fd : group.fds)
+        {
+            ::close(fd);
+        }
+    }
+}
+
+void HardwareCounters::open_group(const std::vector<std::array<std::uint64_t, 4>>& events)
+{
+#ifdef __linux__
+    auto group = Group();
+    auto failed = std::array<bool, num_counters>();
+
+    for (const auto& event : events)
+    {
+        auto attr = perf_event_attr();
+        std::memset(&attr, 0, sizeof(attr));
+        attr.type = event[0];
+        attr.size = sizeof(attr);
+        attr.config = event[1];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        const int leader = group.fds.empty() ? -1 : group.fds.front();
+        const int fd = ::syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+
+        if (fd < 0)
+        {
+            if (! failed[event[2]])
+            {
+                message += (message.empty() ? "" : "; ") + std::string(name(event[2])) + ": " + std::strerror(errno);
+            }
+            failed[event[2]] = true;
+            continue;
+        }
+        group.fds.push_back(fd);
+        group.counters.push_back(event[2]);
+        group.weights.push_back(double(event[3]));
+    }
+
+    // A counter made of several events is only valid if all of them are.
+    for (std::size_t n = 0; n < group.counters.size(); ++n)
+    {
+        missing[group.counters[n]] = failed[group.counters[n]];
+    }
+    if (! group.fds.empty())
+    {
+        groups.push_back(group);
+    }
+#else
+    (void) events;
+#endif
+}
+
+HardwareCounters::Values HardwareCounters::read() const
+{
+    auto result = Values();
+    auto buffer = std::vector<std::uint64_t>();
+
+    for (const auto& group : groups)
+    {
+        // Layout of PERF_FORMAT_GROUP: nr, time enabled, time running, and
+        // then nr values in the order the events were opened.
+        buffer.assign(3 + group.fds.size(), 0);
+
+        if (::read(group.fds.front(), buffer.data(), buffer.size() * sizeof(std::uint64_t)) < 0)
+        {
+            continue;
+        }
+        const double scale = buffer[2] > 0 ? double(buffer[1]) / buffer[2] : 0.0;
+
+        for (std::size_t n = 0; n < group.fds.size(); ++n)
+        {
+            result[group.counters[n]] += group.weights[n] * buffer[3 + n] * scale;
+        }
+    }
+    for (int c = 0; c < num_counters; ++c)
+    {
+        if (missing[c])
+        {
+            result[c] = std::numeric_limits<double>::quiet_NaN();
+        }
+    }
+    return result;
+}
+
+
+
+
+// ============================================================================
+Profiler::Profiler(std::size_t num_workers)
+: slots(num_workers + 2)
+, origin(Clock::now())
+, main_thread(std::this_thread::get_id())
+{
+    for (int p = 0; p < num_phases; ++p)
+    {
+        bytes_in[p].store(0);
+        bytes_out[p].store(0);
+    }
+    for (auto& slot : slots)
+    {
+        for (auto& c : slot.counts)
+        {
+            c.store(0.0);
+        }
+    }
+}
+
+Profiler::Slot& Profiler::this_slot()
+{
+    const int worker = ThreadPool::current_worker();
+
+    if (worker >= 0)
+    {
+        return slots.at(worker + 1);
+    }
+    return std::this_thread::get_id() == main_thread ? slots.front() : slots.back();
+}
+
+PhaseCounters& Profiler::times()
+{
+    return this_slot().times;
+}
+
+void Profiler::record(Phase phase, Clock::time_point start, Clock::time_point end, int patch)
+{
+    auto& events = this_slot().events;
+
+    if (events.size() < max_events_per_thread)
+    {
+        events.push_back({start, end, phase, patch});
+    }
+}
+
+void Profiler::add_bytes(Phase phase, std::uint64_t in, std::uint64_t out)
+{
+    bytes_in[phase].fetch_add(in, std::memory_order_relaxed);
+    bytes_out[phase].fetch_add(out, std::memory_order_relaxed);
+}
+
+PhaseTimes Profiler::totals() const
+{
+    auto result = PhaseTimes();
+
+    for (const auto& slot : slots)
+    {
+        for (int p = 0; p < num_phases; ++p)
+        {
+            result[p] += slot.times[p];
+        }
+    }
+    return result;
+}
+
+void Profiler::enable_counters()
+{
+    counters_enabled = true;
+}
+
+HardwareCounters::Values Profiler::read_counters()
+{
+    auto& slot = this_slot();
+
+    if (! slot.hardware)
+    {
+        slot.hardware.reset(new HardwareCounters());
+    }
+    return slot.hardware->read();
+}
+
+void Profiler::add_counts(int region, const HardwareCounters::Values& start)
+{
+    const auto end = read_counters();
+    auto& counts = this_slot().counts;
+
+    for (int c = 0; c < HardwareCounters::num_counters; ++c)
+    {
+        auto& t = counts[region * HardwareCounters::num_counters + c];
+        t.store(t.load(std::memory_order_relaxed) + end[c] - start[c], std::memory_order_relaxed);
+    }
+}
+
+std::array<HardwareCounters::Values, num_regions> Profiler::counter_totals() const
+{
+    auto result = std::array<HardwareCounters::Values, num_regions>();
+
+    for (const auto& slot : slots)
+    {
+        for (int r = 0; r < num_regions; ++r)
+        {
+            for (int c = 0; c < HardwareCounters::num_counters; ++c)
+            {
+                result[r][c] += slot.counts[r * HardwareCounters::num_counters + c].load(std::memory_order_relaxed);
+            }
+        }
+    }
+    return result;
+}
+
+void Profiler::print_summary(std::ostream& os) const
+{
+    const auto total = totals();
+    const auto sum = std::max(1e-300, std::accumulate(total.begin(), total.end(), 0.0));
+    char line[128];
+
+    os << std::string(52, '=') << "\n";
+    os << "Profile (wall seconds, summed over " << slots.size() << " threads):\n\n";
+    std::snprintf(line, sizeof(line), "\t%-14s %10s %7s %10s\n", "phase", "total", "share", "max thread");
+    os << line;
+
+    for (int p = 0; p < num_phases; ++p)
+    {
+        auto max_thread = 0.0;
+
+        for (const auto& slot : slots)
+        {
+            max_thread = std::max(max_thread, slot.times[p]);
+        }
+        std::snprintf(line, sizeof(line), "\t%-14s %10.4f %6.1f%% %10.4f\n",
+            phase_name(p), total[p], 100 * total[p] / sum, max_thread);
+        os << line;
+    }
+
+    for (int p = 0; p < num_phases; ++p)
+    {
+        const double in = bytes_in[p].load();
+        const double out = bytes_out[p].load();
+
+        if (in > 0)
+        {
+            std::snprintf(line, sizeof(line), "\n\t%s: %.2f MB -> %.2f MB (ratio %.2f), %.1f MB/s per thread\n",
+                phase_name(p), in / 1e6, out / 1e6, in / std::max(out, 1.0), in / 1e6 / std::max(total[p], 1e-300));
+            os << line;
+        }
+    }
+    os << "\n";
+}
+
+void Profiler::print_roofline(std::ostream& os, double peak_gflops, double peak_gbs) const
+{
+    const auto counts = counter_totals();
+    const auto times = totals();
+    const long line_size = std::max(::sysconf(_SC_LEVEL1_DCACHE_LINESIZE), 64L);
+    const double ridge = peak_gflops > 0 && peak_gbs > 0 ? peak_gflops / peak_gbs : 0.0;
+    char line[192];
+
+    os << std::string(52, '=') << "\n";
+    os << "Hardware counters (summed over " << slots.size() << " threads):\n\n";
+
+    for (const auto& slot : slots)
+    {
+        if (slot.hardware && ! slot.hardware->error().empty())
+        {
+            os << "\tleft out: " << slot.hardware->error() << "\n\n";
+            break;
+        }
+    }
+    std::snprintf(line, sizeof(line), "\t%-10s %6s %7s %10s %10s %9s %11s %10s %s\n",
+        "region", "IPC", "LLC miss", "GFLOP", "GB moved", "FLOP/byte", "GFLOP/s/thr", "GB/s/thr", ridge > 0 ? "bound (roofline fraction)" : "");
+    os << line;
+
+    for (int r = 0; r < num_regions; ++r)
+    {
+        using C = HardwareCounters;
+        const auto& v = counts[r];
+
+        // The kernel's wall time is that of its laps.
+        const double seconds = r == kernel_region
+        ? times[cons_to_prim] + times[reconstruct] + times[riemann] + times[sources]
+        : times[r];
+
+        if (! (v[C::cycles] > 0) && ! (v[C::flops] > 0) && ! (v[C::cache_references] > 0))
+        {
+            continue;
+        }
+        const double bytes = v[C::cache_misses] * line_size;
+        const double intensity = v[C::flops] / bytes;
+        const double gflops = v[C::flops] / 1e9 / std::max(seconds, 1e-300);
+        auto bound = std::string();
+
+        if (ridge > 0 && intensity > 0)
+        {
+            // The ceiling is that of the whole machine, and the rates are per
+            // thread, so the fraction is a lower bound when threads overlap.
+            const double roof = std::min(peak_gflops, intensity * peak_gbs);
+            std::snprintf(line, sizeof(line), "%s (%.1f%%)", intensity < ridge ? "memory" : "compute", 100 * gflops / roof);
+            bound = line;
+        }
+        std::snprintf(line, sizeof(line), "\t%-10s %6.2f %6.1f%% %10.3f %10.3f %9.3f %11.3f %10.3f %s\n",
+            region_name(r),
+            v[C::instructions] / v[C::cycles],
+            100 * v[C::cache_misses] / v[C::cache_references],
+            v[C::flops] / 1e9,
+            bytes / 1e9,
+            intensity,
+            gflops,
+            bytes / 1e9 / std::max(seconds, 1e-300),
+            bound.c_str());
+        os << line;
+    }
+    if (ridge > 0)
+    {
+        std::snprintf(line, sizeof(line), "\n\tridge point %.3f FLOP/byte (peak_gflops=%g, peak_gbs=%g)\n", ridge, peak_gflops, peak_gbs);
+        os << line;
+    }
+    os << "\n\tBytes moved are estimated as last-level cache misses times the " << line_size << "-byte line.\n\n";
+}
+
+void Profiler::write_trace(std::string filename) const
+{
+    auto os = std::ofstream(filename);
+
+    if (! os.is_open())
+    {
+        throw std::invalid_argument("file " + filename + " could not be opened for writing");
+    }
+
+    auto microseconds = [this] (Clock::time_point t)
+    {
+        return std::chrono::duration<double, std::micro>(t - origin).count();
+    };
+    auto first = true;
+
+    os << "{\"traceEvents\": [\n";
+
+    for (std::size_t tid = 0; tid < slots.size(); ++tid)
+    {
+        for (const auto& event : slots[tid].events)
+        {
+            os << (first ? "" : ",\n")
+            << "{\"name\": \"" << phase_name(event.phase) << "\", \"ph\": \"X\", \"pid\": 0"
+            << ", \"tid\": " << tid
+            << ", \"ts\": " << microseconds(event.start)
+            << ", \"dur\": " << microseconds(event.end) - microseconds(event.start)
+            << ", \"args\": {\"patch\": " << event.patch << "}}";
+            first = false;
+        }
+    }
+    os << "\n], \"displayTimeUnit\": \"ms\"}\n";
+}
@@ -0,0 +1,357 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+
+
+// ============================================================================
+/**
+ * Lightweight per-thread instrumentation. Wall time is accumulated per phase
+ * into one slot per thread: slot 0 is the thread that created the profiler,
+ * slot n + 1 is thread pool worker n, and the last slot is shared by any
+ * other threads, of which there should be at most one, e.g. the background
+ * output writer. A slot is only ever written by its own thread, so recording
+ * takes no locks. Contiguous scopes are also kept as trace events,
+ * which can be written in the Chrome trace_event JSON format.
+ */
+namespace profiler
+{
+    enum Phase
+    {
+        fetch,
+        cons_to_prim,
+        reconstruct,
+        riemann,
+        sources,
+        commit,
+        compress,
+        io,
+        num_phases,
+    };
+
+    /**
+     * The regions that hardware events are counted in: the phases of Scope,
+     * and whole patch kernels, whose phases alternate too quickly to be
+     * counted apart.
+     */
+    enum
+    {
+        kernel_region = num_phases,
+        num_regions,
+    };
+
+    using Clock = std::chrono::steady_clock;
+    using PhaseTimes = std::array<double, num_phases>;
+
+    const char* phase_name(int phase);
+    const char* region_name(int region);
+
+    class HardwareCounters;
+    class PhaseCounters;
+    class Profiler;
+    class Count;
+    class Scope;
+    class Lap;
+}
+
+
+
+
+// ============================================================================
+/**
+ * Hardware event counters of the thread that creates them, read through Linux
+ * perf_event: cycles, instructions, last-level cache references and misses,
+ * and double-precision FLOPs. FLOPs are only counted on Intel CPUs, as the
+ * FP_ARITH_INST_RETIRED events weighted by vector width. Events that the CPU
+ * or the kernel settings (perf_event_paranoid) do not allow are left out, and
+ * read as NaN. Counts are user-space only, and scaled for multiplexing.
+ */
+class profiler::HardwareCounters
+{
+public:
+    enum
+    {
+        cycles,
+        instructions,
+        cache_references,
+        cache_misses,
+        flops,
+        num_counters,
+    };
+    using Values = std::array<double, num_counters>;
+
+    static const char* name(int counter);
+
+    HardwareCounters();
+    ~HardwareCounters();
+    HardwareCounters(const HardwareCounters&) = delete;
+    HardwareCounters& operator=(const HardwareCounters&) = delete;
+
+    /**
+     * Return the counts since construction.
+     */
+    Values read() const;
+
+    /**
+     * Return why events were left out, or an empty string if none were.
+     */
+    const std::string& error() const { return message; }
+
+private:
+    struct Group
+    {
+        std::vector<int> fds; // the leader first
+        std::vector<int> counters;
+        std::vector<double> weights;
+    };
+    void open_group(const std::vector<std::array<std::uint64_t, 4>>& events);
+
+    std::vector<Group> groups;
+    std::array<bool, num_counters> missing;
+    std::string message;
+};
+
+
+
+
+// ============================================================================
+/**
+ * The per-phase accumulators of one thread. Only that thread adds to them,
+ * through relaxed atomics, so other threads may read them at any time.
+ */
+class profiler::PhaseCounters
+{
+public:
+    PhaseCounters()
+    {
+        for (auto& t : counters)
+        {
+            t.store(0.0, std::memory_order_relaxed);
+        }
+    }
+
+    void add(int phase, double seconds)
+    {
+        auto& t = counters[phase];
+        t.store(t.load(std::memory_order_relaxed) + seconds, std::memory_order_relaxed);
+    }
+
+    double operator[](int phase) const
+    {
+        return counters[phase].load(std::memory_order_relaxed);
+    }
+
+private:
+    std::array<std::atomic<double>, num_phases> counters;
+};
+
+
+
+
+// ============================================================================
+class profiler::Profiler
+{
+public:
+    /**
+     * Constructor. num_workers is the size of the thread pool whose workers
+     * will record into this profiler.
+     */
+    Profiler(std::size_t num_workers);
+
+    /**
+     * Return the phase counters of the calling thread's slot.
+     */
+    PhaseCounters& times();
+
+    /**
+     * Record a trace event for the calling thread. Events beyond a fixed
+     * limit are dropped, so that long runs keep a bounded footprint.
+     */
+    void record(Phase phase, Clock::time_point start, Clock::time_point end, int patch=-1);
+
+    /**
+     * Count bytes going into and out of a phase that transforms data, such
+     * as compression. The summary reports the throughput and the ratio.
+     */
+    void add_bytes(Phase phase, std::uint64_t bytes_in, std::uint64_t bytes_out);
+
+    /**
+     * Return the phase totals summed over all threads.
+     */
+    PhaseTimes totals() const;
+
+    /**
+     * Count hardware events in the Scope and Count regions of every thread
+     * from now on. Each thread opens its counters on first use.
+     */
+    void enable_counters();
+    bool counting() const { return counters_enabled; }
+
+    /**
+     * Return the calling thread's hardware counts, for add_counts.
+     */
+    HardwareCounters::Values read_counters();
+
+    /**
+     * Add the calling thread's counts since start to the given region.
+     */
+    void add_counts(int region, const HardwareCounters::Values& start);
+
+    /**
+     * Return the hardware counts of each region, summed over all threads.
+     */
+    std::array<HardwareCounters::Values, num_regions> counter_totals() const;
+
+    void print_summary(std::ostream& os) const;
+
+    /**
+     * Print, for each region with counts, the IPC, the cache miss rate, the
+     * FLOPs and the bytes moved, which are estimated as the last-level cache
+     * misses times the line size, and the arithmetic intensity. Given the
+     * machine's peak FLOP rate and memory bandwidth (0 if unknown), each
+     * region is also placed on the roofline: memory-bound if its intensity
+     * is below the ridge point, peak_gflops / peak_gbs, and compute-bound
+     * otherwise, with the fraction of the roofline it attains per thread.
+     */
+    void print_roofline(std::ostream& os, double peak_gflops, double peak_gbs) const;
+    void write_trace(std::string filename) const;
+
+private:
+    struct Event
+    {
+        Clock::time_point start;
+        Clock::time_point end;
+        int phase;
+        int patch;
+    };
+
+    struct Slot
+    {
+        PhaseCounters times;
+        std::vector<Event> events;
+        std::unique_ptr<HardwareCounters> hardware;
+        std::array<std::atomic<double>, num_regions * HardwareCounters::num_counters> counts;
+    };
+
+    Slot& this_slot();
+
+    std::vector<Slot> slots;
+    bool counters_enabled = false;
+    std::array<std::atomic<std::uint64_t>, num_phases> bytes_in;
+    std::array<std::atomic<std::uint64_t>, num_phases> bytes_out;
+    Clock::time_point origin;
+    std::thread::id main_thread;
+};
+
+
+
+
+// ============================================================================
+/**
+ * Attributes the hardware events of its own lifetime to a region, if the
+ * profiler is counting them. Does nothing if the profiler is null.
+ */
+class profiler::Count
+{
+public:
+    Count(Profiler* profiler, int region)
+    : profiler(profiler && profiler->counting() ? profiler : nullptr)
+    , region(region)
+    , start(this->profiler ? this->profiler->read_counters() : HardwareCounters::Values())
+    {
+    }
+
+    ~Count()
+    {
+        if (profiler)
+        {
+            profiler->add_counts(region, start);
+        }
+    }
+
+private:
+    Profiler* profiler;
+    int region;
+    HardwareCounters::Values start;
+};
+
+
+
+
+// ============================================================================
+/**
+ * Attributes the wall time of its own lifetime to a phase, and records it as
+ * a trace event. Its hardware events are counted as well (see Count). Does
+ * nothing if the profiler is null.
+ */
+class profiler::Scope
+{
+public:
+    Scope(Profiler* profiler, Phase phase, int patch=-1)
+    : profiler(profiler)
+    , phase(phase)
+    , patch(patch)
+    , start(profiler ? Clock::now() : Clock::time_point())
+    , count(profiler, phase)
+    {
+    }
+
+    ~Scope()
+    {
+        if (profiler)
+        {
+            auto end = Clock::now();
+            profiler->times().add(phase, std::chrono::duration<double>(end - start).count());
+            profiler->record(phase, start, end, patch);
+        }
+    }
+
+private:
+    Profiler* profiler;
+    Phase phase;
+    int patch;
+    Clock::time_point start;
+    Count count;
+};
+
+
+
+
+// ============================================================================
+/**
+ * Splits an interleaved loop into phases: each call attributes the wall time
+ * since the previous call (or since construction) to the given phase. Meant
+ * for kernels, where the phases alternate row by row and are too short to be
+ * worth a trace event. Does nothing if times is null.
+ */
+class profiler::Lap
+{
+public:
+    Lap(PhaseCounters* times)
+    : times(times)
+    , last(times ? Clock::now() : Clock::time_point())
+    {
+    }
+
+    void operator()(Phase phase)
+    {
+        if (times)
+        {
+            auto now = Clock::now();
+            times->add(phase, std::chrono::duration<double>(now - last).count());
+            last = now;
+        }
+    }
+
+private:
+    PhaseCounters* times;
+    Clock::time_point last;
+};
@@ -0,0 +1,126 @@
+#pragma once
+#include <cmath>
+#include <algorithm>
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+
+
+
+// ============================================================================
+/**
+ * A minimal packed-double type for the batch physics functors. The width is
+ * fixed at compile time by the target: 8 lanes with AVX-512, 4 lanes with
+ * AVX2, otherwise a single scalar lane. Enable the wide variants by building
+ * with e.g. CXXFLAGS += -march=native in Makefile.in.
+ */
+namespace simd {
+    struct vdouble;
+}
+
+
+
+
+#if defined(__AVX512F__)
+// ============================================================================
+struct simd::vdouble
+{
+    static constexpr int size = 8;
+    vdouble() : v(_mm512_setzero_pd()) {}
+    vdouble(double x) : v(_mm512_set1_pd(x)) {}
+    vdouble(__m512d v) : v(v) {}
+    static vdouble load(const double* p) { return _mm512_loadu_pd(p); }
+    void store(double* p) const { _mm512_storeu_pd(p, v); }
+    __m512d v;
+};
+
+namespace simd {
+    inline vdouble operator+(vdouble a, vdouble b) { return _mm512_add_pd(a.v, b.v); }
+    inline vdouble operator-(vdouble a, vdouble b) { return _mm512_sub_pd(a.v, b.v); }
+    inline vdouble operator*(vdouble a, vdouble b) { return _mm512_mul_pd(a.v, b.v); }
+    inline vdouble operator/(vdouble a, vdouble b) { return _mm512_div_pd(a.v, b.v); }
+    inline vdouble sqrt(vdouble a) { return _mm512_sqrt_pd(a.v); }
+    inline vdouble max(vdouble a, vdouble b) { return _mm512_max_pd(a.v, b.v); }
+    inline vdouble min(vdouble a, vdouble b) { return _mm512_min_pd(a.v, b.v); }
+    inline vdouble fabs(vdouble a) { return _mm512_abs_pd(a.v); }
+
+    /** Equivalent of std::copysign(1, a) */
+    inline vdouble sgn(vdouble a)
+    {
+        const auto sign = _mm512_and_si512(_mm512_castpd_si512(a.v), _mm512_set1_epi64(0x8000000000000000));
+        return _mm512_castsi512_pd(_mm512_or_si512(sign, _mm512_castpd_si512(_mm512_set1_pd(1.0))));
+    }
+    inline bool any_negative(vdouble a)
+    {
+        return _mm512_cmp_pd_mask(a.v, _mm512_setzero_pd(), _CMP_LT_OQ) != 0;
+    }
+}
+
+
+
+
+#elif defined(__AVX2__)
+// ============================================================================
+struct simd::vdouble
+{
+    static constexpr int size = 4;
+    vdouble() : v(_mm256_setzero_pd()) {}
+    vdouble(double x) : v(_mm256_set1_pd(x)) {}
+    vdouble(__m256d v) : v(v) {}
+    static vdouble load(const double* p) { return _mm256_loadu_pd(p); }
+    void store(double* p) const { _mm256_storeu_pd(p, v); }
+    __m256d v;
+};
+
+namespace simd {
+    inline vdouble operator+(vdouble a, vdouble b) { return _mm256_add_pd(a.v, b.v); }
+    inline vdouble operator-(vdouble a, vdouble b) { return _mm256_sub_pd(a.v, b.v); }
+    inline vdouble operator*(vdouble a, vdouble b) { return _mm256_mul_pd(a.v, b.v); }
+    inline vdouble operator/(vdouble a, vdouble b) { return _mm256_div_pd(a.v, b.v); }
+    inline vdouble sqrt(vdouble a) { return _mm256_sqrt_pd(a.v); }
+    inline vdouble max(vdouble a, vdouble b) { return _mm256_max_pd(a.v, b.v); }
+    inline vdouble min(vdouble a, vdouble b) { return _mm256_min_pd(a.v, b.v); }
+    inline vdouble fabs(vdouble a) { return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a.v); }
+
+    /** Equivalent of std::copysign(1, a) */
+    inline vdouble sgn(vdouble a)
+    {
+        return _mm256_or_pd(_mm256_and_pd(_mm256_set1_pd(-0.0), a.v), _mm256_set1_pd(1.0));
+    }
+    inline bool any_negative(vdouble a)
+    {
+        return _mm256_movemask_pd(_mm256_cmp_pd(a.v, _mm256_setzero_pd(), _CMP_LT_OQ)) != 0;
+    }
+}
+
+
+
+
+#else
+// ============================================================================
+struct simd::vdouble
+{
+    static constexpr int size = 1;
+    vdouble() : v(0.0) {}
+    vdouble(double x) : v(x) {}
+    static vdouble load(const double* p) { return *p; }
+    void store(double* p) const { *p = v; }
+    double v;
+};
+
+namespace simd {
+    inline vdouble operator+(vdouble a, vdouble b) { return a.v + b.v; }
+    inline vdouble operator-(vdouble a, vdouble b) { return a.v - b.v; }
+    inline vdouble operator*(vdouble a, vdouble b) { return a.v * b.v; }
+    inline vdouble operator/(vdouble a, vdouble b) { return a.v / b.v; }
+    inline vdouble sqrt(vdouble a) { return std::sqrt(a.v); }
+    inline vdouble max(vdouble a, vdouble b) { return std::max(a.v, b.v); }
+    inline vdouble min(vdouble a, vdouble b) { return std::min(a.v, b.v); }
+    inline vdouble fabs(vdouble a) { return std::fabs(a.v); }
+
+    /** Equivalent of std::copysign(1, a) */
+    inline vdouble sgn(vdouble a) { return std::copysign(1.0, a.v); }
+    inline bool any_negative(vdouble a) { return a.v < 0.0; }
+}
+#endif
@@ -0,0 +1,2517 @@
+#include <sstream>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <mutex>
+#include <utility>
+#include "ndarray.hpp"
+#include "physics.hpp"
+#include "simd.hpp"
+#include "patches.hpp"
+#include "ufunc.hpp"
+#include "chkpt.hpp"
+#include "solver.hpp"
+
+using namespace patches2d;
+using run_config = atmo::run_config;
+
+
+
+
+// ============================================================================
+nd::array<double, 3> mesh_vertices(int ni, int nj, std::array<double, 4> extent)
+{
+    auto X = nd::array<double, 3>(ni + 1, nj + 1, 2);
+    auto x0 = extent[0];
+    auto x1 = extent[1];
+    auto y0 = extent[2];
+    auto y1 = extent[3];
+
+    for (int i = 0; i < ni + 1; ++i)
+    {
+        const auto x = x0 * std::pow(x1 / x0, double(i) / ni);
+
+        for (int j = 0; j < nj + 1; ++j)
+        {
+            X(i, j, 0) = x;
+            X(i, j, 1) = y0 + (y1 - y0) * j / nj;
+        }
+    }
+    return X;
+}
+
+nd::array<double, 3> mesh_cell_centroids(const nd::array<double, 3>& verts)
+{
+    auto centroid_r = ufunc::from([] (double r0, double r1)
+    {
+        return std::sqrt(r0 * r1);
+    });
+    auto centroid_q = ufunc::from([] (double q0, double q1)
+    {
+        return 0.5 * (q0 + q1);
+    });
+
+    auto _ = nd::axis::all();
+    auto mi = verts.shape(0);
+    auto mj = verts.shape(1);
+    auto r0 = verts.select(_|0|mi-1, _|0|mj-1, _|0|1);
+    auto r1 = verts.select(_|1|mi-0, _|1|mj-0, _|0|1);
+    auto q0 = verts.select(_|0|mi-1, _|0|mj-1, _|1|2);
+    auto q1 = verts.select(_|1|mi-0, _|1|mj-0, _|1|2);
+    auto res = nd::array<double, 3>(mi - 1, mj - 1, 2);
+
+    res.select(_, _, _|0|1) = centroid_r(r0, r1);
+    res.select(_, _, _|1|2) = centroid_q(q0, q1);
+
+    return res;
+}
+
+nd::array<double, 3> mesh_cell_volumes(const nd::array<double, 3>& verts)
+{
+    auto _ = nd::axis::all();
+    auto p1 = 2 * M_PI;
+    auto p0 = 0;
+    auto mi = verts.shape(0);
+    auto mj = verts.shape(1);
+    auto r0 = verts.select(_|0|mi-1, _|0|mj-1, _|0|1);
+    auto r1 = verts.select(_|1|mi-0, _|1|mj-0, _|0|1);
+    auto q0 = verts.select(_|0|mi-1, _|0|mj-1, _|1|2);
+    auto q1 = verts.select(_|1|mi-0, _|1|mj-0, _|1|2);
+
+    auto volume = ufunc::nfrom([p0, p1] (std::array<double, 4> extent)
+    {
+        auto r0 = extent[0];
+        auto r1 = extent[1];
+        auto q0 = extent[2];
+        auto q1 = extent[3];
+        return -1. / 3 * (r1 * r1 * r1 - r0 * r0 * r0) * (std::cos(q1) - std::cos(q0)) * (p1 - p0);
+    });
+
+    auto args = std::array<nd::array<double, 3>, 4>{r0, r1, q0, q1};
+    return volume(args);
+}
+
+nd::array<double, 3> mesh_face_areas_i(const nd::array<double, 3>& verts)
+{
+    auto _ = nd::axis::all();
+    auto p1 = 2 * M_PI;
+    auto p0 = 0;
+    // auto mi = verts.shape(0);
+    auto mj = verts.shape(1);
+    auto r0 = verts.select(_, _|0|mj-1, _|0|1);
+    auto r1 = verts.select(_, _|1|mj-0, _|0|1);
+    auto q0 = verts.select(_, _|0|mj-1, _|1|2);
+    auto q1 = verts.select(_, _|1|mj-0, _|1|2);
+
+    auto area = ufunc::nfrom([p0, p1] (std::array<double, 4> extent)
+    {
+        auto r0 = extent[0];
+        // auto r1 = extent[1];
+        auto q0 = extent[2];
+        auto q1 = extent[3];
+        return -r0 * r0 * (p1 - p0) * (std::cos(q1) - std::cos(q0));
+    });
+
+    auto args = std::array<nd::array<double, 3>, 4>{r0, r1, q0, q1};
+    return area(args);
+}
+
+nd::array<double, 3> mesh_face_areas_j(const nd::array<double, 3>& verts)
+{
+    auto _ = nd::axis::all();
+    auto p1 = 2 * M_PI;
+    auto p0 = 0;
+    auto mi = verts.shape(0);
+    // auto mj = verts.shape(1);
+    auto r0 = verts.select(_|0|mi-1, _, _|0|1);
+    auto r1 = verts.select(_|1|mi-0, _, _|0|1);
+    auto q0 = verts.select(_|0|mi-1, _, _|1|2);
+    auto q1 = verts.select(_|1|mi-0, _, _|1|2);
+
+    auto area = ufunc::nfrom([p0, p1] (std::array<double, 4> extent)
+    {
+        auto r0 = extent[0];
+        auto r1 = extent[1];
+        auto q0 = extent[2];
+        // auto q1 = extent[3];
+        return 0.5 * (r1 + r0) * (r1 - r0) * (p1 - p0) * std::sin(q0);
+    });
+
+    auto args = std::array<nd::array<double, 3>, 4>{r0, r1, q0, q1};
+    return area(args);
+}
+
+
+
+
+// ============================================================================
+nd::array<double, 3> pad_with_zeros_j(const nd::array<double, 3>& A)
+{
+    auto _ = nd::axis::all();
+    auto ni = A.shape(0);
+    auto nj = A.shape(1);
+    auto nk = A.shape(2);
+
+    auto res = nd::ndarray<double, 3>(ni, nj + 2, nk);
+    res.select(_, _|1|nj+1, _) = A;
+    return res;
+}
+
+
+
+
+// ============================================================================
+static simd::vdouble minmod(simd::vdouble ul, simd::vdouble u0, simd::vdouble ur, simd::vdouble theta)
+{
+    const auto a = theta * (u0 - ul);
+    const auto b =   0.5 * (ur - ul);
+    const auto c = theta * (ur - u0);
+    const auto m = simd::min(simd::min(simd::fabs(a), simd::fabs(b)), simd::fabs(c));
+    return 0.25 * simd::fabs(simd::sgn(a) + simd::sgn(b)) * (simd::sgn(a) + simd::sgn(c)) * m;
+}
+
+
+
+
+// ============================================================================
+/**
+ * Return the sum over the two directions of the largest signal speed over
+ * cell width, of a cell with primitives P and inverse widths D. The update is
+ * unsplit, so the fluxes through both pairs of faces act within one step,
+ * and the stable time step is the CFL number (< 1) divided by the maximum of
+ * this sum over the mesh, rather than of the larger term.
+ */
+template <typename Validity>
+static double signal_rate(const hydro::Vars& P, const std::array<double, 2>& D)
+{
+    const auto prim_to_eval = hydro::basic_prim_to_eval<Validity>();
+    const auto Ai = prim_to_eval(P, {1, 0, 0});
+    const auto Aj = prim_to_eval(P, {0, 1, 0});
+    const double ai = std::max(std::fabs(Ai[0]), std::fabs(Ai[4]));
+    const double aj = std::max(std::fabs(Aj[0]), std::fabs(Aj[4]));
+    return ai * D[0] + aj * D[1];
+}
+
+
+
+
+// ============================================================================
+template <typename Validity>
+nd::array<double, 3> advance_2d(
+    hydro::source_terms source_terms,
+    const nd::array<double, 3>& U0,
+    const MeshGeometry& G, double dt,
+    profiler::PhaseCounters* phases=nullptr)
+{
+    auto _ = nd::axis::all();
+    auto lap = profiler::Lap(phases);
+
+    auto update_formula = [dt] (std::array<double, 5> s, std::array<double, 5> df, std::array<double, 1> dv)
+    {
+        return std::array<double, 5>{
+            dt * (s[0] - df[0] / dv[0]),
+            dt * (s[1] - df[1] / dv[0]),
+            dt * (s[2] - df[2] / dv[0]),
+            dt * (s[3] - df[3] / dv[0]),
+            dt * (s[4] - df[4] / dv[0]),
+        };
+    };
+
+    auto flux_times_area_formula = [] (std::array<double, 5> f, std::array<double, 1> da)
+    {
+        return std::array<double, 5>{
+            f[0] * da[0],
+            f[1] * da[0],
+            f[2] * da[0],
+            f[3] * da[0],
+            f[4] * da[0],
+        };
+    };
+
+    auto gradient_est = ufunc::from(gradient_plm(2.0));
+    auto advance_cons = ufunc::vfrom(update_formula);
+    auto evaluate_src = ufunc::vfrom(hydro::basic_source_terms<Validity>(source_terms));
+    auto cons_to_prim = ufunc::vfrom(hydro::basic_cons_to_prim<Validity>());
+    auto godunov_flux_i = ufunc::vfrom(hydro::basic_riemann_hlle<Validity>({1, 0, 0}));
+    auto godunov_flux_j = ufunc::vfrom(hydro::basic_riemann_hlle<Validity>({0, 1, 0}));
+    auto extrap_l = ufunc::from([] (double a, double b) { return a - b * 0.5; });
+    auto extrap_r = ufunc::from([] (double a, double b) { return a + b * 0.5; });
+    auto flux_times_area = ufunc::vfrom(flux_times_area_formula);
+    auto difference = ufunc::from([] (double a, double b) { return a - b; });
+    auto sum = ufunc::from([] (double a, double b) { return a + b; });
+
+    auto mi = U0.shape(0);
+    auto mj = U0.shape(1);
+    nd::array<double, 3> P0 = cons_to_prim(U0);
+    lap(profiler::cons_to_prim);
+
+    nd::array<double, 3> Fhi = [&] ()
+    {
+        auto Pa = P0.select(_|0|mi-2, _, _);
+        auto Pb = P0.select(_|1|mi-1, _, _);
+        auto Pc = P0.select(_|2|mi-0, _, _);
+        auto Gb = gradient_est(ufunc::lazy(Pa), ufunc::lazy(Pb), ufunc::lazy(Pc));
+        nd::array<double, 3> Pl = extrap_l(ufunc::lazy(Pb), Gb);
+        nd::array<double, 3> Pr = extrap_r(ufunc::lazy(Pb), Gb);
+        lap(profiler::reconstruct);
+        auto Fh = godunov_flux_i(Pr.template take<0>(_|0|mi-3), Pl.template take<0>(_|1|mi-2));
+        auto Fa = flux_times_area(Fh, G.face_areas_i);
+        lap(profiler::riemann);
+        return Fa;
+    }();
+
+    nd::array<double, 3> Fhj = [&] ()
+    {
+        auto Pa = P0.select(_|2|mi-2, _|0|mj-2, _);
+        auto Pb = P0.select(_|2|mi-2, _|1|mj-1, _);
+        auto Pc = P0.select(_|2|mi-2, _|2|mj-0, _);
+        auto Gb = pad_with_zeros_j(gradient_est(Pa, Pb, Pc));
+        auto Pl = extrap_l(P0.take<0>(_|2|mi-2), Gb);
+        auto Pr = extrap_r(P0.take<0>(_|2|mi-2), Gb);
+        lap(profiler::reconstruct);
+        auto Fh = pad_with_zeros_j(godunov_flux_j(Pr.template take<1>(_|0|mj-1), Pl.template take<1>(_|1|mj)));
+        auto Fa = flux_times_area(Fh, G.face_areas_j);
+        lap(profiler::riemann);
+        return Fa;
+    }();
+
+    auto Fi1 = Fhi.take<0>(_|1|mi-3);
+    auto Fi0 = Fhi.take<0>(_|0|mi-4);
+    auto Fj1 = Fhj.take<1>(_|1|mj+1);
+    auto Fj0 = Fhj.take<1>(_|0|mj+0);
+    nd::array<double, 3> dF = sum(difference(ufunc::lazy(Fi1), ufunc::lazy(Fi0)), difference(ufunc::lazy(Fj1), ufunc::lazy(Fj0)));
+
+    auto S0 = evaluate_src(P0.take<0>(_|2|mi-2), G.centroids);
+    auto dU = advance_cons(S0, dF, G.volumes);
+    nd::array<double, 3> U1 = U0.take<0>(_|2|mi-2) + dU;
+    lap(profiler::sources);
+
+    return U1;
+}
+
+
+
+
+// ============================================================================
+/**
+ * Single-pass equivalent of advance_2d. The patch is walked once in the
+ * i-direction: each row is converted to primitives exactly once, into a ring
+ * of four primitive rows, and the i-face fluxes go into a ring of two flux
+ * rows. As soon as the faces on both sides of a row are known, that row's
+ * j-fluxes and source terms are formed and the update is written out. The
+ * working set is a handful of rows, so it stays in cache, and the arithmetic
+ * is identical to the ufunc pipeline. The rows live in the given scratch, and
+ * rows [n0, n1) of the result are written into U1, which must have shape
+ * (ni, nj, 5); they depend only on rows [n0, n1 + 4) of U0, and on the same
+ * rows of the guard columns. The return value is the maximum signal_rate over
+ * those rows.
+ */
+template <typename Validity>
+double advance_2d_fused(
+    hydro::source_terms source_terms,
+    const GuardedRows& U0,
+    const MeshGeometry& G, double dt,
+    KernelScratch& scratch,
+    nd::array<double, 3>& U1,
+    int n0, int n1)
+{
+    using Vars = hydro::Vars;
+
+    const auto evaluate_src = hydro::basic_source_terms<Validity>(source_terms);
+    const auto gradient_est = gradient_plm(2.0);
+    auto max_rate = 0.0;
+    auto lap = profiler::Lap(scratch.phases);
+    const auto cons_to_prim = hydro::basic_cons_to_prim<Validity>();
+    const auto godunov_flux_i = hydro::basic_riemann_hlle<Validity>({1, 0, 0});
+    const auto godunov_flux_j = hydro::basic_riemann_hlle<Validity>({0, 1, 0});
+
+    const int mj = U0.cols();
+    const int mw = mj + 4; // primitive rows hold the guard columns -2, -1, mj, and mj + 1
+
+    Vars* P_ring = KernelScratch::zeros(scratch.vars, 10 * mj + 19); // primitive rows k .. k + 3
+    Vars* G_ring = P_ring + 4 * mw;     // i-slopes of rows k + 1 and k + 2
+    Vars* F_ring = G_ring + 2 * mj;     // area-weighted i-fluxes on faces k - 1 and k
+    Vars* Gj_row = F_ring + 2 * mj + 1; // j-slopes of the row being updated, from cell -1
+    Vars* Fj_row = Gj_row + mj + 1;     // area-weighted j-fluxes of the row being updated
+
+    auto prim_row = [&] (int r)
+    {
+        return &P_ring[(r % 4) * mw + 2];
+    };
+
+    auto slope_row = [&] (int r)
+    {
+        return &G_ring[(r % 2) * mj];
+    };
+
+    auto flux_row = [&] (int k)
+    {
+        return &F_ring[(k % 2) * mj];
+    };
+
+    auto slope = [&] (const Vars& a, const Vars& b, const Vars& c)
+    {
+        auto g = Vars();
+
+        for (int q = 0; q < 5; ++q)
+        {
+            g[q] = gradient_est(a[q], b[q], c[q]);
+        }
+        return g;
+    };
+
+    auto load_row = [&] (int r)
+    {
+        const auto& A = U0.array(r);
+        const int i = U0.row(r);
+        auto P = prim_row(r);
+
+        for (int j = 0; j < mj; ++j)
+        {
+            auto U = Vars();
+
+            for (int q = 0; q < 5; ++q)
+            {
+                U[q] = A(i, j, q);
+            }
+            P[j] = cons_to_prim(U);
+        }
+    };
+
+    // Only the row being updated needs its guard columns, for the j-fluxes.
+    auto load_guard_columns = [&] (int n, Vars* P)
+    {
+        for (int side = 0; side < 2; ++side)
+        {
+            if (! U0.columns[side])
+            {
+                continue;
+            }
+            const auto& C = *U0.columns[side];
+            const int j0 = side == 0 ? -2 : mj;
+
+            for (int c = 0; c < 2; ++c)
+            {
+                auto U = Vars();
+
+                for (int q = 0; q < 5; ++q)
+                {
+                    U[q] = C(n, c, q);
+                }
+                P[j0 + c] = cons_to_prim(U);
+            }
+        }
+    };
+
+    auto load_slopes = [&] (int r)
+    {
+        const Vars* Pa = prim_row(r - 1);
+        const Vars* Pb = prim_row(r + 0);
+        const Vars* Pc = prim_row(r + 1);
+        Vars* G = slope_row(r);
+
+        for (int j = 0; j < mj; ++j)
+        {
+            G[j] = slope(Pa[j], Pb[j], Pc[j]);
+        }
+    };
+
+    for (int r = n0; r < n0 + 3; ++r)
+    {
+        load_row(r);
+    }
+    lap(profiler::cons_to_prim);
+    load_slopes(n0 + 1);
+    lap(profiler::reconstruct);
+
+    // Face k lies between rows k + 1 and k + 2 of U0, and interior row
+    // n = k - 1 is completed once face k is known.
+    // ------------------------------------------------------------------------
+    for (int k = n0; k < n1 + 1; ++k)
+    {
+        load_row(k + 3);
+        lap(profiler::cons_to_prim);
+        load_slopes(k + 2);
+        lap(profiler::reconstruct);
+
+        const Vars* Pb = prim_row(k + 1);
+        const Vars* Pc = prim_row(k + 2);
+        const Vars* Gb = slope_row(k + 1);
+        const Vars* Gc = slope_row(k + 2);
+        Vars* Fk = flux_row(k);
+
+        for (int j = 0; j < mj; ++j)
+        {
+            auto Pr = Vars();
+            auto Pl = Vars();
+
+            for (int q = 0; q < 5; ++q)
+            {
+                Pr[q] = Pb[j][q] + Gb[j][q] * 0.5;
+                Pl[q] = Pc[j][q] - Gc[j][q] * 0.5;
+            }
+            const auto Fh = godunov_flux_i(Pr, Pl);
+            const double da = G.face_areas_i(k, j, 0);
+
+            for (int q = 0; q < 5; ++q)
+            {
+                Fk[j][q] = Fh[q] * da;
+            }
+        }
+
+        lap(profiler::riemann);
+
+        if (k == n0)
+        {
+            continue;
+        }
+
+        const int n = k - 1;
+        const Vars* P = Pb;
+        const Vars* Fm = flux_row(k - 1);
+        const auto& A = U0.array(n + 2);
+        const int i = U0.row(n + 2);
+        const bool jl = U0.columns[0];
+        const bool jr = U0.columns[1];
+
+        // j-fluxes: next to the polar axis, the slope is zero in the edge
+        // cell and the flux through the axis face vanishes. At an edge with a
+        // j-neighbor, the guard columns give the slopes of the cells on
+        // either side of the edge, and the flux through it.
+        // --------------------------------------------------------------------
+        load_guard_columns(n, prim_row(k + 1));
+        lap(profiler::cons_to_prim);
+
+        if (! jl) Gj_row[0]      = Vars();
+        if (! jr) Gj_row[mj - 1] = Vars();
+
+        for (int j = jl ? -1 : 1; j < (jr ? mj + 1 : mj - 1); ++j)
+        {
+            Gj_row[j] = slope(P[j - 1], P[j], P[j + 1]);
+        }
+
+        lap(profiler::reconstruct);
+
+        if (! jl) Fj_row[0]  = Vars();
+        if (! jr) Fj_row[mj] = Vars();
+
+        for (int j = jl ? 0 : 1; j < (jr ? mj + 1 : mj); ++j)
+        {
+            auto Pr = Vars();
+            auto Pl = Vars();
+
+            for (int q = 0; q < 5; ++q)
+            {
+                Pr[q] = P[j - 1][q] + Gj_row[j - 1][q] * 0.5;
+                Pl[q] = P[j + 0][q] - Gj_row[j + 0][q] * 0.5;
+            }
+            const auto Fh = godunov_flux_j(Pr, Pl);
+            const double da = G.face_areas_j(n, j, 0);
+
+            for (int q = 0; q < 5; ++q)
+            {
+                Fj_row[j][q] = Fh[q] * da;
+            }
+        }
+
+        lap(profiler::riemann);
+
+        // Source terms and the update
+        // --------------------------------------------------------------------
+        for (int j = 0; j < mj; ++j)
+        {
+            const auto S = evaluate_src.evaluate(P[j], G.sources[n * mj + j]);
+            const double dv = G.volumes(n, j, 0);
+
+            for (int q = 0; q < 5; ++q)
+            {
+                const double df = (Fk[j][q] - Fm[j][q]) + (Fj_row[j + 1][q] - Fj_row[j][q]);
+                U1(n, j, q) = A(i, j, q) + dt * (S[q] - df / dv);
+            }
+            max_rate = std::max(max_rate, signal_rate<Validity>(P[j], G.inverse_widths[n * mj + j]));
+        }
+        lap(profiler::sources);
+    }
+    return max_rate;
+}
+
+
+
+
+// ============================================================================
+/**
+ * Vectorized variant of advance_2d_fused. Rows are held in structure-of-arrays
+ * form (all densities, then all radial velocities, ...), so the slopes and the
+ * Riemann solver run on simd::vdouble::size adjacent j-cells at a time. Rows
+ * are padded by two vector widths, and padding cells replicate the last real
+ * cell, so whole-vector and one-cell-shifted loads never touch invalid data.
+ * Primitive and j-slope rows also have a lead of at least two cells, for the
+ * guard columns. The source terms and the final update are evaluated one
+ * cell at a time.
+ */
+template <typename Validity>
+double advance_2d_simd(
+    hydro::source_terms source_terms,
+    const GuardedRows& U0,
+    const MeshGeometry& G, double dt,
+    KernelScratch& scratch,
+    nd::array<double, 3>& U1,
+    int n0, int n1)
+{
+    using simd::vdouble;
+    using Vars = hydro::Vars;
+    using VarsBatch = hydro::VarsBatch;
+    constexpr int W = vdouble::size;
+
+    const auto evaluate_src = hydro::basic_source_terms<Validity>(source_terms);
+    const auto cons_to_prim = hydro::basic_cons_to_prim_batch<Validity>();
+    const auto godunov_flux_i = hydro::basic_riemann_hlle_batch<Validity>({1, 0, 0});
+    const auto godunov_flux_j = hydro::basic_riemann_hlle_batch<Validity>({0, 1, 0});
+    const auto theta = vdouble(2.0);
+    auto max_rate = 0.0;
+    auto lap = profiler::Lap(scratch.phases);
+
+    const int mj = U0.cols();
+    const int lead = (2 + W - 1) / W * W;
+    const int mp = (mj + W - 1) / W * W + 2 * W + lead;
+
+    double* P_ring = KernelScratch::zeros(scratch.reals, 56 * mp); // primitive rows k .. k + 3
+    double* G_ring = P_ring + 4 * 5 * mp; // i-slopes of rows k + 1 and k + 2
+    double* F_ring = G_ring + 2 * 5 * mp; // area-weighted i-fluxes on faces k - 1 and k
+    double* Gj_row = F_ring + 2 * 5 * mp + lead; // j-slopes of the row being updated
+    double* Fj_row = Gj_row - lead + 5 * mp;     // area-weighted j-fluxes of the row being updated
+    double* U_row  = Fj_row + 5 * mp;            // conserved row being converted
+    double* A_row  = U_row  + 5 * mp;            // face areas
+
+    auto prim_row  = [&] (int r) { return &P_ring[(r % 4) * 5 * mp + lead]; };
+    auto slope_row = [&] (int r) { return &G_ring[(r % 2) * 5 * mp]; };
+    auto flux_row  = [&] (int k) { return &F_ring[(k % 2) * 5 * mp]; };
+
+    auto load = [mp] (const double* row, int j)
+    {
+        auto X = VarsBatch();
+
+        for (int q = 0; q < 5; ++q)
+        {
+            X[q] = vdouble::load(row + q * mp + j);
+        }
+        return X;
+    };
+
+    auto store = [mp] (double* row, int j, const VarsBatch& X)
+    {
+        for (int q = 0; q < 5; ++q)
+        {
+            X[q].store(row + q * mp + j);
+        }
+    };
+
+    auto slope = [theta] (const VarsBatch& a, const VarsBatch& b, const VarsBatch& c)
+    {
+        auto g = VarsBatch();
+
+        for (int q = 0; q < 5; ++q)
+        {
+            g[q] = minmod(a[q], b[q], c[q], theta);
+        }
+        return g;
+    };
+
+    auto load_row = [&] (int r)
+    {
+        const auto& A = U0.array(r);
+        const int i = U0.row(r);
+
+        for (int j = 0; j < mp - lead; ++j)
+        {
+            for (int q = 0; q < 5; ++q)
+            {
+                U_row[q * mp + j] = A(i, std::min(j, mj - 1), q);
+            }
+        }
+        for (int j = 0; j < mp - lead; j += W)
+        {
+            store(prim_row(r), j, cons_to_prim(load(U_row, j)));
+        }
+    };
+
+    // Only the row being updated needs its guard columns, for the j-fluxes.
+    // They are converted W cells at a time, replicating the second one into
+    // any remaining lanes, and the two real lanes are copied into the row.
+    auto load_guard_columns = [&] (int n, double* P)
+    {
+        for (int side = 0; side < 2; ++side)
+        {
+            if (! U0.columns[side])
+            {
+                continue;
+            }
+            const auto& C = *U0.columns[side];
+            const int j0 = side == 0 ? -2 : mj;
+
+            for (int c0 = 0; c0 < 2; c0 += W)
+            {
+                for (int c = 0; c < W; ++c)
+                {
+                    for (int q = 0; q < 5; ++q)
+                    {
+                        U_row[q * mp + c] = C(n, std::min(c0 + c, 1), q);
+                    }
+                }
+                store(U_row, W, cons_to_prim(load(U_row, 0)));
+
+                for (int c = 0; c < W && c0 + c < 2; ++c)
+                {
+                    for (int q = 0; q < 5; ++q)
+                    {
+                        P[q * mp + j0 + c0 + c] = U_row[q * mp + W + c];
+                    }
+                }
+            }
+        }
+    };
+
+    auto load_slopes = [&] (int r)
+    {
+        for (int j = 0; j < mj; j += W)
+        {
+            store(slope_row(r), j, slope(
+                load(prim_row(r - 1), j),
+                load(prim_row(r + 0), j),
+                load(prim_row(r + 1), j)));
+        }
+    };
+
+    for (int r = n0; r < n0 + 3; ++r)
+    {
+        load_row(r);
+    }
+    lap(profiler::cons_to_prim);
+    load_slopes(n0 + 1);
+    lap(profiler::reconstruct);
+
+    // Face k lies between rows k + 1 and k + 2 of U0, and interior row
+    // n = k - 1 is completed once face k is known.
+    // ------------------------------------------------------------------------
+    for (int k = n0; k < n1 + 1; ++k)
+    {
+        load_row(k + 3);
+        lap(profiler::cons_to_prim);
+        load_slopes(k + 2);
+        lap(profiler::reconstruct);
+
+        const double* Pb = prim_row(k + 1);
+        const double* Pc = prim_row(k + 2);
+        const double* Gb = slope_row(k + 1);
+        const double* Gc = slope_row(k + 2);
+        double* Fk = flux_row(k);
+
+        for (int j = 0; j < mj; ++j)
+        {
+            A_row[j] = G.face_areas_i(k, j, 0);
+        }
+
+        for (int j = 0; j < mj; j += W)
+        {
+            const auto pb = load(Pb, j);
+            const auto pc = load(Pc, j);
+            const auto gb = load(Gb, j);
+            const auto gc = load(Gc, j);
+            const auto da = vdouble::load(&A_row[j]);
+            auto Pr = VarsBatch();
+            auto Pl = VarsBatch();
+
+            for (int q = 0; q < 5; ++q)
+            {
+                Pr[q] = pb[q] + gb[q] * 0.5;
+                Pl[q] = pc[q] - gc[q] * 0.5;
+            }
+            auto Fh = godunov_flux_i(Pr, Pl);
+
+            for (int q = 0; q < 5; ++q)
+            {
+                Fh[q] = Fh[q] * da;
+            }
+            store(Fk, j, Fh);
+        }
+
+        lap(profiler::riemann);
+
+        if (k == n0)
+        {
+            continue;
+        }
+
+        const int n = k - 1;
+        const double* P = Pb;
+        const double* Fm = flux_row(k - 1);
+        const auto& A = U0.array(n + 2);
+        const int i = U0.row(n + 2);
+        const bool jl = U0.columns[0];
+        const bool jr = U0.columns[1];
+
+        // j-fluxes: next to the polar axis, the slope is zero in the edge
+        // cell and the flux through the axis face vanishes. At an edge with a
+        // j-neighbor, the guard columns give the slopes of the cells on
+        // either side of the edge, and the flux through it.
+        // --------------------------------------------------------------------
+        load_guard_columns(n, prim_row(k + 1));
+        lap(profiler::cons_to_prim);
+
+        for (int j = jl ? -1 : 1; j < (jr ? mj + 1 : mj - 1); j += W)
+        {
+            store(Gj_row, j, slope(load(P, j - 1), load(P, j), load(P, j + 1)));
+        }
+
+        for (int q = 0; q < 5; ++q)
+        {
+            if (! jl) Gj_row[q * mp + 0]      = 0.0;
+            if (! jr) Gj_row[q * mp + mj - 1] = 0.0;
+        }
+
+        lap(profiler::reconstruct);
+
+        for (int j = jl ? 0 : 1; j < (jr ? mj + 1 : mj); ++j)
+        {
+            A_row[j] = G.face_areas_j(n, j, 0);
+        }
+
+        for (int j = jl ? 0 : 1; j < (jr ? mj + 1 : mj); j += W)
+        {
+            const auto pl = load(P, j - 1);
+            const auto pr = load(P, j + 0);
+            const auto gl = load(Gj_row, j - 1);
+            const auto gr = load(Gj_row, j + 0);
+            const auto da = vdouble::load(&A_row[j]);
+            auto Pr = VarsBatch();
+            auto Pl = VarsBatch();
+
+            for (int q = 0; q < 5; ++q)
+            {
+                Pr[q] = pl[q] + gl[q] * 0.5;
+                Pl[q] = pr[q] - gr[q] * 0.5;
+            }
+            auto Fh = godunov_flux_j(Pr, Pl);
+
+            for (int q = 0; q < 5; ++q)
+            {
+                Fh[q] = Fh[q] * da;
+            }
+            store(Fj_row, j, Fh);
+        }
+
+        for (int q = 0; q < 5; ++q)
+        {
+            if (! jl) Fj_row[q * mp + 0]  = 0.0;
+            if (! jr) Fj_row[q * mp + mj] = 0.0;
+        }
+
+        lap(profiler::riemann);
+
+        // Source terms and the update
+        // --------------------------------------------------------------------
+        for (int j = 0; j < mj; ++j)
+        {
+            const auto Pj = Vars{P[0 * mp + j], P[1 * mp + j], P[2 * mp + j], P[3 * mp + j], P[4 * mp + j]};
+            const auto S = evaluate_src.evaluate(Pj, G.sources[n * mj + j]);
+            const double dv = G.volumes(n, j, 0);
+
+            for (int q = 0; q < 5; ++q)
+            {
+                const double df = (Fk[q * mp + j] - Fm[q * mp + j]) + (Fj_row[q * mp + j + 1] - Fj_row[q * mp + j]);
+                U1(n, j, q) = A(i, j, q) + dt * (S[q] - df / dv);
+            }
+            max_rate = std::max(max_rate, signal_rate<Validity>(Pj, G.inverse_widths[n * mj + j]));
+        }
+        lap(profiler::sources);
+    }
+    return max_rate;
+}
+
+
+
+
+// ============================================================================
+/**
+ * Adapts advance_2d to the PatchUpdate signature. The ufunc pipeline is the
+ * reference implementation, and still allocates its intermediate arrays. It
+ * only updates whole patches, so it needs assembled guard zones and n0 = 0,
+ * n1 = ni. The signal rate takes a separate pass over U0.
+ */
+template <typename Validity>
+double advance_2d_ufunc(
+    hydro::source_terms source_terms,
+    const GuardedRows& rows,
+    const MeshGeometry& G, double dt,
+    KernelScratch& scratch,
+    nd::array<double, 3>& U1,
+    int n0, int n1)
+{
+    const auto cons_to_prim = hydro::basic_cons_to_prim<Validity>();
+    const auto U0 = rows.assemble();
+    const int ni = rows.ni;
+    const int nj = rows.cols();
+    auto max_rate = 0.0;
+
+    if (n0 != 0 || n1 != ni)
+    {
+        throw std::invalid_argument("the ufunc kernel only updates whole patches");
+    }
+    if (rows.columns[0] || rows.columns[1])
+    {
+        throw std::invalid_argument("the ufunc kernel does not support j-neighbors");
+    }
+    U1 = advance_2d<Validity>(source_terms, U0, G, dt, scratch.phases);
+    auto lap = profiler::Lap(scratch.phases);
+
+    for (int i = 0; i < ni; ++i)
+    {
+        for (int j = 0; j < nj; ++j)
+        {
+            const auto P = cons_to_prim({U0(i + 2, j, 0), U0(i + 2, j, 1), U0(i + 2, j, 2), U0(i + 2, j, 3), U0(i + 2, j, 4)});
+            max_rate = std::max(max_rate, signal_rate<Validity>(P, G.inverse_widths[i * nj + j]));
+        }
+    }
+    lap(profiler::sources);
+    return max_rate;
+}
+
+template <typename Validity>
+PatchUpdate patch_update_kernel(std::string kernel)
+{
+    if (kernel == "ufunc") return advance_2d_ufunc<Validity>;
+    if (kernel == "fused") return advance_2d_fused<Validity>;
+    if (kernel == "simd")  return advance_2d_simd<Validity>;
+    throw std::invalid_argument("unknown kernel " + kernel);
+}
+
+PatchUpdate patch_update_kernel(std::string kernel, std::string checks)
+{
+    if (checks == "cell") return patch_update_kernel<hydro::checked>(kernel);
+    if (checks == "step") return patch_update_kernel<hydro::unchecked>(kernel);
+    throw std::invalid_argument("unknown checks mode " + checks);
+}
+
+
+
+
+// ============================================================================
+struct atmosphere
+{
+    inline std::array<double, 5> operator()(std::array<double, 2> X) const
+    {
+        const double r = X[0];
+        const double a = 1.5;                 // density index, alpha
+        const double vf = std::sqrt(1.0 / r); // free-fall velocity (GM = 1)
+        const double cs = vf / std::sqrt(a);  // sound speed via Virial condition
+        const double dg = std::pow(r, -a);    // power-law everywhere (infinite Virial radius)
+        const double pg = dg * cs * cs / (5. / 3);
+        return {dg, 0, 0, 0, pg};
+    }
+};
+
+
+
+
+// ============================================================================
+/**
+ * The Philox4x32-10 counter-based generator (Salmon et al. 2011): returns four
+ * random words that are a function of the counter and key alone, so any
+ * number in a stream can be drawn without generating those before it.
+ */
+static std::array<std::uint32_t, 4> philox4x32(std::array<std::uint32_t, 4> c, std::array<std::uint32_t, 2> k)
+{
+    for (int round = 0; round < 10; ++round)
+    {
+        const auto p0 = std::uint64_t(0xD2511F53) * c[0];
+        const auto p1 = std::uint64_t(0xCD9E8D57) * c[2];
+        c = {
+            std::uint32_t(p1 >> 32) ^ c[1] ^ k[0],
+            std::uint32_t(p1),
+            std::uint32_t(p0 >> 32) ^ c[3] ^ k[1],
+            std::uint32_t(p0)};
+        k[0] += 0x9E3779B9;
+        k[1] += 0xBB67AE85;
+    }
+    return c;
+}
+
+/**
+ * Add noise uniform in [0, noise) to the density of the primitive array P,
+ * whose zone (0, 0) is zone (i0, j0) of a mesh nj zones wide. The noise of a
+ * zone is drawn from the stream at the zone's index in that mesh, so it is
+ * the same however the mesh is divided among blocks, threads, and ranks.
+ */
+static void add_density_noise(nd::array<double, 3>& P, double noise, int i0, int j0, int nj)
+{
+    for (int i = 0; i < P.shape(0); ++i)
+    {
+        for (int j = 0; j < P.shape(1); ++j)
+        {
+            const auto n = std::uint64_t(i0 + i) * nj + (j0 + j);
+            const auto r = philox4x32({std::uint32_t(n), std::uint32_t(n >> 32), 0, 0}, {0, 0});
+            const auto u = double(((std::uint64_t(r[0]) << 32) | r[1]) >> 11) / 9007199254740992.0;
+            P(i, j, 0) += noise * u;
+        }
+    }
+}
+
+
+
+
+// ============================================================================
+/**
+ * The physical boundary conditions, the only place they are defined: the
+ * update fills the guard strips of the patches on the inner and outer radial
+ * boundaries through it (see fill_guard_strip). The database has no boundary
+ * value installed, since nothing fetches guard zones from it. The polar axis
+ * is treated by the kernels themselves.
+ */
+struct boundary_value
+{
+    /**
+     * Write the two guard rows of the given radial edge (il or ir) of the
+     * patch into rows i0 and i0 + 1 of U.
+     */
+    void operator()(PatchBoundary edge, const nd::array<double, 3>& patch, nd::array<double, 3>& U, int i0) const
+    {
+        switch (edge)
+        {
+            case PatchBoundary::il: reflecting_inner(patch, U, i0); return;
+            case PatchBoundary::ir: zero_gradient_outer(patch, U, i0); return;
+            default: throw std::invalid_argument("boundary_value: only the radial edges have guard rows");
+        }
+    }
+
+    /**
+     * Write the outer guard zones into rows i0 and i0 + 1 of U, which
+     * already exists.
+     */
+    void zero_gradient_outer(const nd::array<double, 3>& patch, nd::array<double, 3>& U, int i0) const
+    {
+        const int i = patch.shape(0) - 1;
+
+        for (int j = 0; j < patch.shape(1); ++j)
+        {
+            for (int q = 0; q < 5; ++q)
+            {
+                U(i0 + 0, j, q) = patch(i, j, q);
+                U(i0 + 1, j, q) = patch(i, j, q);
+            }
+        }
+    }
+
+    /**
+     * Write the unperturbed atmosphere at r = 1 into rows i0 and i0 + 1 of
+     * U, an alternative to reflecting_inner.
+     */
+    void fixed_inner(const nd::array<double, 3>& patch, nd::array<double, 3>& U, int i0) const
+    {
+        const auto P = hydro::prim_to_cons()(atmosphere()({1.0, 0.0}));
+
+        for (int j = 0; j < patch.shape(1); ++j)
+        {
+            for (int q = 0; q < 5; ++q)
+            {
+                U(i0 + 0, j, q) = P[q];
+                U(i0 + 1, j, q) = P[q];
+            }
+        }
+    }
+
+    /**
+     * Write the inner guard zones into rows i0 and i0 + 1 of U, which
+     * already exists.
+     */
+    void reflecting_inner(const nd::array<double, 3>& patch, nd::array<double, 3>& U, int i0) const
+    {
+        for (int j = 0; j < patch.shape(1); ++j)
+        {
+            for (int q = 0; q < 5; ++q)
+            {
+                const double sign = q == 1 ? -1.0 : 1.0;
+                U(i0 + 0, j, q) = patch(1, j, q) * sign;
+                U(i0 + 1, j, q) = patch(0, j, q) * sign;
+            }
+        }
+    }
+};
+
+
+
+
+// ============================================================================
+nd::array<double, 3> first_touch_copy(const nd::array<double, 3>& A)
+{
+    auto B = nd::array<double, 3>(A.shape(0), A.shape(1), A.shape(2));
+
+    for (int i = 0; i < A.shape(0); ++i)
+    {
+        for (int j = 0; j < A.shape(1); ++j)
+        {
+            for (int k = 0; k < A.shape(2); ++k)
+            {
+                B(i, j, k) = A(i, j, k);
+            }
+        }
+    }
+    return B;
+}
+
+/**
+ * Return a copy of columns [j0, j1) of A.
+ */
+nd::array<double, 3> copy_columns(const nd::array<double, 3>& A, int j0, int j1)
+{
+    auto B = nd::array<double, 3>(A.shape(0), j1 - j0, A.shape(2));
+
+    for (int i = 0; i < A.shape(0); ++i)
+    {
+        for (int j = j0; j < j1; ++j)
+        {
+            for (int k = 0; k < A.shape(2); ++k)
+            {
+                B(i, j - j0, k) = A(i, j, k);
+            }
+        }
+    }
+    return B;
+}
+
+
+
+
+// ============================================================================
+std::vector<int> balanced_splits(const std::vector<double>& costs, int parts)
+{
+    const int count = costs.size();
+    const bool nonempty = count >= parts;
+    auto prefix = std::vector<double>(count + 1, 0.0);
+    auto splits = std::vector<int>(parts + 1, count);
+
+    for (int n = 0; n < count; ++n)
+    {
+        prefix[n + 1] = prefix[n] + std::max(costs[n], 0.0);
+    }
+    splits[0] = 0;
+
+    for (int r = 1; r < parts; ++r)
+    {
+        if (prefix[count] <= 0.0)
+        {
+            splits[r] = int(long(count) * r / parts);
+            continue;
+        }
+        const double target = prefix[count] * r / parts;
+        int k = splits[r - 1];
+
+        while (k < count && prefix[k + 1] <= target)
+        {
+            ++k;
+        }
+        if (k < count && target - prefix[k] > prefix[k + 1] - target)
+        {
+            ++k;
+        }
+        k = std::max(k, splits[r - 1] + nonempty);
+        k = std::min(k, count - (nonempty ? parts - r : 0));
+        splits[r] = k;
+    }
+    return splits;
+}
+
+
+
+
+// ============================================================================
+UpdateWorkspace::UpdateWorkspace(
+    const Database& database,
+    ThreadPool& pool,
+    hydro::source_terms source_terms,
+    const BlockPartition& partition,
+    bool split,
+    int rk)
+: scratch(std::max(pool.size(), std::size_t(1)))
+, partition(partition)
+, split(split)
+{
+    auto lookup = std::map<Database::Index, int>();
+
+    for (const auto& patch : database)
+    {
+        if (std::get<3>(patch.first) == Field::conserved)
+        {
+            lookup[patch.first] = indexes.size();
+            indexes.push_back(patch.first);
+        }
+    }
+
+    for (const auto& index : indexes)
+    {
+        auto other = [&] (int di, int dj)
+        {
+            auto result = index;
+            std::get<0>(result) += di;
+            std::get<1>(result) += dj;
+            return result;
+        };
+        auto neighbor = [&] (int di, int dj)
+        {
+            return lookup.count(other(di, dj)) ? lookup.at(other(di, dj)) : -1;
+        };
+        auto owner = [&] (int di)
+        {
+            return lookup.count(other(di, 0)) ? -1 : partition.owner(std::get<0>(other(di, 0)));
+        };
+        neighbors.push_back({neighbor(-1, 0), neighbor(1, 0), neighbor(0, -1), neighbor(0, 1)});
+        remote.push_back({owner(-1), owner(1)});
+    }
+
+    remaining = std::vector<std::atomic<int>>(indexes.size());
+    guarded.resize(indexes.size());
+    strips.resize(indexes.size());
+    columns.resize(indexes.size());
+    results[0].resize(indexes.size());
+    results[1].resize(indexes.size());
+    initial.resize(indexes.size());
+    sources.resize(indexes.size());
+    inverse_widths.resize(indexes.size());
+    rates.resize(2 * indexes.size());
+    send_buffers.resize(indexes.size());
+    recv_buffers.resize(indexes.size());
+    send_requests.resize(indexes.size());
+    recv_requests.resize(indexes.size());
+    item_seconds.assign(2 * indexes.size(), 0.0);
+    stages.assign(indexes.size(), 0);
+    costs = partition.costs;
+    set_worker_splits(partition.worker_splits(scratch.size()));
+
+    for_each_patch(pool, indexes.size(), [&] (int n)
+    {
+        const auto& U = database.at(indexes[n], Field::conserved);
+        const auto& X = database.at(indexes[n], Field::cell_coords);
+        const auto& V = database.at(indexes[n], Field::vert_coords);
+        const int ni = U.shape(0);
+        const int nj = U.shape(1);
+
+        if (split)
+        {
+            strips[n][0] = nd::array<double, 3>(2, nj, 5);
+            strips[n][1] = nd::array<double, 3>(2, nj, 5);
+        }
+        else
+        {
+            guarded[n] = nd::array<double, 3>(ni + 4, nj, 5);
+        }
+        for (int side = 0; side < 2; ++side)
+        {
+            if (neighbors[n][side + 2] != -1)
+            {
+                columns[n][side] = nd::array<double, 3>(ni, 2, 5);
+            }
+            if (remote[n][side] != -1)
+            {
+                send_buffers[n][side].resize(2 * nj * 5);
+                recv_buffers[n][side].resize(2 * nj * 5);
+            }
+        }
+        results[0][n] = nd::array<double, 3>(ni, nj, 5);
+        results[1][n] = nd::array<double, 3>(ni, nj, 5);
+
+        if (rk > 1)
+        {
+            initial[n] = nd::array<double, 3>(ni, nj, 5);
+        }
+        sources[n].reserve(ni * nj);
+        inverse_widths[n].reserve(ni * nj);
+
+        for (int i = 0; i < ni; ++i)
+        {
+            for (int j = 0; j < nj; ++j)
+            {
+                const double dr = V(i + 1, j, 0) - V(i, j, 0);
+                const double dq = V(i, j + 1, 1) - V(i, j, 1);
+                sources[n].push_back(source_terms.coefficients({X(i, j, 0), X(i, j, 1)}));
+                inverse_widths[n].push_back({1.0 / dr, 1.0 / (X(i, j, 0) * dq)});
+            }
+        }
+    }, patch_splits);
+}
+
+/**
+ * Return true if the patches of radial block i are updated by the current
+ * pass: every block if the workspace is not subcycling, and otherwise those
+ * at the pass level.
+ */
+bool block_active(const UpdateWorkspace& workspace, int i)
+{
+    return workspace.pass_level == -1 || workspace.block_levels[i] == workspace.pass_level;
+}
+
+bool patch_active(const UpdateWorkspace& workspace, int n)
+{
+    return block_active(workspace, std::get<0>(workspace.indexes[n]));
+}
+
+/**
+ * Return the weight of the state of patch n in the guard rows it gives the
+ * patches of the current pass, against its state at the start of its step:
+ * 1, unless n is on a coarser level, whose step is then ahead of the pass,
+ * so that its rows are interpolated to the time of the stage being run.
+ */
+double guard_time_weight(const UpdateWorkspace& workspace, int n)
+{
+    if (workspace.pass_level == -1)
+    {
+        return 1.0;
+    }
+    const int level = workspace.block_levels[std::get<0>(workspace.indexes[n])];
+
+    if (level <= workspace.pass_level)
+    {
+        return 1.0;
+    }
+    return (workspace.stage_time - workspace.level_starts[level]) / (1 << level);
+}
+
+/**
+ * Post the exchange of guard rows with the neighbors on other ranks, for the
+ * stage about to start. Each off-rank side of a patch sends its two edge rows
+ * and receives the neighbor's. Messages are tagged with the receiving block
+ * and side (see BlockPartition::tag), so each one lands in the right buffer
+ * in whatever order they arrive. When subcycling, only the patches of the
+ * pass receive, and only the neighbors of those send.
+ */
+void post_guard_exchange(const Database& database, UpdateWorkspace& workspace)
+{
+    for (std::size_t n = 0; n < workspace.indexes.size(); ++n)
+    {
+        for (int side = 0; side < 2; ++side)
+        {
+            const int rank = workspace.remote[n][side];
+
+            if (rank == -1)
+            {
+                continue;
+            }
+            const auto& U = database.at(workspace.indexes[n], Field::conserved);
+            const auto& U0 = workspace.initial[n];
+            const int nj = U.shape(1);
+            const int i0 = side == 0 ? 0 : U.shape(0) - 2;
+            const int bi = std::get<0>(workspace.indexes[n]);
+            const int bj = std::get<1>(workspace.indexes[n]);
+            const int other = bi + (side == 0 ? -1 : 1);
+            const double w = guard_time_weight(workspace, n);
+            const auto& partition = workspace.partition;
+            auto& buffer = workspace.send_buffers[n][side];
+
+            if (patch_active(workspace, n))
+            {
+                workspace.recv_requests[n][side] = partition.comm.irecv(workspace.recv_buffers[n][side], rank, partition.tag(bi, bj, side));
+            }
+            if (! block_active(workspace, other))
+            {
+                continue;
+            }
+
+            for (int i = 0; i < 2; ++i)
+            {
+                for (int j = 0; j < nj; ++j)
+                {
+                    for (int q = 0; q < 5; ++q)
+                    {
+                        buffer[(i * nj + j) * 5 + q] = w == 1.0 ? U(i0 + i, j, q) : (1 - w) * U0(i0 + i, j, q) + w * U(i0 + i, j, q);
+                    }
+                }
+            }
+            workspace.send_requests[n][side] = partition.comm.isend(buffer, rank, partition.tag(other, bj, 1 - side));
+        }
+    }
+}
+
+/**
+ * Wait for the sends posted by post_guard_exchange, so that their buffers
+ * may be refilled by the next stage. The receives are completed by the guard
+ * fill of each patch.
+ */
+void complete_guard_exchange(UpdateWorkspace& workspace)
+{
+    for (auto& requests : workspace.send_requests)
+    {
+        for (auto& request : requests)
+        {
+            request.wait();
+        }
+    }
+}
+
+/**
+ * Write guard strip side (0 for il, 1 for ir) of patch n into rows i0 and
+ * i0 + 1 of V: from the neighbor patch if it is on this rank, from the
+ * received message if it is on another, and otherwise from the physical
+ * boundary condition.
+ */
+void fill_guard_strip(const Database& database, UpdateWorkspace& workspace, int n, int side, nd::array<double, 3>& V, int i0)
+{
+    const auto& U = database.at(workspace.indexes[n], Field::conserved);
+    const int m = workspace.neighbors[n][side];
+    const int nj = U.shape(1);
+
+    if (m != -1)
+    {
+        const auto& A = database.at(workspace.indexes[m], Field::conserved);
+        const auto& A0 = workspace.initial[m];
+        const int a0 = side == 0 ? A.shape(0) - 2 : 0;
+        const double w = guard_time_weight(workspace, m);
+
+        for (int i = 0; i < 2; ++i)
+        {
+            for (int j = 0; j < nj; ++j)
+            {
+                for (int q = 0; q < 5; ++q)
+                {
+                    V(i0 + i, j, q) = w == 1.0 ? A(a0 + i, j, q) : (1 - w) * A0(a0 + i, j, q) + w * A(a0 + i, j, q);
+                }
+            }
+        }
+    }
+    else if (workspace.remote[n][side] != -1)
+    {
+        const auto& buffer = workspace.recv_buffers[n][side];
+        workspace.recv_requests[n][side].wait();
+
+        for (int i = 0; i < 2; ++i)
+        {
+            for (int j = 0; j < nj; ++j)
+            {
+                for (int q = 0; q < 5; ++q)
+                {
+                    V(i0 + i, j, q) = buffer[(i * nj + j) * 5 + q];
+                }
+            }
+        }
+    }
+    else
+    {
+        boundary_value()(side == 0 ? PatchBoundary::il : PatchBoundary::ir, U, V, i0);
+    }
+}
+
+/**
+ * Copy patch n of the workspace, with two guard zones on either side in the
+ * i-direction, into its guard-zone array, which it writes in place. The guard
+ * zones come from fill_guard_strip.
+ */
+void fetch_guarded(const Database& database, UpdateWorkspace& workspace, int n)
+{
+    const auto& U = database.at(workspace.indexes[n], Field::conserved);
+    const int ni = U.shape(0);
+    const int nj = U.shape(1);
+    auto& V = workspace.guarded[n];
+
+    for (int i = 0; i < ni; ++i)
+    {
+        for (int j = 0; j < nj; ++j)
+        {
+            for (int q = 0; q < 5; ++q)
+            {
+                V(i + 2, j, q) = U(i, j, q);
+            }
+        }
+    }
+    fill_guard_strip(database, workspace, n, 0, V, 0);
+    fill_guard_strip(database, workspace, n, 1, V, ni + 2);
+}
+
+/**
+ * Fill the two guard strips of patch n of the workspace, from its neighbors
+ * or from the physical boundary conditions. The patch itself is not copied.
+ */
+void fetch_guard_strips(const Database& database, UpdateWorkspace& workspace, int n)
+{
+    fill_guard_strip(database, workspace, n, 0, workspace.strips[n][0], 0);
+    fill_guard_strip(database, workspace, n, 1, workspace.strips[n][1], 0);
+}
+
+/**
+ * Copy rows [i0, i1) of the two columns of each j-neighbor of patch n that
+ * are next to the shared edge into the guard columns of the patch. Sides
+ * on the polar axis have no guard columns; the kernels treat them
+ * themselves.
+ */
+void fetch_guard_columns(const Database& database, UpdateWorkspace& workspace, int n, int i0, int i1)
+{
+    for (int side = 0; side < 2; ++side)
+    {
+        const int m = workspace.neighbors[n][side + 2];
+
+        if (m == -1)
+        {
+            continue;
+        }
+        const auto& A = database.at(workspace.indexes[m], Field::conserved);
+        const int a0 = side == 0 ? A.shape(1) - 2 : 0;
+        auto& V = workspace.columns[n][side];
+
+        for (int i = i0; i < i1; ++i)
+        {
+            for (int c = 0; c < 2; ++c)
+            {
+                for (int q = 0; q < 5; ++q)
+                {
+                    V(i, c, q) = A(i, a0 + c, q);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Return pointers to the guard columns of patch n, null on the axis sides.
+ */
+GuardedRows::Columns guard_columns(const UpdateWorkspace& workspace, int n)
+{
+    auto result = GuardedRows::Columns{nullptr, nullptr};
+
+    for (int side = 0; side < 2; ++side)
+    {
+        if (workspace.neighbors[n][side + 2] != -1)
+        {
+            result[side] = &workspace.columns[n][side];
+        }
+    }
+    return result;
+}
+
+
+
+
+// ============================================================================
+/**
+ * Copy rows [i0, i1) of A into B, which has the same shape.
+ */
+void copy_rows(const nd::array<double, 3>& A, nd::array<double, 3>& B, int i0, int i1)
+{
+    for (int i = i0; i < i1; ++i)
+    {
+        for (int j = 0; j < A.shape(1); ++j)
+        {
+            for (int k = 0; k < A.shape(2); ++k)
+            {
+                B(i, j, k) = A(i, j, k);
+            }
+        }
+    }
+}
+
+/**
+ * Round rows [i0, i1) of U to the nearest float32 values.
+ */
+void round_rows_to_float(nd::array<double, 3>& U, int i0, int i1)
+{
+    for (int i = i0; i < i1; ++i)
+    {
+        for (int j = 0; j < U.shape(1); ++j)
+        {
+            for (int k = 0; k < U.shape(2); ++k)
+            {
+                U(i, j, k) = double(float(U(i, j, k)));
+            }
+        }
+    }
+}
+
+/**
+ * Replace rows [i0, i1) of U by U - dt R.
+ */
+void subtract_rate_rows(nd::array<double, 3>& U, const nd::array<double, 3>& R, double dt, int i0, int i1)
+{
+    for (int i = i0; i < i1; ++i)
+    {
+        for (int j = 0; j < U.shape(1); ++j)
+        {
+            for (int k = 0; k < U.shape(2); ++k)
+            {
+                U(i, j, k) -= dt * R(i, j, k);
+            }
+        }
+    }
+}
+
+/**
+ * Replace rows [i0, i1) of U by a U0 + (1 - a) U.
+ */
+void blend_rows(nd::array<double, 3>& U, const nd::array<double, 3>& U0, double a, int i0, int i1)
+{
+    for (int i = i0; i < i1; ++i)
+    {
+        for (int j = 0; j < U.shape(1); ++j)
+        {
+            for (int k = 0; k < U.shape(2); ++k)
+            {
+                U(i, j, k) = a * U0(i, j, k) + (1 - a) * U(i, j, k);
+            }
+        }
+    }
+}
+
+
+
+
+// ============================================================================
+/**
+ * Return the offset in the flux registers of column 0 of the i-face of
+ * radial block b, on its lower side (sum 0, written by block b - 1) or its
+ * upper side (sum 1, written by block b).
+ */
+std::size_t register_offset(const UpdateWorkspace& workspace, int b, int sum)
+{
+    return std::size_t(2 * b + sum) * workspace.register_cols * 5;
+}
+
+/**
+ * Return the area-weighted Godunov flux through i-face k of the rows, in
+ * column j, as the patch kernels compute it.
+ */
+hydro::Vars face_flux_i(const GuardedRows& U0, const MeshGeometry& G, int k, int j)
+{
+    const auto cons_to_prim = hydro::basic_cons_to_prim<hydro::unchecked>();
+    const auto godunov_flux = hydro::basic_riemann_hlle<hydro::unchecked>({1, 0, 0});
+    const auto gradient_est = gradient_plm(2.0);
+    auto P = std::array<hydro::Vars, 4>();
+
+    for (int r = 0; r < 4; ++r)
+    {
+        const auto& A = U0.array(k + r);
+        const int i = U0.row(k + r);
+        P[r] = cons_to_prim({A(i, j, 0), A(i, j, 1), A(i, j, 2), A(i, j, 3), A(i, j, 4)});
+    }
+    auto Pr = hydro::Vars();
+    auto Pl = hydro::Vars();
+
+    for (int q = 0; q < 5; ++q)
+    {
+        Pr[q] = P[1][q] + gradient_est(P[0][q], P[1][q], P[2][q]) * 0.5;
+        Pl[q] = P[2][q] - gradient_est(P[1][q], P[2][q], P[3][q]) * 0.5;
+    }
+    auto F = godunov_flux(Pr, Pl);
+
+    for (int q = 0; q < 5; ++q)
+    {
+        F[q] *= G.face_areas_i(k, j, 0);
+    }
+    return F;
+}
+
+/**
+ * Add dt times the fluxes through the edge faces of patch n that border
+ * another level, weighted by the stage's share of the step, to the flux
+ * registers, if rows [n0, n1) include the row next to the face.
+ */
+void add_register_fluxes(UpdateWorkspace& workspace, const GuardedRows& rows, const MeshGeometry& G, int n, int n0, int n1, double dt)
+{
+    const int bi = std::get<0>(workspace.indexes[n]);
+    const int bj = std::get<1>(workspace.indexes[n]);
+    const int nj = rows.cols();
+    const auto& levels = workspace.block_levels;
+
+    for (int side = 0; side < 2; ++side)
+    {
+        const int other = bi + (side == 0 ? -1 : 1);
+
+        if ((side == 0 ? n0 != 0 : n1 != rows.ni) || other < 0 || other >= int(levels.size()) || levels[other] == levels[bi])
+        {
+            continue;
+        }
+        const int k = side == 0 ? 0 : rows.ni;
+        auto R = &workspace.registers[register_offset(workspace, bi + side, 1 - side) + bj * nj * 5];
+
+        for (int j = 0; j < nj; ++j)
+        {
+            const auto F = face_flux_i(rows, G, k, j);
+
+            for (int q = 0; q < 5; ++q)
+            {
+                R[j * 5 + q] += workspace.register_weight * dt * F[q];
+            }
+        }
+    }
+}
+
+
+
+
+// ============================================================================
+/**
+ * Update all patches as one pipeline on the thread pool. Each patch's work
+ * item fetches its guard zones, runs the kernel, and then releases its
+ * dependents. A patch may be committed once its own result is ready and every
+ * neighbor that reads its cells as guard zones has finished fetching. The
+ * thread that releases the last such dependency performs the commit, so
+ * commits into (disjoint) patch storage run in parallel with other patches'
+ * fetches and kernels, and nothing is serialized on the calling thread.
+ *
+ * If the workspace is split, each patch has two work items instead. The
+ * interior item updates the rows that need no guard data, reading the patch
+ * in place. The boundary item fills the two guard strips, releases the
+ * neighbors, and then updates the two rows at either end. The interior items
+ * thus run while guard strips are being filled, and no item copies a whole
+ * patch.
+ *
+ * Every item also copies the guard columns of the rows it updates from the
+ * patch's j-neighbors, and then releases them, so a patch with j-neighbors
+ * is committed only once each of their items is past that point.
+ *
+ * Guard rows from neighbors on other ranks are sent and received as messages,
+ * posted here before the work items start. The item that fills a guard strip
+ * waits for its message, so the exchange overlaps the work on every other
+ * patch, and in split mode the interior rows of the same patch.
+ *
+ * The kernel calls of each work item are timed, and their wall time added to
+ * the workspace, to measure the cost of each patch. Guard fills are not
+ * counted, since they may include waiting on messages.
+ *
+ * The stage result is U = a U^n + (1 - a) (U + dt L(U)), where U on the
+ * right is the database state and U^n the workspace's copy of the state at
+ * the start of the step, so a is 0 for the first stage of any step. Each
+ * work item blends the rows it has just updated, in place, right after the
+ * kernel, and each commit is then a plain copy. If save_initial is true, the
+ * item also copies its rows of the input state to U^n, before the patch can
+ * be committed. With round_to_float32, the stage result is then rounded to
+ * float32. This emulates the rounding of a single-precision state, to test
+ * the solution's sensitivity to it. It costs a pass over the rows, since the
+ * storage and the kernels stay double.
+ *
+ * Results alternate between the two result arrays of each patch from one
+ * commit to the next, so a kernel never writes into an array the database
+ * may still be holding on to from the previous commit. The return value is
+ * the maximum signal rate of the stage's input state, reduced over the
+ * per-item values returned by the kernel.
+ *
+ * If the workspace is subcycling, only the patches at the pass level are
+ * updated, on the split of that level's items, and the others only give
+ * guard rows (see guard_time_weight). Those patches' fluxes through faces
+ * to other levels are added to the flux registers.
+ */
+double update_2d_threaded(
+    ThreadPool& pool,
+    PatchUpdate kernel,
+    hydro::source_terms source_terms,
+    Database& database,
+    UpdateWorkspace& workspace, double dt, double a, bool save_initial)
+{
+    auto& indexes = workspace.indexes;
+    auto& neighbors = workspace.neighbors;
+    auto& remaining = workspace.remaining;
+    auto& rates = workspace.rates;
+    const int items_per_patch = workspace.split ? 2 : 1;
+    const int num_items = items_per_patch * indexes.size();
+
+    auto result = [&] (int n) -> nd::array<double, 3>&
+    {
+        return workspace.results[workspace.stages[n] % 2][n];
+    };
+
+    auto fetches = [&] (int n, int side)
+    {
+        return neighbors[n][side] != -1 && patch_active(workspace, neighbors[n][side]);
+    };
+
+    // The guard zones of a patch come from its neighbors, so those are the
+    // patches that must finish fetching before the patch can be overwritten:
+    // one item of each i-neighbor, and every item of each j-neighbor, of
+    // those in the pass.
+    // ------------------------------------------------------------------------
+    for (std::size_t n = 0; n < indexes.size(); ++n)
+    {
+        remaining[n] = items_per_patch
+            + fetches(n, 0)
+            + fetches(n, 1)
+            + fetches(n, 2) * items_per_patch
+            + fetches(n, 3) * items_per_patch;
+    }
+    if (workspace.pass_level != -1)
+    {
+        std::fill(rates.begin(), rates.begin() + num_items, 0.0);
+    }
+    post_guard_exchange(database, workspace);
+
+    auto release = [&] (int n)
+    {
+        if (--remaining[n] == 0)
+        {
+            profiler::Scope scope(workspace.profiler, profiler::commit, n);
+            database.commit(indexes[n], result(n), 0.0);
+            workspace.stages[n] += 1;
+        }
+    };
+
+    auto release_neighbors = [&] (int n, int side0, int side1)
+    {
+        for (int side = side0; side < side1; ++side)
+        {
+            if (fetches(n, side))
+            {
+                release(neighbors[n][side]);
+            }
+        }
+    };
+
+    auto run_kernel = [&] (int item, const GuardedRows& rows, int n0, int n1)
+    {
+        const int n = item / items_per_patch;
+        auto G = MeshGeometry(
+            database.at(indexes[n], Field::cell_coords),
+            database.at(indexes[n], Field::cell_volume),
+            database.at(indexes[n], Field::face_area_i),
+            database.at(indexes[n], Field::face_area_j),
+            workspace.sources[n],
+            workspace.inverse_widths[n]);
+        auto& scratch = workspace.scratch[std::max(ThreadPool::current_worker(), 0)];
+        scratch.phases = workspace.profiler ? &workspace.profiler->times() : nullptr;
+
+        if (n0 == n1)
+        {
+            return 0.0;
+        }
+        const auto start = profiler::Clock::now();
+        auto rate = 0.0;
+        {
+            profiler::Count count(workspace.profiler, profiler::kernel_region);
+            rate = kernel(source_terms, rows, G, dt, scratch, result(n), n0, n1);
+        }
+
+        if (! workspace.registers.empty())
+        {
+            add_register_fluxes(workspace, rows, G, n, n0, n1, dt);
+        }
+        if (! workspace.equilibrium_rates.empty())
+        {
+            subtract_rate_rows(result(n), workspace.equilibrium_rates[n], dt, n0, n1);
+        }
+        if (save_initial)
+        {
+            copy_rows(database.at(indexes[n], Field::conserved), workspace.initial[n], n0, n1);
+        }
+        if (a != 0.0)
+        {
+            blend_rows(result(n), workspace.initial[n], a, n0, n1);
+        }
+        if (workspace.round_to_float32)
+        {
+            round_rows_to_float(result(n), n0, n1);
+        }
+        workspace.item_seconds[item] += std::chrono::duration<double>(profiler::Clock::now() - start).count();
+        return rate;
+    };
+
+    auto update_item = [&] (int item)
+    {
+        const int n = item / items_per_patch;
+
+        if (! workspace.split)
+        {
+            {
+                profiler::Scope scope(workspace.profiler, profiler::fetch, n);
+                fetch_guarded(database, workspace, n);
+                fetch_guard_columns(database, workspace, n, 0, workspace.guarded[n].shape(0) - 4);
+            }
+            release_neighbors(n, 0, 4);
+
+            const auto rows = GuardedRows::contiguous(workspace.guarded[n], guard_columns(workspace, n));
+            rates[item] = run_kernel(item, rows, 0, rows.ni);
+            release(n);
+            return;
+        }
+
+        // Rows [0, b0) and [b1, ni) read guard rows, and rows [b0, b1) don't.
+        // --------------------------------------------------------------------
+        const auto& U = database.at(indexes[n], Field::conserved);
+        const auto rows = GuardedRows::split(workspace.strips[n][0], U, workspace.strips[n][1], guard_columns(workspace, n));
+        const int ni = rows.ni;
+        const int b0 = std::min(2, ni);
+        const int b1 = std::max(b0, ni - 2);
+
+        if (item % 2 == 0)
+        {
+            {
+                profiler::Scope scope(workspace.profiler, profiler::fetch, n);
+                fetch_guard_strips(database, workspace, n);
+                fetch_guard_columns(database, workspace, n, 0, b0);
+                fetch_guard_columns(database, workspace, n, b1, ni);
+            }
+            release_neighbors(n, 0, 4);
+            rates[item] = std::max(run_kernel(item, rows, 0, b0), run_kernel(item, rows, b1, ni));
+        }
+        else
+        {
+            {
+                profiler::Scope scope(workspace.profiler, profiler::fetch, n);
+                fetch_guard_columns(database, workspace, n, b0, b1);
+            }
+            release_neighbors(n, 2, 4);
+            rates[item] = run_kernel(item, rows, b0, b1);
+        }
+        release(n);
+    };
+
+    if (workspace.pass_level == -1)
+    {
+        for_each_patch(pool, num_items, update_item, workspace.item_splits);
+    }
+    else
+    {
+        const auto& items = workspace.level_items[workspace.pass_level];
+
+        for_each_patch(pool, items.size(), [&] (int k)
+        {
+            update_item(items[k]);
+        }, workspace.level_splits[workspace.pass_level]);
+    }
+    complete_guard_exchange(workspace);
+
+    return *std::max_element(rates.begin(), rates.begin() + num_items);
+}
+
+/**
+ * Return the start-of-step weight a of each stage of the rk-stage scheme.
+ */
+std::vector<double> rk_weights(int rk)
+{
+    switch (rk)
+    {
+        case 1: return {0.0};
+        case 2: return {0.0, 1.0 / 2};
+        case 3: return {0.0, 3.0 / 4, 1.0 / 3};
+        default: throw std::invalid_argument("rk must be 1, 2, or 3");
+    }
+}
+
+double update(ThreadPool& pool,
+    PatchUpdate kernel,
+    hydro::source_terms source_terms,
+    Database& database,
+    UpdateWorkspace& workspace,
+    double dt, int rk)
+{
+    workspace.measured_steps += 1;
+
+    const auto weights = rk_weights(rk);
+    auto rate = 0.0;
+
+    for (std::size_t s = 0; s < weights.size(); ++s)
+    {
+        const auto save_initial = s == 0 && weights.size() > 1;
+        rate = std::max(rate, update_2d_threaded(pool, kernel, source_terms, database, workspace, dt, weights[s], save_initial));
+    }
+    return workspace.partition.comm.allreduce_max(rate);
+}
+
+/**
+ * Set the levels of the radial blocks from the signal rate of each patch (see
+ * assign_levels), with the work items of each level and their split over the
+ * workers, and clear the flux registers.
+ */
+void set_levels(UpdateWorkspace& workspace, const std::vector<double>& patch_rates)
+{
+    const auto& partition = workspace.partition;
+    const int items_per_patch = workspace.split ? 2 : 1;
+    auto block_rates = std::vector<double>(partition.num_blocks, 0.0);
+    auto& levels = workspace.block_levels;
+
+    // Each radial block is on a single rank, so the sum over the ranks is
+    // that rank's maximum over the polar blocks.
+    // ------------------------------------------------------------------------
+    for (std::size_t n = 0; n < workspace.indexes.size(); ++n)
+    {
+        auto& rate = block_rates[std::get<0>(workspace.indexes[n])];
+        rate = std::max(rate, patch_rates[n]);
+    }
+    partition.comm.allreduce_sum(block_rates);
+
+    const auto max_rate = *std::max_element(block_rates.begin(), block_rates.end());
+    levels.assign(partition.num_blocks, workspace.max_level);
+
+    for (int b = 0; b < partition.num_blocks; ++b)
+    {
+        if (block_rates[b] > 0.0)
+        {
+            levels[b] = std::min(workspace.max_level, int(std::floor(std::log2(max_rate / block_rates[b]))));
+        }
+    }
+    for (int b = 1; b < partition.num_blocks; ++b)
+    {
+        levels[b] = std::min(levels[b], levels[b - 1] + 1);
+    }
+    for (int b = partition.num_blocks - 2; b >= 0; --b)
+    {
+        levels[b] = std::min(levels[b], levels[b + 1] + 1);
+    }
+    const int num_levels = *std::max_element(levels.begin(), levels.end()) + 1;
+
+    workspace.level_items.assign(num_levels, {});
+    workspace.level_splits.assign(num_levels, {});
+    workspace.level_starts.assign(num_levels, 0);
+
+    for (int level = 0; level < num_levels; ++level)
+    {
+        auto& items = workspace.level_items[level];
+        auto costs = std::vector<double>();
+
+        for (std::size_t n = 0; n < workspace.indexes.size(); ++n)
+        {
+            if (levels[std::get<0>(workspace.indexes[n])] != level)
+            {
+                continue;
+            }
+            for (int k = 0; k < items_per_patch; ++k)
+            {
+                items.push_back(n * items_per_patch + k);
+                costs.push_back(workspace.costs.empty() ? 0.0 : workspace.costs[n] / items_per_patch);
+            }
+        }
+        workspace.level_splits[level] = balanced_splits(costs, workspace.scratch.size());
+    }
+    workspace.registers.assign(register_offset(workspace, partition.num_blocks + 1, 0), 0.0);
+}
+
+/**
+ * Correct the coarse cells next to each face between levels whose coarse
+ * side has just finished a step, at level-0 step s, so that their flux
+ * through the face is the sum on the fine side, and clear the face's
+ * registers. This is a collective over the partition's communicator.
+ */
+void apply_flux_corrections(Database& database, UpdateWorkspace& workspace, int s)
+{
+    const auto& levels = workspace.block_levels;
+    const int cols = workspace.register_cols * 5;
+    auto faces = std::vector<int>();
+    auto sums = std::vector<double>();
+
+    for (int b = 1; b < int(levels.size()); ++b)
+    {
+        if (levels[b - 1] != levels[b] && s % (1 << std::max(levels[b - 1], levels[b])) == 0)
+        {
+            const auto R = workspace.registers.begin() + register_offset(workspace, b, 0);
+            faces.push_back(b);
+            sums.insert(sums.end(), R, R + 2 * cols);
+        }
+    }
+    if (faces.empty())
+    {
+        return;
+    }
+    workspace.partition.comm.allreduce_sum(sums);
+
+    for (std::size_t f = 0; f < faces.size(); ++f)
+    {
+        const int b = faces[f];
+        const int coarse = levels[b] > levels[b - 1] ? b : b - 1;
+        const int side = coarse == b ? 0 : 1; // the side of the coarse block the face is on
+        const double* Rc = &sums[(2 * f + 1 - side) * cols];
+        const double* Rf = &sums[(2 * f + side) * cols];
+
+        for (std::size_t n = 0; n < workspace.indexes.size(); ++n)
+        {
+            const auto& index = workspace.indexes[n];
+
+            if (std::get<0>(index) != coarse)
+            {
+                continue;
+            }
+            const auto& U = database.at(index, Field::conserved);
+            const auto& V = database.at(index, Field::cell_volume);
+            const int ni = U.shape(0);
+            const int nj = U.shape(1);
+            const int i = side == 0 ? 0 : ni - 1;
+            const int J = std::get<1>(index) * nj;
+            const double sign = side == 0 ? 1.0 : -1.0;
+            auto& W = workspace.results[workspace.stages[n] % 2][n];
+
+            copy_rows(U, W, 0, ni);
+
+            for (int j = 0; j < nj; ++j)
+            {
+                for (int q = 0; q < 5; ++q)
+                {
+                    W(i, j, q) += sign * (Rf[(J + j) * 5 + q] - Rc[(J + j) * 5 + q]) / V(i, j, 0);
+                }
+            }
+            if (workspace.round_to_float32)
+            {
+                round_rows_to_float(W, i, i + 1);
+            }
+            database.commit(index, W, 0.0);
+            workspace.stages[n] += 1;
+        }
+        std::fill_n(workspace.registers.begin() + register_offset(workspace, b, 0), 2 * cols, 0.0);
+    }
+}
+
+void assign_levels(ThreadPool& pool, const Database& database, UpdateWorkspace& workspace, int max_level)
+{
+    max_signal_rate(pool, database, workspace);
+
+    for_each_patch(pool, workspace.indexes.size(), [&] (int n)
+    {
+        const auto& U = database.at(workspace.indexes[n], Field::conserved);
+        workspace.initial[n] = nd::array<double, 3>(U.shape(0), U.shape(1), 5);
+    }, workspace.patch_splits);
+
+    workspace.max_level = max_level;
+    workspace.register_cols = workspace.partition.num_blocks_j * workspace.results[0].front().shape(1);
+    set_levels(workspace, std::vector<double>(workspace.rates.begin(), workspace.rates.begin() + workspace.indexes.size()));
+}
+
+int subcycle_steps(const UpdateWorkspace& workspace)
+{
+    return workspace.level_items.empty() ? 1 : 1 << (workspace.level_items.size() - 1);
+}
+
+double update_subcycled(ThreadPool& pool,
+    PatchUpdate kernel,
+    hydro::source_terms source_terms,
+    Database& database,
+    UpdateWorkspace& workspace,
+    double dt, int rk)
+{
+    workspace.measured_steps += 1;
+
+    const auto weights = rk_weights(rk);
+    const int num_stages = weights.size();
+    const int num_levels = workspace.level_items.size();
+    const int num_steps = subcycle_steps(workspace);
+    const int items_per_patch = workspace.split ? 2 : 1;
+    auto times = std::vector<double>(num_stages, 0.0);
+    auto shares = std::vector<double>(num_stages, 1.0);
+    auto patch_rates = std::vector<double>(workspace.indexes.size(), 0.0);
+
+    // The input of stage s + 1 is at time (1 - a) (t + 1), in steps, where t
+    // is that of stage s and a its weight. The L(U) of stage s enters the
+    // step's result with the product of 1 - a over that and every later
+    // stage, which is its share of the fluxes through the step.
+    // ------------------------------------------------------------------------
+    for (int s = 0; s < num_stages; ++s)
+    {
+        if (s > 0)
+        {
+            times[s] = (1 - weights[s - 1]) * (times[s - 1] + 1);
+        }
+        for (int t = s; t < num_stages; ++t)
+        {
+            shares[s] *= 1 - weights[t];
+        }
+    }
+
+    for (int step = 0; step < num_steps; ++step)
+    {
+        if (step > 0)
+        {
+            apply_flux_corrections(database, workspace, step);
+        }
+        for (int level = num_levels - 1; level >= 0; --level)
+        {
+            if (step % (1 << level) != 0)
+            {
+                continue;
+            }
+            workspace.pass_level = level;
+            workspace.level_starts[level] = step;
+
+            for (int s = 0; s < num_stages; ++s)
+            {
+                workspace.stage_time = step + times[s] * (1 << level);
+                workspace.register_weight = shares[s];
+                update_2d_threaded(pool, kernel, source_terms, database, workspace, dt * (1 << level), weights[s], s == 0);
+
+                for (int item : workspace.level_items[level])
+                {
+                    auto& rate = patch_rates[item / items_per_patch];
+                    rate = std::max(rate, workspace.rates[item]);
+                }
+            }
+        }
+    }
+    apply_flux_corrections(database, workspace, num_steps);
+    workspace.pass_level = -1;
+
+    const auto rate = patch_rates.empty() ? 0.0 : *std::max_element(patch_rates.begin(), patch_rates.end());
+    set_levels(workspace, patch_rates);
+    return workspace.partition.comm.allreduce_max(rate);
+}
+
+void rebalance_workers(UpdateWorkspace& workspace)
+{
+    if (workspace.measured_steps == 0)
+    {
+        return;
+    }
+    const int items_per_patch = workspace.split ? 2 : 1;
+    workspace.costs.assign(workspace.indexes.size(), 0.0);
+
+    for (std::size_t item = 0; item < items_per_patch * workspace.indexes.size(); ++item)
+    {
+        workspace.costs[item / items_per_patch] += workspace.item_seconds[item] / workspace.measured_steps;
+    }
+    std::fill(workspace.item_seconds.begin(), workspace.item_seconds.end(), 0.0);
+    workspace.measured_steps = 0;
+    workspace.set_worker_splits(balanced_splits(workspace.costs, workspace.scratch.size()));
+}
+
+void set_equilibrium_rates(ThreadPool& pool, PatchUpdate kernel, Database& database, UpdateWorkspace& workspace)
+{
+    // The rate is that of one forward-Euler stage with dt = 1, computed on a
+    // workspace of its own, so that the costs and result parity of the given
+    // one are left alone. The equilibrium is rounded like the state it is
+    // subtracted from, so it stays steady with round_to_float32 too.
+    // ------------------------------------------------------------------------
+    auto equilibrium = UpdateWorkspace(database, pool, hydro::source_terms(0.0, 0.0), workspace.partition);
+    auto prim_to_cons = ufunc::vfrom(hydro::prim_to_cons());
+    auto initial_data = ufunc::vfrom(atmosphere());
+    auto saved = std::vector<Database::Array>(workspace.indexes.size());
+    workspace.equilibrium_rates.assign(workspace.indexes.size(), nd::array<double, 3>());
+
+    for_each_patch(pool, workspace.indexes.size(), [&] (int n)
+    {
+        const auto& index = workspace.indexes[n];
+        auto u = prim_to_cons(initial_data(database.at(index, Field::cell_coords)));
+
+        if (workspace.round_to_float32)
+        {
+            round_rows_to_float(u, 0, u.shape(0));
+        }
+        saved[n] = first_touch_copy(database.at(index, Field::conserved));
+        workspace.equilibrium_rates[n] = first_touch_copy(u);
+        database.commit(index, u, 0.0);
+    }, workspace.patch_splits);
+
+    update_2d_threaded(pool, kernel, hydro::source_terms(0.0, 0.0), database, equilibrium, 1.0, 0.0, false);
+
+    for_each_patch(pool, workspace.indexes.size(), [&] (int n)
+    {
+        const auto& index = workspace.indexes[n];
+        const auto& U = database.at(index, Field::conserved);
+        auto& R = workspace.equilibrium_rates[n];
+
+        for (int i = 0; i < R.shape(0); ++i)
+        {
+            for (int j = 0; j < R.shape(1); ++j)
+            {
+                for (int k = 0; k < R.shape(2); ++k)
+                {
+                    R(i, j, k) = U(i, j, k) - R(i, j, k);
+                }
+            }
+        }
+        database.commit(index, saved[n], 0.0);
+    }, workspace.patch_splits);
+}
+
+std::vector<double> gather_block_costs(const UpdateWorkspace& workspace)
+{
+    const auto& partition = workspace.partition;
+    const double measured = workspace.costs.empty() ? 0.0 : 1.0;
+    auto result = std::vector<double>(partition.num_blocks * partition.num_blocks_j, 0.0);
+
+    for (std::size_t n = 0; n < workspace.costs.size(); ++n)
+    {
+        const auto& index = workspace.indexes[n];
+        result[std::get<0>(index) * partition.num_blocks_j + std::get<1>(index)] = workspace.costs[n];
+    }
+    if (partition.comm.allreduce_sum(measured) < partition.size)
+    {
+        return {};
+    }
+    partition.comm.allreduce_sum(result);
+    return result;
+}
+
+double max_signal_rate(ThreadPool& pool, const Database& database, UpdateWorkspace& workspace)
+{
+    const auto cons_to_prim = hydro::cons_to_prim();
+
+    pool.parallel_for(0, workspace.indexes.size(), [&] (int n)
+    {
+        const auto& U = database.at(workspace.indexes[n], Field::conserved);
+        const int ni = U.shape(0);
+        const int nj = U.shape(1);
+        auto max_rate = 0.0;
+
+        for (int i = 0; i < ni; ++i)
+        {
+            for (int j = 0; j < nj; ++j)
+            {
+                const auto P = cons_to_prim({U(i, j, 0), U(i, j, 1), U(i, j, 2), U(i, j, 3), U(i, j, 4)});
+                max_rate = std::max(max_rate, signal_rate<hydro::checked>(P, workspace.inverse_widths[n][i * nj + j]));
+            }
+        }
+        workspace.rates[n] = max_rate;
+    });
+    return workspace.partition.comm.allreduce_max(*std::max_element(workspace.rates.begin(), workspace.rates.begin() + workspace.indexes.size()));
+}
+
+
+
+
+// ============================================================================
+/**
+ * Whole-database validity pass, which goes with the unchecked physics
+ * functors. The thread pool scans each patch for cells whose density or
+ * pressure is negative or NaN. Counts are reduced over patches and ranks, and
+ * only then, if any were found, is an exception raised on every rank, naming
+ * the total and the first offending cell of the rank.
+ */
+struct PositivityReport
+{
+    std::size_t num_invalid = 0;
+    Database::Index index;
+    int i = 0;
+    int j = 0;
+    double density  = 0.0;
+    double pressure = 0.0;
+};
+
+PositivityReport positivity_report(Database::Index index, const Database::Array& U)
+{
+    const double gm1 = 5. / 3 - 1.0;
+    const int ni = U.shape(0);
+    const int nj = U.shape(1);
+
+    auto density  = [&U] (int i, int j) { return U(i, j, 0); };
+    auto pressure = [&U, gm1] (int i, int j)
+    {
+        const double pp = U(i, j, 1) * U(i, j, 1) + U(i, j, 2) * U(i, j, 2) + U(i, j, 3) * U(i, j, 3);
+        return (U(i, j, 4) - 0.5 * pp / U(i, j, 0)) * gm1;
+    };
+
+    auto report = PositivityReport();
+    report.index = index;
+
+    for (int i = 0; i < ni; ++i)
+    {
+        std::size_t row_invalid = 0;
+
+        for (int j = 0; j < nj; ++j)
+        {
+            row_invalid += ! (density(i, j) >= 0.0) | ! (pressure(i, j) >= 0.0);
+        }
+
+        if (row_invalid && ! report.num_invalid)
+        {
+            for (int j = 0; j < nj; ++j)
+            {
+                if (! (density(i, j) >= 0.0) || ! (pressure(i, j) >= 0.0))
+                {
+                    report.i = i;
+                    report.j = j;
+                    report.density  = density(i, j);
+                    report.pressure = pressure(i, j);
+                    break;
+                }
+            }
+        }
+        report.num_invalid += row_invalid;
+    }
+    return report;
+}
+
+void check_positivity(ThreadPool& pool, const Database& database, const mpi::Communicator& comm)
+{
+    auto patches = std::vector<std::pair<Database::Index, const Database::Array*>>();
+
+    for (const auto& patch : database)
+    {
+        if (std::get<3>(patch.first) == Field::conserved)
+        {
+            patches.emplace_back(patch.first, &patch.second);
+        }
+    }
+
+    auto reports = std::vector<PositivityReport>(patches.size());
+
+    pool.parallel_for(0, patches.size(), [&] (int n)
+    {
+        reports[n] = positivity_report(patches[n].first, *patches[n].second);
+    });
+
+    auto first = PositivityReport();
+    auto total = std::size_t(0);
+
+    for (const auto& report : reports)
+    {
+        if (report.num_invalid && ! total)
+        {
+            first = report;
+        }
+        total += report.num_invalid;
+    }
+
+    const auto global_total = std::size_t(comm.allreduce_sum(double(total)));
+
+    if (global_total)
+    {
+        auto ss = std::stringstream();
+        ss << "positivity report: " << global_total << " cells with negative density or pressure";
+
+        if (total)
+        {
+            ss << "; first" << (comm.size() > 1 ? " on rank " + std::to_string(comm.rank()) : "") << " in patch "
+            << to_string(first.index) << " at (" << first.i << ", " << first.j << "): "
+            << "density = " << first.density << ", pressure = " << first.pressure;
+        }
+        throw std::runtime_error(ss.str());
+    }
+}
+
+
+
+
+// ============================================================================
+Database::Header create_header()
+{
+    return Database::Header
+    {
+        {Field::conserved,   {5, MeshLocation::cell}},
+        {Field::vert_coords, {2, MeshLocation::vert}},
+        {Field::cell_coords, {2, MeshLocation::cell}},
+        {Field::cell_volume, {1, MeshLocation::cell}},
+        {Field::face_area_i, {1, MeshLocation::face_i}},
+        {Field::face_area_j, {1, MeshLocation::face_j}},
+    };
+}
+
+Database create_database(run_config cfg, ThreadPool& pool, const BlockPartition& partition)
+{
+    auto target_radial_zone_count = cfg.nr * std::log10(cfg.outer_radius);
+    auto block_size = target_radial_zone_count / cfg.num_blocks;
+
+    auto ni = block_size;
+    auto nj = cfg.nr / cfg.num_blocks_j;
+    auto database = Database(ni, nj, create_header());
+    auto blocks = std::vector<std::array<int, 2>>();
+    std::mutex insert_mutex;
+
+    auto radial_block_vertices = [&] (int i)
+    {
+        double r0 = std::pow(cfg.outer_radius, double(i + 0) / cfg.num_blocks);
+        double r1 = std::pow(cfg.outer_radius, double(i + 1) / cfg.num_blocks);
+        return mesh_vertices(ni, cfg.nr, {r0, r1, 0, M_PI});
+    };
+
+    auto block_vertices = [&] (std::array<int, 2> block)
+    {
+        return copy_columns(radial_block_vertices(block[0]), block[1] * nj, (block[1] + 1) * nj + 1);
+    };
+
+    for (int i = partition.begin(); i < partition.end(); ++i)
+    {
+        for (int j = 0; j < cfg.num_blocks_j; ++j)
+        {
+            blocks.push_back({i, j});
+        }
+    }
+
+    if (! cfg.restart.empty())
+    {
+        auto found = load_patches_from_chkpt(pool, database, cfg.restart, [&] (Database::Index index)
+        {
+            return partition.owns(std::get<0>(index));
+        });
+        auto loaded = database.all(Field::conserved);
+
+        for (auto block : blocks)
+        {
+            auto patch = loaded.find(std::make_tuple(block[0], block[1], 0, Field::conserved));
+
+            if (patch == loaded.end())
+            {
+                throw std::runtime_error("checkpoint " + cfg.restart + " is missing block "
+                    + std::to_string(block[0]) + "-" + std::to_string(block[1]));
+            }
+            if (patch->second.shape(0) != int(ni) || patch->second.shape(1) != nj)
+            {
+                throw std::runtime_error("checkpoint " + cfg.restart + " does not match the mesh of its run config");
+            }
+        }
+        if (found != cfg.num_blocks * cfg.num_blocks_j)
+        {
+            throw std::runtime_error("checkpoint " + cfg.restart + " has " + std::to_string(found)
+                + " blocks, but its run config has " + std::to_string(cfg.num_blocks * cfg.num_blocks_j));
+        }
+    }
+
+    auto prim_to_cons = ufunc::vfrom(hydro::prim_to_cons());
+    auto initial_data = ufunc::vfrom(atmosphere());
+
+    // Each block's arrays are allocated and written (first-touched) by the
+    // worker that will own it during the update, until the workers are
+    // rebalanced. The geometry is not read from checkpoints, so it is
+    // rebuilt here on restart as well. The initial noise is counter-based
+    // (see add_density_noise), so the blocks are independent of one another.
+    for_each_patch(pool, blocks.size(), [&] (int n)
+    {
+        const int i = blocks[n][0];
+        const int j = blocks[n][1];
+        auto x_verts = block_vertices(blocks[n]);
+        auto x_cells = mesh_cell_centroids(x_verts);
+        auto v_cells = mesh_cell_volumes(x_verts);
+        auto a_faces_i = mesh_face_areas_i(x_verts);
+        auto a_faces_j = mesh_face_areas_j(x_verts);
+        auto u_cells = Database::Array();
+
+        if (cfg.restart.empty())
+        {
+            auto p_cells = initial_data(x_cells);
+            add_density_noise(p_cells, cfg.noise, i * int(ni), j * nj, cfg.nr);
+            u_cells = prim_to_cons(p_cells);
+
+            if (cfg.emulate_float32)
+            {
+                round_rows_to_float(u_cells, 0, u_cells.shape(0));
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(insert_mutex);
+        database.insert(std::make_tuple(i, j, 0, Field::vert_coords), x_verts);
+        database.insert(std::make_tuple(i, j, 0, Field::cell_coords), x_cells);
+        database.insert(std::make_tuple(i, j, 0, Field::cell_volume), v_cells);
+        database.insert(std::make_tuple(i, j, 0, Field::face_area_i), a_faces_i);
+        database.insert(std::make_tuple(i, j, 0, Field::face_area_j), a_faces_j);
+
+        if (cfg.restart.empty())
+        {
+            database.insert(std::make_tuple(i, j, 0, Field::conserved), u_cells);
+        }
+    }, partition.worker_splits(std::max(pool.size(), std::size_t(1))));
+
+    return database;
+}
+
+Solver create_solver(run_config cfg, ThreadPool& pool, const BlockPartition& partition)
+{
+    auto database = create_database(cfg, pool, partition);
+    auto source_terms = hydro::source_terms(cfg.heating_rate, cfg.cooling_rate);
+    auto kernel = patch_update_kernel(cfg.kernel, cfg.checks);
+    auto workspace = UpdateWorkspace(database, pool, source_terms, partition, cfg.exchange == "split", cfg.rk);
+
+    workspace.round_to_float32 = cfg.emulate_float32;
+
+    if (cfg.well_balanced)
+    {
+        set_equilibrium_rates(pool, kernel, database, workspace);
+    }
+    if (cfg.subcycle)
+    {
+        assign_levels(pool, database, workspace, cfg.subcycle);
+    }
+    return Solver{std::move(database), source_terms, kernel, std::move(workspace), cfg.rk, cfg.subcycle > 0};
+}
+
+double advance(ThreadPool& pool, Solver& solver, double dt)
+{
+    return solver.subcycle
+        ? update_subcycled(pool, solver.kernel, solver.source_terms, solver.database, solver.workspace, dt, solver.rk)
+        : update(pool, solver.kernel, solver.source_terms, solver.database, solver.workspace, dt, solver.rk);
+}
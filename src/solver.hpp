@@ -0,0 +1,610 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <string>
+#include <vector>
+#include "ndarray.hpp"
+#include "patches.hpp"
+#include "physics.hpp"
+#include "atmo.hpp"
+#include "comm.hpp"
+#include "profiler.hpp"
+#include "thread_pool.hpp"
+
+namespace hydro = newtonian_hydro;
+
+
+
+
+// ============================================================================
+struct MeshGeometry
+{
+    MeshGeometry(
+        const nd::array<double, 3>& A,
+        const nd::array<double, 3>& B,
+        const nd::array<double, 3>& C,
+        const nd::array<double, 3>& D,
+        const std::vector<hydro::SourceCoefficients>& E,
+        const std::vector<std::array<double, 2>>& F)
+    : centroids(A)
+    , volumes(B)
+    , face_areas_i(C)
+    , face_areas_j(D)
+    , sources(E)
+    , inverse_widths(F)
+    {
+    }
+
+    const nd::array<double, 3>& centroids;
+    const nd::array<double, 3>& volumes;
+    const nd::array<double, 3>& face_areas_i;
+    const nd::array<double, 3>& face_areas_j;
+    const std::vector<hydro::SourceCoefficients>& sources; // cell (i, j) at i * nj + j
+    const std::vector<std::array<double, 2>>& inverse_widths; // 1 / dr and 1 / (r dq), likewise
+};
+
+
+
+
+// ============================================================================
+/**
+ * Row buffers for the patch kernels. Each worker thread has its own, and they
+ * only ever grow, so once they fit the patch shape the kernels run without
+ * allocating. If phases is not null, the kernels add their per-phase wall
+ * time to it.
+ */
+struct KernelScratch
+{
+    /**
+     * Return the first n elements of the given buffer, zeroed, growing the
+     * buffer if it is too short.
+     */
+    template <typename T>
+    static T* zeros(std::vector<T>& buffer, std::size_t n)
+    {
+        if (buffer.size() < n)
+        {
+            buffer.resize(n);
+        }
+        std::fill(buffer.begin(), buffer.begin() + n, T());
+        return buffer.data();
+    }
+
+    std::vector<hydro::Vars> vars;
+    std::vector<double> reals;
+    profiler::PhaseCounters* phases = nullptr;
+};
+
+
+
+
+// ============================================================================
+/**
+ * The input rows of a patch kernel: a patch of ni rows with two guard rows on
+ * either side, so that row r is row r - 2 of the patch. The rows come in three
+ * segments, the lower guards [0, 2), the patch [2, ni + 2), and the upper
+ * guards [ni + 2, ni + 4), each of which may live in a different array. The
+ * patch rows can thus be read in place from the database, while only the
+ * guard strips are copied; a fetched array with the guards already in it is
+ * also described by putting it in all three segments.
+ *
+ * If the patch has j-neighbors, the two cells beyond either j-edge of each
+ * patch row are in guard columns of shape (ni, 2, 5), in order of increasing
+ * j. A side without guard columns lies on the polar axis.
+ */
+struct GuardedRows
+{
+    using Columns = std::array<const nd::array<double, 3>*, 2>;
+
+    /**
+     * Return the rows of U0, which has shape (ni + 4, nj, 5).
+     */
+    static GuardedRows contiguous(const nd::array<double, 3>& U0, Columns columns={nullptr, nullptr})
+    {
+        return {{&U0, &U0, &U0}, {0, 0, 0}, U0.shape(0) - 4, columns};
+    }
+
+    /**
+     * Return the rows of patch U, with guard strips L and R of shape (2, nj, 5).
+     */
+    static GuardedRows split(
+        const nd::array<double, 3>& L,
+        const nd::array<double, 3>& U,
+        const nd::array<double, 3>& R,
+        Columns columns={nullptr, nullptr})
+    {
+        return {{&L, &U, &R}, {0, 2, U.shape(0) + 2}, U.shape(0), columns};
+    }
+
+    int segment(int r) const
+    {
+        return (r >= 2) + (r >= ni + 2);
+    }
+
+    /** Return the array holding row r, and the index of row r in it. */
+    const nd::array<double, 3>& array(int r) const { return *segments[segment(r)]; }
+    int row(int r) const { return r - offsets[segment(r)]; }
+
+    int rows() const { return ni + 4; }
+    int cols() const { return segments[1]->shape(1); }
+
+    /**
+     * Return the rows as one array, copying them only if they are split.
+     */
+    nd::array<double, 3> assemble() const
+    {
+        if (segments[0] == segments[1] && segments[1] == segments[2])
+        {
+            return *segments[1];
+        }
+        auto U0 = nd::array<double, 3>(rows(), cols(), 5);
+
+        for (int r = 0; r < rows(); ++r)
+        {
+            const auto& A = array(r);
+            const int i = row(r);
+
+            for (int j = 0; j < cols(); ++j)
+            {
+                for (int q = 0; q < 5; ++q)
+                {
+                    U0(r, j, q) = A(i, j, q);
+                }
+            }
+        }
+        return U0;
+    }
+
+    std::array<const nd::array<double, 3>*, 3> segments;
+    std::array<int, 3> offsets;
+    int ni;
+    Columns columns; // lower and upper j guard columns, or null at the axis
+};
+
+
+
+
+// ============================================================================
+#define MIN3ABS(a, b, c) std::min(std::min(std::fabs(a), std::fabs(b)), std::fabs(c))
+#define SGN(x) std::copysign(1, x)
+
+inline double minmod(double ul, double u0, double ur, double theta)
+{
+    const double a = theta * (u0 - ul);
+    const double b =   0.5 * (ur - ul);
+    const double c = theta * (ur - u0);
+    return 0.25 * std::fabs(SGN(a) + SGN(b)) * (SGN(a) + SGN(c)) * MIN3ABS(a, b, c);
+}
+#undef MIN3ABS
+#undef SGN
+
+struct gradient_plm
+{
+    gradient_plm(double theta) : theta(theta) {}
+
+    double inline operator()(double a, double b, double c) const
+    {
+        return minmod(a, b, c, theta);
+    }
+    double theta;
+};
+
+
+
+
+// ============================================================================
+/**
+ * A patch kernel. It writes rows [n0, n1) of the updated patch into the last
+ * argument, and returns the maximum signal rate over those rows.
+ */
+using PatchUpdate = double (*)(
+    hydro::source_terms,
+    const GuardedRows&,
+    const MeshGeometry&, double,
+    KernelScratch&,
+    nd::array<double, 3>&,
+    int, int);
+
+
+
+
+// ============================================================================
+/**
+ * Call f(n) for each of count patches on the pool. If the workers are pinned,
+ * patch n always runs on its owner, so that it is updated by the same core
+ * (and NUMA node) that first touched its memory. Otherwise idle workers may
+ * steal patches from busy ones. Worker w owns the patches [splits[w],
+ * splits[w + 1]) if splits are given, and otherwise those of pool.owner.
+ */
+template <typename Function>
+void for_each_patch(ThreadPool& pool, int count, Function&& f, const std::vector<int>& splits={})
+{
+    if (! splits.empty() && splits.back() != count)
+    {
+        throw std::logic_error("for_each_patch: the splits do not cover the patches");
+    }
+    if (pool.pinned() && splits.empty())
+    {
+        pool.parallel_for_owned(0, count, std::forward<Function>(f));
+    }
+    else if (pool.pinned())
+    {
+        pool.parallel_for_owned(splits, std::forward<Function>(f));
+    }
+    else if (splits.empty())
+    {
+        pool.parallel_for(0, count, std::forward<Function>(f));
+    }
+    else
+    {
+        pool.parallel_for(splits, std::forward<Function>(f));
+    }
+}
+
+/**
+ * Return a deep copy of the given array, allocated and written by the calling
+ * thread.
+ */
+nd::array<double, 3> first_touch_copy(const nd::array<double, 3>& A);
+
+
+
+
+// ============================================================================
+/**
+ * Split a sequence of items with the given costs into parts contiguous
+ * ranges of roughly equal total cost, and return the parts + 1 boundaries.
+ * No range is empty unless there are fewer items than parts. If the costs
+ * are all zero, the ranges are of equal length instead.
+ */
+std::vector<int> balanced_splits(const std::vector<double>& costs, int parts);
+
+
+
+
+// ============================================================================
+/**
+ * The assignment of radial blocks to MPI ranks. Each rank owns a contiguous
+ * range of blocks. Without cost estimates, the ranges differ in length by at
+ * most one, so with a single rank that rank owns every block. Given the
+ * measured cost of every block (i, j), at i * num_blocks_j + j, the ranges
+ * are chosen to have roughly equal cost instead. A rank owns all the polar
+ * blocks of each of its radial blocks, so j-neighbors are always on the same
+ * rank.
+ */
+struct BlockPartition
+{
+    BlockPartition(int num_blocks, int num_blocks_j, mpi::Communicator comm, std::vector<double> block_costs={})
+    : comm(comm)
+    , num_blocks(num_blocks)
+    , num_blocks_j(num_blocks_j)
+    , rank(comm.rank())
+    , size(comm.size())
+    {
+        if (block_costs.size() != std::size_t(num_blocks * num_blocks_j))
+        {
+            block_costs.clear();
+        }
+        if (block_costs.empty())
+        {
+            for (int r = 0; r < size + 1; ++r)
+            {
+                firsts.push_back(int(long(num_blocks) * r / size));
+            }
+            return;
+        }
+        auto radial_costs = std::vector<double>(num_blocks, 0.0);
+
+        for (int n = 0; n < num_blocks * num_blocks_j; ++n)
+        {
+            radial_costs[n / num_blocks_j] += block_costs[n];
+        }
+        firsts = balanced_splits(radial_costs, size);
+        costs.assign(block_costs.begin() + begin() * num_blocks_j, block_costs.begin() + end() * num_blocks_j);
+    }
+
+    /** Return the first block of rank r; first(size) is num_blocks. */
+    int first(int r) const { return firsts[r]; }
+    int begin() const { return first(rank); }
+    int end() const { return first(rank + 1); }
+    bool owns(int block) const { return begin() <= block && block < end(); }
+
+    /**
+     * Return the rank that owns the given block, or -1 if there is no such
+     * block.
+     */
+    int owner(int block) const
+    {
+        for (int r = 0; r < size; ++r)
+        {
+            if (first(r) <= block && block < first(r + 1))
+            {
+                return r;
+            }
+        }
+        return -1;
+    }
+
+    /**
+     * Return the message tag of the given side (0 or 1) of block (i, j).
+     */
+    int tag(int i, int j, int side) const
+    {
+        return 2 * (i * num_blocks_j + j) + side;
+    }
+
+    /**
+     * Return the ranges of this rank's patches, in index order, that each of
+     * the given number of pool workers should own.
+     */
+    std::vector<int> worker_splits(int num_workers) const
+    {
+        if (costs.empty())
+        {
+            return balanced_splits(std::vector<double>((end() - begin()) * num_blocks_j, 0.0), num_workers);
+        }
+        return balanced_splits(costs, num_workers);
+    }
+
+    mpi::Communicator comm;
+    int num_blocks;
+    int num_blocks_j;
+    int rank;
+    int size;
+    std::vector<int> firsts;
+    std::vector<double> costs; // the costs of this rank's patches, if known
+};
+
+
+
+
+// ============================================================================
+/**
+ * Storage reused by every call to update_2d_threaded: the patch list and its
+ * neighbors, a guard-zone array per patch, two result arrays per patch, the
+ * source term coefficients and inverse widths of every cell, the signal rate
+ * of each patch, and the kernel scratch of each worker. For a multi-stage
+ * time step, there is also a copy of each patch's state at the start of the
+ * step, which the later stages are blended with. It is built once for
+ * a database whose set of patches and mesh do not change afterwards, so that
+ * in steady state the update allocates nothing outside of Database::commit.
+ * Per-patch storage is allocated by the worker that updates the patch.
+ *
+ * An i-neighbor that lives on another rank is not in neighbors; its owner is
+ * in remote instead, and the two guard rows are exchanged with it through the
+ * message buffers of that side of the patch. A patch with j-neighbors also
+ * has guard columns on those sides.
+ *
+ * The kernel time of each work item is accumulated, so that the patches can be
+ * redistributed over the pool workers by their measured cost (see
+ * rebalance_workers). Until then, the split of the patches is the one given
+ * by the block partition.
+ *
+ * If subcycling (see assign_levels), the workspace also holds the level of
+ * every radial block, the work items of each level and their split over the
+ * workers, and the flux registers of the faces between levels. A pass over
+ * the patches then updates only those at pass_level.
+ */
+struct UpdateWorkspace
+{
+    /**
+     * Constructor. If split is true, patches are updated with the interior
+     * and boundary rows as separate work items (see update_2d_threaded), and
+     * only guard strips are allocated, rather than whole guarded patches.
+     * The start-of-step copies are only allocated if rk is more than 1.
+     */
+    UpdateWorkspace(
+        const patches2d::Database& database,
+        ThreadPool& pool,
+        hydro::source_terms source_terms,
+        const BlockPartition& partition,
+        bool split=false,
+        int rk=1);
+
+    /**
+     * Give worker w the patches [splits[w], splits[w + 1]), and their work
+     * items.
+     */
+    void set_worker_splits(const std::vector<int>& splits)
+    {
+        patch_splits = splits;
+        item_splits = splits;
+
+        for (auto& s : item_splits)
+        {
+            s *= split ? 2 : 1;
+        }
+    }
+
+    std::vector<patches2d::Database::Index> indexes;
+    std::vector<std::array<int, 4>> neighbors;  // il, ir, jl, and jr neighbors, or -1
+    std::vector<std::array<int, 2>> remote;     // owner ranks of off-rank il and ir neighbors, or -1
+    std::vector<std::atomic<int>> remaining;
+    std::vector<nd::array<double, 3>> guarded;
+    std::vector<std::array<nd::array<double, 3>, 2>> strips; // il and ir guard strips (split mode)
+    std::vector<std::array<nd::array<double, 3>, 2>> columns; // jl and jr guard columns, if there are j-neighbors
+    std::vector<nd::array<double, 3>> results[2];
+    std::vector<nd::array<double, 3>> initial; // U^n of each patch, if rk > 1
+    std::vector<std::vector<hydro::SourceCoefficients>> sources;
+    std::vector<std::vector<std::array<double, 2>>> inverse_widths;
+    std::vector<nd::array<double, 3>> equilibrium_rates; // L(U_eq) of each patch, if well-balanced (see set_equilibrium_rates)
+    std::vector<double> rates;
+    std::vector<std::array<std::vector<double>, 2>> send_buffers;
+    std::vector<std::array<std::vector<double>, 2>> recv_buffers;
+    std::vector<std::array<mpi::Request, 2>> send_requests;
+    std::vector<std::array<mpi::Request, 2>> recv_requests;
+    std::vector<KernelScratch> scratch;
+    std::vector<double> item_seconds; // kernel wall time of each work item since the last rebalance
+    std::vector<double> costs;        // seconds per step of each patch, once measured
+    std::vector<int> patch_splits;
+    std::vector<int> item_splits;
+    std::vector<int> stages; // stages committed by each patch, whose parity picks its result array
+    std::vector<int> block_levels;              // level of every radial block, if subcycling
+    std::vector<std::vector<int>> level_items;  // work items of the patches at each level
+    std::vector<std::vector<int>> level_splits; // and their split over the pool workers
+    std::vector<int> level_starts;              // level-0 step at which each level's current step began
+    std::vector<double> registers;              // weighted fluxes through the faces between levels
+    int register_cols = 0;                      // polar zones of a radial block
+    int max_level = 0;
+    int pass_level = -1;                        // level being updated, or -1 for every patch
+    double stage_time = 0.0;                    // time of the stage being run, in level-0 steps
+    double register_weight = 0.0;               // weight of the stage's fluxes in the step
+    profiler::Profiler* profiler = nullptr;
+    bool round_to_float32 = false; // round every stage result to float32 (emulate_float32=1)
+    BlockPartition partition;
+    bool split;
+    int measured_steps = 0;
+};
+
+
+
+
+// ============================================================================
+/**
+ * Return the patch kernel named by kernel (ufunc, fused, or simd)
+ * with the validity checks named by checks (cell or step).
+ */
+PatchUpdate patch_update_kernel(std::string kernel, std::string checks);
+
+/**
+ * Advance the database by dt with the rk-stage SSP Runge-Kutta scheme (the
+ * forward Euler, Heun, or Shu-Osher third-order method), and return the
+ * maximum signal rate seen over all stages and all ranks. The rate is not
+ * known until the kernels have run, so the caller uses it to choose the next
+ * time step. Every stage after the first is blended with the start-of-step
+ * state kept in the workspace, so the schemes need no storage beyond one
+ * copy of the state, and the workspace must have been built for rk.
+ */
+double update(ThreadPool& pool,
+    PatchUpdate kernel,
+    hydro::source_terms source_terms,
+    patches2d::Database& database,
+    UpdateWorkspace& workspace,
+    double dt, int rk);
+
+/**
+ * Assign every radial block a subcycling level L of at most max_level, from
+ * the signal rates of the current state, and allocate what subcycling needs.
+ * A block at level L steps at 2^L times the level-0 step, which the fastest
+ * block limits, and adjacent blocks differ by at most one level. This is a
+ * collective over the partition's communicator.
+ */
+void assign_levels(ThreadPool& pool, const patches2d::Database& database, UpdateWorkspace& workspace, int max_level);
+
+/**
+ * Return the number of level-0 steps that update_subcycled advances by: 2^L
+ * for the highest level L in use, or 1 if the workspace is not subcycling.
+ */
+int subcycle_steps(const UpdateWorkspace& workspace);
+
+/**
+ * Like update, but with dt the step of level 0, and advancing the database
+ * by subcycle_steps of them. The levels are updated coarsest first, each by
+ * whole steps of the given RK scheme. A block reads the guard rows of a
+ * coarser neighbor, which is then ahead of it, interpolated linearly in time
+ * between the start and end of the neighbor's step, and those of a finer
+ * neighbor at the start of its own step. The fluxes through each face
+ * between levels are summed on both sides, and once both have reached the
+ * same time the coarse cells next to the face are corrected to the fine
+ * side's fluxes, so the scheme is conservative. On return, the levels are
+ * reassigned from the signal rates seen during the step.
+ */
+double update_subcycled(ThreadPool& pool,
+    PatchUpdate kernel,
+    hydro::source_terms source_terms,
+    patches2d::Database& database,
+    UpdateWorkspace& workspace,
+    double dt, int rk);
+
+/**
+ * Replace the patch costs of the workspace by those measured since the last
+ * call, as seconds per step, and split the patches over the pool workers so
+ * that each has about the same share of them. Nothing changes if no steps
+ * were measured. Only the split over the workers of this rank is changed;
+ * the blocks of each rank are repartitioned on restart, from the costs in
+ * the checkpoint (see gather_block_costs).
+ */
+void rebalance_workers(UpdateWorkspace& workspace);
+
+/**
+ * Make the update well-balanced: store in the workspace the rate L(U_eq)
+ * that the kernel computes for the noise-free atmosphere, with the heating
+ * and cooling left out, and subtract it from every stage from then on. The
+ * equilibrium is thus an exact steady state of the discrete scheme, rather
+ * than one up to the truncation error of the cancelling pressure and gravity
+ * terms, and only the perturbations about it evolve. The database state is
+ * unchanged. This is a collective over the partition's communicator.
+ */
+void set_equilibrium_rates(ThreadPool& pool, PatchUpdate kernel, patches2d::Database& database, UpdateWorkspace& workspace);
+
+/**
+ * Return the costs of every block (i, j) of every rank, at i * num_blocks_j
+ * + j, or an empty vector if they have not been measured. This is a
+ * collective over the partition's communicator.
+ */
+std::vector<double> gather_block_costs(const UpdateWorkspace& workspace);
+
+/**
+ * Return the maximum signal rate of the current state, over all ranks. This
+ * is the same reduction the kernels perform during the update, and is only
+ * needed to choose the very first time step.
+ */
+double max_signal_rate(ThreadPool& pool, const patches2d::Database& database, UpdateWorkspace& workspace);
+
+/**
+ * Throw on every rank if any cell of any rank has a negative or NaN density
+ * or pressure (see solver.cpp). This is a collective over comm.
+ */
+void check_positivity(ThreadPool& pool, const patches2d::Database& database, const mpi::Communicator& comm);
+
+
+
+
+// ============================================================================
+patches2d::Database::Header create_header();
+
+/**
+ * Create the database of the blocks owned by this rank, from the initial data
+ * or the restart checkpoint. Block (i, j) spans radial block i and polar
+ * block j, whose vertices are cut from the full radial block, so that the
+ * mesh does not depend on num_blocks_j. The blocks are built concurrently on
+ * the pool, and the initial noise of a zone depends only on its place in the
+ * mesh, not on num_blocks_j, the threads, or the ranks.
+ */
+patches2d::Database create_database(atmo::run_config cfg, ThreadPool& pool, const BlockPartition& partition);
+
+
+
+
+// ============================================================================
+/**
+ * What a run updates: the database of this rank's blocks, and the source
+ * terms, patch kernel, and workspace of its update, as configured by a run
+ * config (see create_solver). The run and the benchmark harness both build
+ * it with create_solver, so every option of the update applies to both.
+ */
+struct Solver
+{
+    patches2d::Database database;
+    hydro::source_terms source_terms;
+    PatchUpdate kernel;
+    UpdateWorkspace workspace;
+    int rk;
+    bool subcycle;
+};
+
+/**
+ * Create the solver of a run: the database (see create_database), then its
+ * workspace, with the emulate_float32, exchange, well_balanced, and
+ * subcycle options applied. This is a collective over the partition's
+ * communicator.
+ */
+Solver create_solver(atmo::run_config cfg, ThreadPool& pool, const BlockPartition& partition);
+
+/**
+ * Advance the solver by one update of the level-0 step dt, with
+ * update_subcycled if it is subcycling and with update otherwise, and return
+ * the maximum signal rate. The time advances by subcycle_steps of dt.
+ */
+double advance(ThreadPool& pool, Solver& solver, double dt);
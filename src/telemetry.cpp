@@ -0,0 +1,140 @@
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "json.hpp"
+#include "app_utils.hpp"
+#include "telemetry.hpp"
+using namespace telemetry;
+
+
+
+
+// ============================================================================
+/**
+ * Telemetry file format. The file outdir/telemetry.dat holds
+ *
+ *     char[8]    magic, "ATMOTELE"
+ *     uint64     length L of the JSON index
+ *     uint64     offset of the payload section
+ *     char[L]    JSON index
+ *     (padding)
+ *     uint64     number n of samples published so far
+ *     (padding to 64 bytes)
+ *     slots
+ *
+ * The index is {"capacity": C, "fields": [...], "dtype": "<f8",
+ * "slots_offset": 64, "slot_nbytes": S}, with the offset relative to the
+ * payload section. Sample m is in slot m % C, of S bytes, which holds
+ *
+ *     uint64     sequence, 2 m + 1 while the sample is written, 2 m + 2 after
+ *     float64[F] the value of each field
+ *
+ * The last min(n, C) samples are thus in the slots before (n - 1) % C,
+ * cyclically. A reader discards a slot it has copied unless the sequence is
+ * 2 m + 2 both before and after the copy. The integers in the fixed header
+ * are little-endian, and those in the payload in the host order, like the
+ * values.
+ */
+static const char telemetry_file_magic[8] = {'A', 'T', 'M', 'O', 'T', 'E', 'L', 'E'};
+static const std::size_t telemetry_file_alignment = 4096;
+static const std::size_t telemetry_line_size = 64;
+
+static std::atomic<std::uint64_t>* atomic_at(char* address)
+{
+    return reinterpret_cast<std::atomic<std::uint64_t>*>(address);
+}
+
+
+
+
+// ============================================================================
+Publisher::Publisher(std::string filename, std::vector<std::string> fields, std::size_t capacity)
+: num_fields(fields.size())
+, capacity(capacity)
+{
+    if (capacity == 0)
+    {
+        return;
+    }
+    slot_nbytes = binary_file::align_up(sizeof(std::uint64_t) + num_fields * sizeof(double), telemetry_line_size);
+
+    auto index = nlohmann::json{
+        {"capacity", capacity},
+        {"fields", fields},
+        {"dtype", binary_file::native_float_dtype(sizeof(double))},
+        {"slots_offset", telemetry_line_size},
+        {"slot_nbytes", slot_nbytes}};
+
+    filesystem::require_dir(filesystem::parent(filename));
+    const int fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0)
+    {
+        throw std::invalid_argument("file " + filename + " could not be opened for writing");
+    }
+
+    try {
+        payload = binary_file::write_file_header(fd, telemetry_file_magic, index.dump(), telemetry_file_alignment, filename);
+        size = payload + telemetry_line_size + capacity * slot_nbytes;
+
+        if (::ftruncate(fd, size) != 0)
+        {
+            throw std::runtime_error("ftruncate of " + filename + " failed: " + std::strerror(errno));
+        }
+    }
+    catch (...)
+    {
+        ::close(fd);
+        throw;
+    }
+
+    // The file is zero-filled, so every slot reads as not yet written. The
+    // mapping stays valid once the file is closed.
+    auto mapping = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    auto error = errno;
+    ::close(fd);
+
+    if (mapping == MAP_FAILED)
+    {
+        throw std::runtime_error("mmap of " + filename + " failed: " + std::strerror(error));
+    }
+    data = static_cast<char*>(mapping);
+
+    if (! atomic_at(data + payload)->is_lock_free())
+    {
+        throw std::runtime_error("telemetry needs lock-free 64-bit atomics");
+    }
+}
+
+Publisher::~Publisher()
+{
+    if (data)
+    {
+        ::munmap(data, size);
+    }
+}
+
+void Publisher::publish(const std::vector<double>& values)
+{
+    if (! data)
+    {
+        return;
+    }
+    if (values.size() != num_fields)
+    {
+        throw std::invalid_argument("telemetry::Publisher::publish: wrong number of values");
+    }
+    char* slot = data + payload + telemetry_line_size + (count % capacity) * slot_nbytes;
+    auto sequence = atomic_at(slot);
+
+    sequence->store(2 * count + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(slot + sizeof(std::uint64_t), values.data(), num_fields * sizeof(double));
+    sequence->store(2 * count + 2, std::memory_order_release);
+    atomic_at(data + payload)->store(count + 1, std::memory_order_release);
+    count += 1;
+}
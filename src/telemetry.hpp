@@ -0,0 +1,58 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+
+
+// ============================================================================
+namespace telemetry
+{
+    class Publisher;
+}
+
+
+
+
+// ============================================================================
+/**
+ * Publishes per-step metrics of a run in a memory-mapped file, which other
+ * processes can read while the run goes on (see telemetry.cpp for the
+ * layout). The file holds a ring of the last capacity samples. Publishing a
+ * sample is a few stores into the mapping: it never blocks or makes a system
+ * call, and the pages are written back by the kernel in its own time.
+ *
+ * Only one thread may publish, and it needs no lock. Each slot carries a
+ * sequence number that is odd while the slot is being written, so a reader
+ * that sees the same even number before and after copying a slot has a
+ * consistent sample, of a number that it can tell from the sequence.
+ */
+class telemetry::Publisher
+{
+public:
+    /**
+     * Constructor. Create or truncate the file, with a ring of capacity
+     * samples of the given fields. If capacity is zero, no file is created
+     * and publish does nothing.
+     */
+    Publisher(std::string filename, std::vector<std::string> fields, std::size_t capacity);
+    ~Publisher();
+    Publisher(const Publisher&) = delete;
+    Publisher& operator=(const Publisher&) = delete;
+
+    /**
+     * Publish the next sample, whose values are in the order of the fields.
+     */
+    void publish(const std::vector<double>& values);
+
+private:
+    char* data = nullptr;
+    std::size_t size = 0;
+    std::size_t payload = 0;
+    std::size_t slot_nbytes = 0;
+    std::size_t num_fields = 0;
+    std::size_t capacity = 0;
+    std::uint64_t count = 0;
+};
@@ -1,20 +1,34 @@
 #pragma once
 #include <vector>
-#include <queue>
+#include <deque>
 #include <memory>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <condition_variable>
 #include <future>
 #include <functional>
+#include <exception>
 #include <stdexcept>
+#include <algorithm>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 
 
 
 // ============================================================================
 /**
- * Basic thread pool implementation: https://github.com/progschj/ThreadPool.
+ * Work-stealing thread pool. Every worker owns two deques: a range of loop
+ * indices for parallel_for, and a queue of general tasks for enqueue. A worker
+ * takes work from the front of its own deques and, when they are empty,
+ * steals from the back of the other workers' deques. Each deque has its own
+ * lock, so there is no single queue that every submission and every worker
+ * contends on.
+ *
+ * Originally based on https://github.com/progschj/ThreadPool.
  */
 class ThreadPool
 {
@@ -22,9 +36,11 @@ public:
 
 
     /**
-     * Constructor. The given number of threads are started idling.
+     * Constructor. The given number of threads are started idling. If
+     * pin_threads is true, worker n is bound to logical CPU n (modulo the
+     * number of CPUs), where the platform supports it.
      */
-    ThreadPool(std::size_t num_threads);
+    ThreadPool(std::size_t num_threads, bool pin_threads=false);
 
 
     /**
@@ -35,65 +51,326 @@ public:
 
 
     /**
-     * Enqueue a job to be run, and return a promise.
+     * Return the number of worker threads.
+     */
+    std::size_t size() const;
+
+
+    /**
+     * Return true if the workers were pinned to CPUs at construction.
+     */
+    bool pinned() const;
+
+
+    /**
+     * Return the worker that parallel_for_owned assigns to index n of a loop
+     * over count indices.
+     */
+    int owner(int n, int count) const;
+
+
+    /**
+     * Return the index of the pool worker calling this function, or -1 if
+     * it's called from a thread that is not a pool worker.
+     */
+    static int current_worker();
+
+
+    /**
+     * Enqueue a job to be run, and return a promise. Unlike parallel_for,
+     * this allocates the task and its shared state, so it is not meant for
+     * the update loop.
      */
     template<class F, class... Args>
     auto enqueue(F&& f, Args&&... args) -> std::future<typename std::result_of<F(Args...)>::type>;
 
 
+    /**
+     * Call f(n) for each n in [begin, end) on the worker threads, and block
+     * until all of them have returned. The range is split into contiguous
+     * chunks, one per worker deque, and idle workers steal from the far end of
+     * busy ones. Submission does not allocate: the job is a pointer to f plus
+     * a trampoline. If any f(n) throws, the remaining indices still run, and
+     * the first exception is rethrown here. This function must not be called
+     * from inside a pool task.
+     */
+    template<class F>
+    void parallel_for(int begin, int end, F&& f);
+
+
+    /**
+     * Like parallel_for, but without stealing: index n always runs on worker
+     * owner(n - begin, end - begin). Repeated loops over the same range thus
+     * visit each index from the same thread, which keeps per-index data local
+     * to the core (and NUMA node) of its owner.
+     */
+    template<class F>
+    void parallel_for_owned(int begin, int end, F&& f);
+
+
+    /**
+     * Like parallel_for and parallel_for_owned, but worker w starts with
+     * (or, without stealing, keeps) the indices [splits[w], splits[w + 1]),
+     * e.g. to give the workers ranges of equal cost rather than of equal
+     * length. splits must hold size() + 1 non-decreasing indices.
+     */
+    template<class F>
+    void parallel_for(const std::vector<int>& splits, F&& f);
+
+    template<class F>
+    void parallel_for_owned(const std::vector<int>& splits, F&& f);
+
+
 private:
     // ========================================================================
-    std::vector<std::thread> workers;           // need to keep track of threads so we can join them
-    std::queue<std::function<void()>> tasks;    // the task queue
-    std::mutex queue_mutex;                     // synchronization
-    std::condition_variable condition;
+    struct Worker
+    {
+        std::mutex index_mutex;                 // guards [front, back) and stealable
+        int front = 0;
+        int back = 0;
+        bool stealable = true;                  // false for parallel_for_owned
+        std::mutex task_mutex;                  // guards tasks
+        std::deque<std::function<void()>> tasks;
+    };
+
+    static int& this_worker();
+    void worker_loop(std::size_t self);
+    bool run_one(std::size_t self);
+    bool pop_index(std::size_t w, bool steal, int& n);
+    bool pop_task(std::size_t w, bool steal, std::function<void()>& task);
+    void notify_work();
+
+    template<class F>
+    void run_loop(int begin, int end, F&& f, bool steal, const int* splits=nullptr);
+
+    const std::size_t num_workers;              // fixed before any thread starts
+    std::vector<std::thread> threads;
+    std::unique_ptr<Worker[]> workers;
+    std::atomic<std::size_t> next_worker;       // round-robin target for enqueue
+
+    // The active parallel_for job
+    std::mutex job_mutex;                       // one parallel_for at a time
+    void (*job_invoke)(void*, int);
+    void* job_context;
+    std::atomic<int> job_remaining;
+    std::exception_ptr job_error;
+
+    std::mutex sleep_mutex;                     // synchronization
+    std::condition_variable condition;          // wakes idle workers
+    std::condition_variable job_done;           // wakes the parallel_for caller
+    std::size_t work_epoch;
     bool stop;
+    bool is_pinned;
 };
 
 
 
 
 // ============================================================================
-inline ThreadPool::ThreadPool(std::size_t num_threads)
-: stop(false)
+inline ThreadPool::ThreadPool(std::size_t num_threads, bool pin_threads)
+: num_workers(num_threads)
+, workers(new Worker[num_threads])
+, next_worker(0)
+, job_invoke(nullptr)
+, job_context(nullptr)
+, job_remaining(0)
+, work_epoch(0)
+, stop(false)
+, is_pinned(false)
 {
+    // The workers read num_workers, never threads, which is still growing
+    // while they start.
+    threads.reserve(num_threads);
+
     for (std::size_t i = 0; i < num_threads; ++i)
     {
-        workers.emplace_back([this]
-        {
-            for(;;)
-            {
-                std::function<void()> task;
-                {
-                    std::unique_lock<std::mutex> lock(this->queue_mutex);
+        threads.emplace_back([this, i] { worker_loop(i); });
+    }
 
-                    condition.wait(lock, [this] { return stop || ! tasks.empty(); });
+#ifdef __linux__
+    if (pin_threads)
+    {
+        const std::size_t num_cpus = std::max(1u, std::thread::hardware_concurrency());
+        is_pinned = true;
 
-                    if (stop && tasks.empty())
-                    {
-                        return;
-                    }
-                    task = std::move(tasks.front());
-                    tasks.pop();
-                }
-                task();
+        for (std::size_t i = 0; i < num_threads; ++i)
+        {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(i % num_cpus, &cpus);
+
+            if (pthread_setaffinity_np(threads[i].native_handle(), sizeof(cpu_set_t), &cpus) != 0)
+            {
+                is_pinned = false;
             }
-        });
+        }
     }
+#else
+    (void) pin_threads;
+#endif
 }
 
 inline ThreadPool::~ThreadPool()
 {
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
+        std::unique_lock<std::mutex> lock(sleep_mutex);
         stop = true;
     }
     condition.notify_all();
 
-    for (auto &worker: workers)
+    for (auto &thread: threads)
+    {
+        thread.join();
+    }
+}
+
+inline std::size_t ThreadPool::size() const
+{
+    return num_workers;
+}
+
+inline bool ThreadPool::pinned() const
+{
+    return is_pinned;
+}
+
+inline int ThreadPool::owner(int n, int count) const
+{
+    int w = 0;
+
+    while (w + 1 < int(num_workers) && long(count) * (w + 1) / long(num_workers) <= n)
+    {
+        ++w;
+    }
+    return w;
+}
+
+inline int ThreadPool::current_worker()
+{
+    return this_worker();
+}
+
+inline int& ThreadPool::this_worker()
+{
+    static thread_local int index = -1;
+    return index;
+}
+
+inline void ThreadPool::worker_loop(std::size_t self)
+{
+    this_worker() = int(self);
+
+    for (;;)
+    {
+        std::size_t epoch;
+        {
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            epoch = work_epoch;
+        }
+
+        while (run_one(self))
+        {
+        }
+
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+
+        condition.wait(lock, [this, epoch] { return stop || work_epoch != epoch; });
+
+        if (stop && work_epoch == epoch)
+        {
+            return;
+        }
+    }
+}
+
+inline bool ThreadPool::run_one(std::size_t self)
+{
+    int n;
+    std::function<void()> task;
+
+    for (std::size_t k = 0; k < num_workers; ++k)
+    {
+        const std::size_t w = (self + k) % num_workers;
+
+        if (pop_index(w, k != 0, n))
+        {
+            try {
+                job_invoke(job_context, n);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(sleep_mutex);
+
+                if (! job_error)
+                {
+                    job_error = std::current_exception();
+                }
+            }
+
+            if (--job_remaining == 0)
+            {
+                std::lock_guard<std::mutex> lock(sleep_mutex);
+                job_done.notify_all();
+            }
+            return true;
+        }
+    }
+
+    for (std::size_t k = 0; k < num_workers; ++k)
     {
-        worker.join();
+        const std::size_t w = (self + k) % num_workers;
+
+        if (pop_task(w, k != 0, task))
+        {
+            task();
+            return true;
+        }
     }
+    return false;
+}
+
+inline bool ThreadPool::pop_index(std::size_t w, bool steal, int& n)
+{
+    std::lock_guard<std::mutex> lock(workers[w].index_mutex);
+
+    // The flag is set with the range, under the same lock, so a worker can
+    // never steal an owned index on the strength of a previous job's flag.
+    if (workers[w].front == workers[w].back || (steal && ! workers[w].stealable))
+    {
+        return false;
+    }
+    n = steal ? --workers[w].back : workers[w].front++;
+    return true;
+}
+
+inline bool ThreadPool::pop_task(std::size_t w, bool steal, std::function<void()>& task)
+{
+    std::lock_guard<std::mutex> lock(workers[w].task_mutex);
+
+    if (workers[w].tasks.empty())
+    {
+        return false;
+    }
+    if (steal)
+    {
+        task = std::move(workers[w].tasks.back());
+        workers[w].tasks.pop_back();
+    }
+    else
+    {
+        task = std::move(workers[w].tasks.front());
+        workers[w].tasks.pop_front();
+    }
+    return true;
+}
+
+inline void ThreadPool::notify_work()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        ++work_epoch;
+    }
+    condition.notify_all();
 }
 
 template<class F, class... Args>
@@ -106,14 +383,107 @@ auto ThreadPool::enqueue(F&& f, Args&&... args) -> std::future<typename std::res
 
     std::future<return_type> res = task->get_future();
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
+        std::unique_lock<std::mutex> lock(sleep_mutex);
 
         if (stop)
         {
             throw std::runtime_error("enqueue on stopped ThreadPool");
         }
-        tasks.emplace([task] { (*task)(); });
     }
-    condition.notify_one();
+
+    if (num_workers == 0)
+    {
+        throw std::runtime_error("enqueue on ThreadPool with no threads");
+    }
+
+    auto& worker = workers[next_worker++ % num_workers];
+    {
+        std::lock_guard<std::mutex> lock(worker.task_mutex);
+        worker.tasks.emplace_back([task] { (*task)(); });
+    }
+    notify_work();
     return res;
 }
+
+template<class F>
+void ThreadPool::parallel_for(int begin, int end, F&& f)
+{
+    run_loop(begin, end, std::forward<F>(f), true);
+}
+
+template<class F>
+void ThreadPool::parallel_for_owned(int begin, int end, F&& f)
+{
+    run_loop(begin, end, std::forward<F>(f), false);
+}
+
+template<class F>
+void ThreadPool::parallel_for(const std::vector<int>& splits, F&& f)
+{
+    if (splits.size() != std::max(num_workers, std::size_t(1)) + 1)
+    {
+        throw std::invalid_argument("parallel_for: splits must have one more entry than there are workers");
+    }
+    run_loop(splits.front(), splits.back(), std::forward<F>(f), true, splits.data());
+}
+
+template<class F>
+void ThreadPool::parallel_for_owned(const std::vector<int>& splits, F&& f)
+{
+    if (splits.size() != std::max(num_workers, std::size_t(1)) + 1)
+    {
+        throw std::invalid_argument("parallel_for_owned: splits must have one more entry than there are workers");
+    }
+    run_loop(splits.front(), splits.back(), std::forward<F>(f), false, splits.data());
+}
+
+template<class F>
+void ThreadPool::run_loop(int begin, int end, F&& f, bool steal, const int* splits)
+{
+    using Callable = typename std::remove_reference<F>::type;
+
+    if (end <= begin)
+    {
+        return;
+    }
+
+    if (num_workers == 0)
+    {
+        for (int n = begin; n < end; ++n)
+        {
+            f(n);
+        }
+        return;
+    }
+
+    std::lock_guard<std::mutex> job_lock(job_mutex);
+
+    const int count = end - begin;
+
+    job_invoke = [] (void* context, int n) { (*static_cast<Callable*>(context))(n); };
+    job_context = const_cast<void*>(static_cast<const void*>(&f));
+    job_remaining = count;
+    job_error = nullptr;
+
+    for (int w = 0; w < int(num_workers); ++w)
+    {
+        std::lock_guard<std::mutex> lock(workers[w].index_mutex);
+        workers[w].front = splits ? splits[w + 0] : begin + int(long(count) * (w + 0) / long(num_workers));
+        workers[w].back  = splits ? splits[w + 1] : begin + int(long(count) * (w + 1) / long(num_workers));
+        workers[w].stealable = steal;
+    }
+    notify_work();
+
+    std::unique_lock<std::mutex> lock(sleep_mutex);
+    job_done.wait(lock, [this] { return job_remaining == 0; });
+
+    job_invoke = nullptr;
+    job_context = nullptr;
+
+    if (job_error)
+    {
+        auto error = job_error;
+        job_error = nullptr;
+        std::rethrow_exception(error);
+    }
+}
@@ -1,4 +1,7 @@
 #pragma once
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include "ndarray.hpp"
 
 
@@ -74,8 +77,39 @@ namespace ufunc {
         template <typename, typename, std::size_t, std::size_t> struct Vfunc1;
         template <typename, typename, std::size_t, std::size_t, std::size_t> struct Vfunc2;
         template <typename, typename, std::size_t, std::size_t, std::size_t, std::size_t> struct Vfunc3;
+
+        struct ExpressionTag {};
+        template <typename ArrayType> struct Leaf;
+        template <typename Callable, typename T, typename... Args> struct Expression;
+
+        template <typename E>
+        using is_expression = std::is_base_of<ExpressionTag, E>;
+
+        template <typename... E> struct all_expressions : std::true_type {};
+
+        template <typename E, typename... Rest> struct all_expressions<E, Rest...>
+        : std::integral_constant<bool, is_expression<E>::value && all_expressions<Rest...>::value>
+        {
+        };
+
+        template <typename E>
+        using enable_if_eager = typename std::enable_if<! is_expression<E>::value>::type;
+
+        template <std::size_t Arity, typename... Args>
+        using enable_if_lazy = typename std::enable_if<sizeof...(Args) == Arity && all_expressions<Args...>::value>::type;
     }
 
+    /**
+     * Wrap an array as the leaf of a lazy expression. A scalar ufunc (from)
+     * called on expressions does not compute anything, but returns a larger
+     * expression, so that a chain of calls is evaluated in a single pass over
+     * the leaves when it is assigned to an nd::array, with no intermediate
+     * arrays. The leaves are held by reference, and must outlive the
+     * expression; wrapping a temporary is a compile error.
+     */
+    template<typename ArrayType> auto lazy(const ArrayType& A);
+    template<typename ArrayType> void lazy(const ArrayType&& A) = delete;
+
     template<typename Callable> auto from(Callable f, typename std::enable_if<detail::function_traits<Callable>::arity == 1>::type* = nullptr);
     template<typename Callable> auto from(Callable f, typename std::enable_if<detail::function_traits<Callable>::arity == 2>::type* = nullptr);
     template<typename Callable> auto from(Callable f, typename std::enable_if<detail::function_traits<Callable>::arity == 3>::type* = nullptr);
@@ -95,7 +129,13 @@ struct ufunc::detail::Ufunc1
 {
     Ufunc1(Callable F) : F(F) {}
 
-    template <typename ArrayType>
+    template <typename... E, typename = enable_if_lazy<1, E...>>
+    inline auto operator()(const E&... e) const
+    {
+        return Expression<Callable, T, E...>(F, e...);
+    }
+
+    template <typename ArrayType, typename = enable_if_eager<ArrayType>>
     inline auto operator()(const ArrayType& A) const
     {
         auto R = nd::array<T, ArrayType::rank>(A.shape());
@@ -120,7 +160,13 @@ struct ufunc::detail::Ufunc2
 {
     Ufunc2(Callable F) : F(F) {}
 
-    template <typename ArrayType>
+    template <typename... E, typename = enable_if_lazy<2, E...>>
+    inline auto operator()(const E&... e) const
+    {
+        return Expression<Callable, T, E...>(F, e...);
+    }
+
+    template <typename ArrayType, typename = enable_if_eager<ArrayType>>
     inline auto operator()(const ArrayType& A, const ArrayType& B) const
     {
         throw_unless_same(A.shape(), B.shape());
@@ -148,7 +194,13 @@ struct ufunc::detail::Ufunc3
 {
     Ufunc3(Callable F) : F(F) {}
 
-    template <typename ArrayType>
+    template <typename... E, typename = enable_if_lazy<3, E...>>
+    inline auto operator()(const E&... e) const
+    {
+        return Expression<Callable, T, E...>(F, e...);
+    }
+
+    template <typename ArrayType, typename = enable_if_eager<ArrayType>>
     inline auto operator()(const ArrayType& A, const ArrayType& B, const ArrayType& C) const
     {
         throw_unless_same(A.shape(), B.shape());
@@ -330,6 +382,111 @@ struct ufunc::detail::Vfunc3
 
 
 
+// ============================================================================
+template <typename ArrayType>
+struct ufunc::detail::Leaf : ExpressionTag
+{
+    static constexpr auto rank = ArrayType::rank;
+
+    Leaf(const ArrayType& A) : A(A) {}
+
+    auto shape() const { return A.shape(); }
+    auto begin() const { return A.begin(); }
+
+    const ArrayType& A;
+};
+
+
+
+
+// ============================================================================
+/**
+ * A scalar function of the elements of its argument expressions. A cursor
+ * over the expression advances one cursor per leaf, and dereferencing it
+ * evaluates the whole tree at that element, so the tree is one fused loop.
+ */
+template <typename Callable, typename T, typename... Args>
+struct ufunc::detail::Expression : ExpressionTag
+{
+    static constexpr auto rank = std::tuple_element<0, std::tuple<Args...>>::type::rank;
+    using Indexes = std::index_sequence_for<Args...>;
+
+    struct Cursor
+    {
+        T operator*() const
+        {
+            return apply(Indexes());
+        }
+
+        Cursor& operator++()
+        {
+            increment(Indexes());
+            return *this;
+        }
+
+        template <std::size_t... I>
+        T apply(std::index_sequence<I...>) const
+        {
+            return F(*std::get<I>(cursors)...);
+        }
+
+        template <std::size_t... I>
+        void increment(std::index_sequence<I...>)
+        {
+            (void) std::initializer_list<int>{(++std::get<I>(cursors), 0)...};
+        }
+
+        const Callable& F;
+        std::tuple<decltype(std::declval<const Args&>().begin())...> cursors;
+    };
+
+    Expression(Callable F, const Args&... args) : F(F), args(args...)
+    {
+        check_shapes(Indexes());
+    }
+
+    auto shape() const { return std::get<0>(args).shape(); }
+    auto begin() const { return begin(Indexes()); }
+
+    /**
+     * Evaluate the expression into a new array, in one pass.
+     */
+    nd::array<T, rank> evaluate() const
+    {
+        auto R = nd::array<T, rank>(shape());
+        auto c = begin();
+
+        for (auto r = R.begin(); r != R.end(); ++r, ++c)
+        {
+            *r = *c;
+        }
+        return R;
+    }
+
+    operator nd::array<T, rank>() const
+    {
+        return evaluate();
+    }
+
+    template <std::size_t... I>
+    Cursor begin(std::index_sequence<I...>) const
+    {
+        return {F, std::make_tuple(std::get<I>(args).begin()...)};
+    }
+
+    template <std::size_t... I>
+    void check_shapes(std::index_sequence<I...>) const
+    {
+        (void) std::initializer_list<int>{(throw_unless_same(shape(), std::get<I>(args).shape()), 0)...};
+    }
+
+    Callable F;
+    std::tuple<Args...> args;
+};
+
+
+
+
 // ============================================================================
 template<typename Callable>
 auto ufunc::from(Callable f, typename std::enable_if<detail::function_traits<Callable>::arity == 1>::type*)
@@ -382,3 +539,9 @@ auto ufunc::vfrom(Callable f, typename std::enable_if<detail::function_traits<Ca
     constexpr std::size_t ArgSize3 = typename detail::function_traits<Callable>::template arg<2>::type().size();
     return detail::Vfunc3<Callable, double, ResSize, ArgSize1, ArgSize2, ArgSize3>(f);
 }
+
+template<typename ArrayType>
+auto ufunc::lazy(const ArrayType& A)
+{
+    return detail::Leaf<ArrayType>(A);
+}